@@ -1,3 +1,5 @@
+#define _GNU_SOURCE /* for fallocate() */
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,10 +21,77 @@ struct disk {
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Block size */
+	size_t bsize;
+	/* Size of the disk image in bytes */
+	off_t size;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = { .fd = INVALID_FD, .bsize = BLOCK_SIZE };
+
+static int block_size_valid(size_t bsize)
+{
+	return bsize >= BLOCK_SIZE_MIN && bsize <= BLOCK_SIZE_MAX &&
+		!(bsize & (bsize - 1));
+}
+
+int block_disk_create(const char *diskname, size_t bcount, size_t bsize)
+{
+	int fd;
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return -1;
+	}
+
+	if (!block_size_valid(bsize)) {
+		block_error("invalid block size '%zu'", bsize);
+		return -1;
+	}
+
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
+
+	/* Blocks that are never written read back as zeros */
+	if (ftruncate(fd, bcount * bsize)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+int block_disk_set_block_size(size_t bsize)
+{
+	if (!block_size_valid(bsize)) {
+		block_error("invalid block size '%zu'", bsize);
+		return -1;
+	}
+
+	if (disk.fd != INVALID_FD) {
+		if (disk.size % bsize != 0) {
+			block_error("size '%zu' is not multiple of '%zu'",
+				    (size_t)disk.size, bsize);
+			return -1;
+		}
+		disk.bcount = disk.size / bsize;
+	}
+
+	disk.bsize = bsize;
+
+	return 0;
+}
+
+size_t block_disk_block_size(void)
+{
+	return disk.bsize;
+}
 
 int block_disk_open(const char *diskname)
 {
@@ -46,18 +115,21 @@ int block_disk_open(const char *diskname)
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
+		close(fd);
 		return -1;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
-	if (st.st_size % BLOCK_SIZE != 0) {
-		block_error("size '%zu' is not multiple of '%d'",
-			    st.st_size, BLOCK_SIZE);
+	if (st.st_size % disk.bsize != 0) {
+		block_error("size '%zu' is not multiple of '%zu'",
+			    st.st_size, disk.bsize);
+		close(fd);
 		return -1;
 	}
 
 	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	disk.size = st.st_size;
+	disk.bcount = st.st_size / disk.bsize;
 
 	return 0;
 }
@@ -72,6 +144,7 @@ int block_disk_close(void)
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
+	disk.bsize = BLOCK_SIZE;
 
 	return 0;
 }
@@ -99,15 +172,12 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
-
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/*
+	 * Perform the actual write into the disk image, at the offset of the
+	 * specified block and without moving a shared file offset
+	 */
+	if (pwrite(disk.fd, buf, disk.bsize, block * disk.bsize) < 0) {
+		perror("pwrite");
 		return -1;
 	}
 
@@ -127,18 +197,114 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	/*
+	 * Perform the actual read from the disk image, at the offset of the
+	 * specified block and without moving a shared file offset
+	 */
+	if (pread(disk.fd, buf, disk.bsize, block * disk.bsize) < 0) {
+		perror("pread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int block_range_valid(size_t block, size_t count)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return 0;
+	}
+
+	if (block > disk.bcount || count > disk.bcount - block) {
+		block_error("block range out of bounds (%zu+%zu/%zu)",
+			    block, count, disk.bcount);
+		return 0;
+	}
+
+	return 1;
+}
+
+int block_write_many(size_t block, size_t count, const void *buf)
+{
+	const char *pos = buf;
+	size_t left = count * disk.bsize;
+	off_t offset = block * disk.bsize;
+
+	if (!block_range_valid(block, count))
 		return -1;
+
+	/* One system call for the whole range, unless it gets interrupted */
+	while (left) {
+		ssize_t ret = pwrite(disk.fd, pos, left, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pwrite");
+			return -1;
+		}
+		pos += ret;
+		left -= ret;
+		offset += ret;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return 0;
+}
+
+int block_read_many(size_t block, size_t count, void *buf)
+{
+	char *pos = buf;
+	size_t left = count * disk.bsize;
+	off_t offset = block * disk.bsize;
+
+	if (!block_range_valid(block, count))
 		return -1;
+
+	while (left) {
+		ssize_t ret = pread(disk.fd, pos, left, offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+		pos += ret;
+		left -= ret;
+		offset += ret;
 	}
 
 	return 0;
 }
 
+int block_disk_sync(void)
+{
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (fdatasync(disk.fd)) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+int block_discard(size_t block, size_t count)
+{
+	if (!block_range_valid(block, count))
+		return -1;
+
+	/* Not every file system can punch holes, the caller falls back */
+	if (fallocate(disk.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      block * disk.bsize, count * disk.bsize))
+		return -1;
+
+	return 0;
+}
+
@@ -3,9 +3,15 @@
 
 #include <stddef.h> /* for size_t definition */
 
-/** Size of a disk block in bytes */
+/** Default size of a disk block in bytes */
 #define BLOCK_SIZE 4096
 
+/** Smallest supported disk block size in bytes */
+#define BLOCK_SIZE_MIN 512
+
+/** Largest supported disk block size in bytes */
+#define BLOCK_SIZE_MAX 65536
+
 /**
  * block_disk_open - Open virtual disk file
  * @diskname: Name of the virtual disk file
@@ -34,13 +40,51 @@ int block_disk_close(void);
  */
 int block_disk_count(void);
 
+/**
+ * block_disk_create - Create a virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the new disk
+ * @bsize: Size of a block in bytes
+ *
+ * Create (or truncate) virtual disk file @diskname so that it holds @bcount
+ * zeroed blocks of @bsize bytes. The disk is not left open.
+ *
+ * Return: -1 if @diskname is invalid, if @bsize is not a supported block size,
+ * or if the file cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount, size_t bsize);
+
+/**
+ * block_disk_set_block_size - Set the block size of the virtual disk
+ * @bsize: Size of a block in bytes
+ *
+ * Set the size of the blocks transferred by block_read() and block_write().
+ * @bsize must be a power of two between %BLOCK_SIZE_MIN and %BLOCK_SIZE_MAX.
+ * If a virtual disk file is currently open, its size must be a multiple of
+ * @bsize and its block count is updated accordingly; otherwise @bsize is used
+ * by the next block_disk_open(). The block size is reset to %BLOCK_SIZE when
+ * the disk is closed.
+ *
+ * Return: -1 if @bsize is not a supported block size, or if the size of the
+ * currently open virtual disk file is not a multiple of @bsize. 0 otherwise.
+ */
+int block_disk_set_block_size(size_t bsize);
+
+/**
+ * block_disk_block_size - Get disk's block size
+ *
+ * Return: The size in bytes of the blocks transferred by block_read() and
+ * block_write().
+ */
+size_t block_disk_block_size(void);
+
 /**
  * block_write - Write a block to disk
  * @block: Index of the block to write to
  * @buf: Data buffer to write in the block
  *
- * Write the content of buffer @buf (%BLOCK_SIZE bytes) in the virtual disk's
- * block @block.
+ * Write the content of buffer @buf (one block, see block_disk_block_size()) in
+ * the virtual disk's block @block.
  *
  * Return: -1 if @block is out of bounds or inaccessible or if the writing
  * operation fails. 0 otherwise.
@@ -52,13 +96,66 @@ int block_write(size_t block, const void *buf);
  * @block: Index of the block to read from
  * @buf: Data buffer to be filled with content of block
  *
- * Read the content of virtual disk's block @block (%BLOCK_SIZE bytes) into
- * buffer @buf.
+ * Read the content of virtual disk's block @block (one block, see
+ * block_disk_block_size()) into buffer @buf.
  *
  * Return: -1 if @block is out of bounds or inaccessible, or if the reading
  * operation fails. 0 otherwise.
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_many - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count blocks) in the virtual disk's
+ * blocks @block to @block + @count - 1, with as few system calls as possible.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_many(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_many - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of the virtual disk's blocks @block to @block + @count - 1
+ * into buffer @buf, with as few system calls as possible.
+ *
+ * Return: -1 if the range is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_many(size_t block, size_t count, void *buf);
+
+/**
+ * block_disk_sync - Flush the virtual disk to stable storage
+ *
+ * Wait until every block written so far to the virtual disk file is on stable
+ * storage.
+ *
+ * Return: -1 if there was no virtual disk file opened, or if the flush fails.
+ * 0 otherwise.
+ */
+int block_disk_sync(void);
+
+/**
+ * block_discard - Release blocks from the disk image
+ * @block: Index of the first block to release
+ * @count: Number of blocks to release
+ *
+ * Punch a hole in the virtual disk file over @count blocks starting at block
+ * @block, so that the host file system frees the space they use. The size of
+ * the disk does not change and the blocks read back as zeros.
+ *
+ * Return: -1 if the range is out of bounds, or if the host file system cannot
+ * punch holes. 0 otherwise.
+ */
+int block_discard(size_t block, size_t count);
+
 #endif /* _DISK_H */
 
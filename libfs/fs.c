@@ -1,20 +1,34 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)||defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include "disk.h"
 #include "fs.h"
 
 
-#pragma pack(1)
-
-
 #define my_min(x,y)     ( ((x)>=(y))?y:x )
+#define my_max(x,y)     ( ((x)>=(y))?x:y )
 #define FAT_EOC         (0xFFFF)
 #define DEFAULT_SIGN    ("ECS150FS")
 
+//shift of the default block size, stored as 0 in the super block
+#define BLOCK_SHIFT_DEFAULT     (12)
+#define BLOCK_SHIFT_MIN         (9)
+#define BLOCK_SHIFT_MAX         (16)
+
+#pragma pack(push, 1)
+
+//only the first BLOCK_SIZE_MIN bytes of block 0 are used by the super block,
+//the rest of it is padding whatever the block size is
 typedef struct _super_block_info_s_{
     char sign[8];
     uint16_t block_num_total;
@@ -22,658 +36,6091 @@ typedef struct _super_block_info_s_{
     uint16_t data_block_idx;
     uint16_t data_block_num;
     uint8_t fat_block_num;
-    uint8_t reserve[4079];
+    uint8_t block_shift;    //log2 of block size, 0 for BLOCK_SIZE
+    uint16_t refcnt_block_idx;  //first data block of the refcount table, 0 if none
+    uint16_t snapshot_block_idx;    //first data block of the snapshot, 0 if none
+    uint16_t journal_block_idx; //first data block of the journal, 0 if none
+    uint16_t journal_block_num; //the journal is a run of data blocks
+    uint16_t csum_block_idx;    //first data block of the checksum table, 0 if none
+    uint8_t reserve[BLOCK_SIZE_MIN-28];
 }Super_Block_Info;
 
 typedef struct _FAT_info_s_{
     uint16_t* data;
+    uint32_t free_num;      //free entries
+    uint32_t free_hint;     //no free entry below this one
 }FAT_Info;
 
 typedef struct _file_entry_s_{
     char filename[FS_FILENAME_LEN];
     uint32_t file_size;
     uint16_t start_data_block_idx;
-    uint8_t reserve[10];
+    uint8_t flags;          //FE_FLAG_*
+    uint16_t frag_off;      //offset in its fragment block of a packed file
+    uint8_t reserve[7];
 }File_Entry;
 
 typedef struct _root_dir_info_s_{
     File_Entry files[FS_FILE_MAX_COUNT];
 }Root_Dir_Info;
 
-typedef struct _data_block_s_{
-    uint8_t data[BLOCK_SIZE];
-}Data_Block;
+//head of a journal transaction, followed by the new content of the blocks
+//listed; may span several blocks. The first block of the journal holds a head
+//with a super block signature and no blocks, whose seq is the first
+//transaction to replay
+typedef struct _journal_head_s_{
+    char sign[8];
+    uint32_t seq;
+    uint32_t count;     //blocks in the transaction
+    uint32_t checksum;  //FNV-1a of the head, with this field zero, and of the blocks
+    uint16_t blocks[];  //home of each block
+}Journal_Head;
+
+#pragma pack(pop)
+
+//file entry flags
+#define FE_FLAG_MAPPED  (0x01)  //chain of map blocks, the file may have holes
+#define FE_FLAG_COMPRESSED (0x02)  //blocks hold a stream of compressed clusters
+#define FE_FLAG_PACKED  (0x04)  //data in slots of a fragment block shared with other files
 
+#define HUGE_PAGE_SIZE  ((size_t)2 << 20)
+
+//frame table flags
+#define FRAME_DIRTY     (0x01)  //differs from the disk
+#define FRAME_BAD       (0x02)  //failed its checksum when loaded
+#define FRAME_NOSUM     (0x04)  //holds the checksum table, not checksummed
+#define FRAME_VERIFY    (0x08)  //to check against its checksum
+#define FRAME_DEDUP     (0x10)  //in the dedup index, under its hash
+
+//cache of all the data blocks, carved out of one arena: the frame of data
+//block i is at arena + (i << g_blockShift)
 typedef struct _all_data_block_s_{
-    Data_Block** data_all;
+    uint8_t* arena;
+    size_t arena_len;
+    uint8_t* flags;     //frame table, one entry per data block
 }All_Data_Block;
 
+//in-core inode, shared by all the descriptors of a file while it is open
+typedef struct _inode_s_{
+    uint16_t idx;           //entry in root dir
+    uint32_t refcnt;        //open descriptors
+    uint32_t size;          //cached file_size
+    uint16_t* blocks;       //block map, logical block -> data block
+    uint32_t block_num;     //length of the FAT chain, or up to the last mapped block
+    uint32_t block_cap;
+    uint16_t tail_block;    //last block, pinned while appends fill it, 0 if none
+    uint8_t mapped;         //blocks found through map blocks, 0 is a hole
+    uint16_t* map_blocks;   //chain of map blocks of a mapped file
+    uint32_t map_num;
+    uint32_t map_cap;
+    uint8_t packed;         //data in slots of a fragment block, no block of its own
+    uint8_t compressed;     //content in clusters, the blocks hold them compressed
+    uint8_t** zcl;          //content of each cluster, NULL until first used
+    uint8_t* zcl_dirty;     //cluster changed since stored
+    uint32_t zcl_cap;
+    uint32_t* zoff;         //offset of each stored cluster in the stream, then its
+                            //end, NULL until indexed
+    uint32_t zsize;         //size the stream holds
+    uint32_t zstored;       //clusters of the stream still in the file
+    uint32_t zdirty;        //first cluster changed since stored, UINT32_MAX if none
+    pthread_mutex_t lock;   //serializes reads and writes on the file
+}Inode;
+
 typedef struct _file_des_s_{
-    uint16_t idx;
+    Inode* ino;
     uint32_t offset;
+    uint8_t in_use;
+    uint8_t flags;      //FS_O_* flags given to fs_open_flags()
+    uint8_t wcombine;   //defer write-back of partially written blocks
+    uint16_t wc_block;  //block with a deferred write-back, 0 if none
+    int32_t next_free;  //next free descriptor while not in use
 }File_Des;
 
+//descriptors are carved out of chunks that never move, so a File_Des* stays
+//valid while the table grows
+#define FD_CHUNK_SHIFT  (6)
+#define FD_CHUNK_LEN    (1 << FD_CHUNK_SHIFT)
+
+//extra owners of each data block, 0 for a block owned by one file or by the
+//snapshot only. Kept in a chain of data blocks, loaded at mount and stored
+//back on sync
+typedef struct _refcnt_info_s_{
+    uint16_t* data;     //one entry per data block, NULL while nothing is shared
+    uint8_t dirty;
+}Refcnt_Info;
+
+//CRC32C of every data block, kept in a chain of data blocks
+typedef struct _csum_info_s_{
+    uint32_t* data;     //one entry per data block, NULL without a checksum table
+    uint8_t dirty;
+    uint32_t bad_num;   //blocks that failed their checksum at mount
+}Csum_Info;
+
+//a fragment block and the slots its packed files use
+typedef struct _frag_s_{
+    uint16_t block_idx;     //0 for an unused entry
+    uint16_t owners;        //packed files in the block
+    uint64_t used;          //one bit per slot
+}Frag;
+
+//blocks of mapped files by content, hashed with open addressing
+typedef struct _dedup_index_s_{
+    uint32_t* hash;     //one entry per data block, for blocks flagged FRAME_DEDUP
+    uint16_t* table;    //blocks by hash, 0 for an empty slot, NULL until used
+    uint32_t mask;
+}Dedup_Index;
+
+typedef struct _csum_kernel_s_{
+    uint32_t (*one)(const uint8_t* data, uint32_t len);
+    //three blocks at once
+    void (*three)(const uint8_t* const data[3], uint32_t len, uint32_t crcs[3]);
+}Csum_Kernel;
+
+//freed blocks handed to the disk layer in runs
+typedef struct _free_run_s_{
+    uint16_t start;
+    uint32_t len;
+}Free_Run;
+
+//scrub map flags
+#define SCRUB_PENDING   (0x01)  //freed, waits to be zeroed on disk by the scrubber
+#define SCRUB_STALE     (0x02)  //freed and zeroed on disk, not in the cache
+
+//background zeroing of freed blocks: a block flagged SCRUB_PENDING belongs to
+//the scrubber until it is zeroed or allocated again, both under the lock
+typedef struct _scrub_info_s_{
+    pthread_t thread;
+    pthread_mutex_t lock;   //guards the scrub map and the pending frames
+    pthread_cond_t cond;
+    uint8_t* map;           //SCRUB_* flags, one entry per data block
+    uint32_t pending_num;   //blocks flagged SCRUB_PENDING
+    uint32_t cursor;        //where the scrubber looks first
+    uint8_t running;
+    uint8_t stop;           //drain the pending blocks and exit
+}Scrub_Info;
+
+#define JOURNAL_SIGN        ("ECSJRNL")
+#define JOURNAL_SUPER_SIGN  ("ECSJSUP")
+#define COMMIT_INTERVAL_DEFAULT (5)     //ms
+
+//metadata journal: commits come from the main thread, checkpoints from a
+//background thread, both under the lock
+typedef struct _journal_info_s_{
+    pthread_t thread;
+    pthread_mutex_t lock;   //guards the journal and the buffers below
+    pthread_cond_t cond;
+    uint16_t first_block;   //disk block of the journal super block
+    uint32_t block_num;
+    uint32_t meta_num;      //metadata blocks: super block, FAT and root dir
+    uint32_t head;          //where the next transaction goes
+    uint32_t seq;           //sequence number of the next transaction
+    uint8_t* shadow;        //metadata as of the last commit
+    uint8_t* stage;         //metadata being committed
+    uint8_t* txn;           //transaction being written
+    uint8_t* home_dirty;    //committed blocks not written home yet, one entry per metadata block
+    uint16_t* freed;        //blocks freed since the last commit, still in use on disk
+    uint32_t freed_num;
+    uint32_t freed_cap;
+    uint32_t freed_done;    //the first ones, freed by finished operations
+    struct timespec last_commit;
+    uint8_t pending;        //operations since the last commit
+    uint8_t running;
+    uint8_t stop;           //checkpoint and exit
+}Journal_Info;
+
+//batch operations
+#define BATCH_CREATE    (0)
+#define BATCH_DELETE    (1)
+#define BATCH_RENAME    (2)
+#define BATCH_TRUNCATE  (3)
+
+typedef struct _batch_op_s_{
+    uint8_t type;       //BATCH_*
+    char filename[FS_FILENAME_LEN];
+    char new_filename[FS_FILENAME_LEN];     //BATCH_RENAME only
+    uint32_t length;    //BATCH_TRUNCATE only
+}Batch_Op;
+
+//operations recorded since fs_batch_begin()
+typedef struct _batch_info_s_{
+    Batch_Op* ops;
+    uint32_t op_num;
+    uint32_t op_cap;
+    uint8_t open;
+}Batch_Info;
+
+//FAT scans, in scalar code or with the widest vector instructions the CPU has
+typedef struct _fat_scan_s_{
+    uint32_t (*count_zero)(const uint16_t* data, uint32_t len);
+    //index of the first zero, or non-zero, entry from start, len if none
+    uint32_t (*find_zero)(const uint16_t* data, uint32_t start, uint32_t len);
+    uint32_t (*find_nonzero)(const uint16_t* data, uint32_t start, uint32_t len);
+    //links to limit and beyond, other than FAT_EOC
+    uint32_t (*count_bad)(const uint16_t* data, uint32_t len, uint16_t limit);
+}Fat_Scan;
+
+//consistency check, see fs_fsck()
+#define FSCK_THREAD_MAX (64)
+
+typedef struct _fsck_info_s_{
+    const Root_Dir_Info* roots[2];  //root dir, then the snapshot's if any
+    const uint16_t* fats[2];
+    uint32_t root_num;
+    uint32_t* claims;       //owners found for each block
+    uint32_t thread_num;
+}Fsck_Info;
+
+typedef struct _fsck_task_s_{
+    pthread_t thread;
+    uint32_t id;
+    Fsck_Info* info;
+    uint32_t* stamps;       //last chain walked through each block, to find loops
+    size_t bad_chains;
+    size_t bad_sizes;
+    size_t cross_links;
+    size_t leaks;
+    size_t bad_refcnts;
+    size_t bad_entries;
+}Fsck_Task;
+
+typedef struct _fd_table_s_{
+    File_Des** chunks;
+    uint32_t chunk_num;
+    uint32_t slot_num;  //descriptors carved out so far
+    int32_t free_head;  //LIFO list of closed descriptors, -1 if empty
+}FD_Table;
+
 
 static Super_Block_Info g_superBlockInfo = {0};
+static uint32_t g_blockSize = BLOCK_SIZE;
+static uint8_t g_blockShift = BLOCK_SHIFT_DEFAULT;
+static uint8_t* g_blockBuf = NULL; //one block of scratch space
 static uint32_t g_FATLen = 0;
 static FAT_Info g_FATInfo = {0};
 static Root_Dir_Info g_rootDirInfo = {0};
 static All_Data_Block g_all_data = {0};
 uint16_t g_fileNumTotal = 0;
-static File_Des* g_openedFiles[FS_OPEN_MAX_COUNT] = {0};
-static uint16_t g_openedFileNum = 0;
+static Inode g_inodes[FS_FILE_MAX_COUNT] = {{0}};
+static FD_Table g_openedFiles = { .free_head = -1 };
+static uint32_t g_openedFileNum = 0;
+static uint32_t g_openMax = FS_OPEN_MAX_COUNT;
+static uint8_t g_hugePages = 0;
+static uint8_t g_writeCombine = 0;
+static uint8_t g_punchHole = 0;
+static uint8_t g_scrub = 0;
+static uint8_t g_fatSimd = 1;
+static Fat_Scan g_fatScan = {0};
+static uint8_t g_checksum = 0;
+static Csum_Info g_csum = {0};
+static uint8_t g_dedup = 0;
+static uint8_t g_pack = 0;
+static Frag g_frags[FS_FILE_MAX_COUNT];     //at most one fragment block per file
+static Dedup_Index g_dedupIndex = {0};
+static Csum_Kernel g_csumKernel = {0};
+static Free_Run g_freeRun = {0};
+static Refcnt_Info g_refcnt = {0};
+static Scrub_Info g_scrubInfo = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+static uint32_t g_journalSize = 0;
+static uint32_t g_commitInterval = COMMIT_INTERVAL_DEFAULT;
+static Journal_Info g_journal = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static pthread_mutex_t g_opLock = PTHREAD_MUTEX_INITIALIZER;
+static Batch_Info g_batch = {0};
 static int8_t g_mounted_flag = 0;
 
 
-static uint16_t _get_fs_file_num(void)
+/*
+ * FAT scan kernels. The vector versions compare a vector of entries at once and
+ * turn the result into a bit mask, two bits per entry; the tail is left to the
+ * scalar versions. _fat_scan_init() picks them once per mount.
+ */
+static uint32_t _scan_count_zero(const uint16_t* data, uint32_t len)
 {
-    uint16_t cnt = 0;
-    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
-        if(0 != g_rootDirInfo.files[idx].start_data_block_idx){
-            cnt++;
-        }
+    uint32_t cnt = 0;
+    for(uint32_t idx = 0; idx < len; ++idx){
+        cnt += (0 == data[idx]);
     }
-
     return cnt;
 }
 
-static uint16_t _get_free_FAT_num(void)
+static uint32_t _scan_find_zero(const uint16_t* data, uint32_t start, uint32_t len)
 {
-    uint16_t cnt = 0;
-    for(uint16_t idx = 0; idx < g_FATLen; ++idx){
-        if(0 == g_FATInfo.data[idx]){
-            cnt++;
-        }
+    while( (start < len)&&(0 != data[start]) ){
+        start++;
     }
-
-    return cnt;
+    return start;
 }
 
-static int16_t _find_openedFile_by_fd(File_Des* fd)
+static uint32_t _scan_find_nonzero(const uint16_t* data, uint32_t start, uint32_t len)
 {
-    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
-        if(fd == g_openedFiles[idx]){
-            return idx;
-        }
+    while( (start < len)&&(0 == data[start]) ){
+        start++;
     }
-    return -1;
+    return start;
 }
 
-static int16_t _find_openedFile_by_name(const char* filename)
+static uint32_t _scan_count_bad(const uint16_t* data, uint32_t len, uint16_t limit)
 {
-    File_Des* fd = NULL;
-    for(uint16_t idx = 0; idx < FS_OPEN_MAX_COUNT; ++idx){
-        fd = g_openedFiles[idx];
-        if(NULL != fd){
-            if(0 == strncmp(filename, (g_rootDirInfo.files[fd->idx]).filename, strlen(filename))){
-                return idx;
-            }
-        }
+    uint32_t cnt = 0;
+    for(uint32_t idx = 0; idx < len; ++idx){
+        cnt += (limit <= data[idx])&&(FAT_EOC != data[idx]);
     }
-    return -1;
+    return cnt;
 }
 
-static int16_t _find_space_for_open_file(void)
+#if defined(__x86_64__)||defined(__i386__)
+__attribute__((target("sse2")))
+static uint32_t _scan_count_zero_sse2(const uint16_t* data, uint32_t len)
 {
-    return _find_openedFile_by_fd(NULL);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t cnt = 0;
+    uint32_t idx = 0;
+    for( ; idx+8 <= len; idx += 8){
+        __m128i hit = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(data+idx)), zero);
+        cnt += __builtin_popcount(_mm_movemask_epi8(hit)) >> 1;
+    }
+    return cnt+_scan_count_zero(data+idx, len-idx);
 }
 
-static int16_t _search_file_by_filename(const char* filename)
+__attribute__((target("sse2")))
+static uint32_t _scan_find_sse2(const uint16_t* data, uint32_t start, uint32_t len, uint32_t flip)
 {
-    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
-        if( 0 == strncmp(filename, g_rootDirInfo.files[idx].filename, strlen(filename)) ){
-            return idx;
+    const __m128i zero = _mm_setzero_si128();
+    for( ; start+8 <= len; start += 8){
+        __m128i hit = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(data+start)), zero);
+        uint32_t mask = (_mm_movemask_epi8(hit)^flip) & 0xFFFF;
+        if(0 != mask){
+            return start+(__builtin_ctz(mask) >> 1);
         }
     }
+    return (0 == flip)?_scan_find_zero(data, start, len):_scan_find_nonzero(data, start, len);
+}
 
-    //not found
-    return -1;
+static uint32_t _scan_find_zero_sse2(const uint16_t* data, uint32_t start, uint32_t len)
+{
+    return _scan_find_sse2(data, start, len, 0);
 }
 
-static int8_t _check_filename(const char* filename)
+static uint32_t _scan_find_nonzero_sse2(const uint16_t* data, uint32_t start, uint32_t len)
 {
-    if(NULL == filename){
-        return -1;
-    }
+    return _scan_find_sse2(data, start, len, 0xFFFF);
+}
 
-    uint16_t name_len = strlen(filename);
-    if(FILENAME_MAX < name_len){
-        return -1;
+__attribute__((target("sse2")))
+static uint32_t _scan_count_bad_sse2(const uint16_t* data, uint32_t len, uint16_t limit)
+{
+    //no unsigned compare: an entry at limit or beyond survives a saturated
+    //subtraction of limit-1
+    if(0 == limit){
+        return _scan_count_bad(data, len, limit);
     }
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i eoc = _mm_set1_epi16((short)FAT_EOC);
+    const __m128i below = _mm_set1_epi16((short)(limit-1));
+    uint32_t cnt = 0;
+    uint32_t idx = 0;
+    for( ; idx+8 <= len; idx += 8){
+        __m128i entries = _mm_loadu_si128((const __m128i*)(data+idx));
+        __m128i in = _mm_cmpeq_epi16(_mm_subs_epu16(entries, below), zero);
+        __m128i ok = _mm_or_si128(in, _mm_cmpeq_epi16(entries, eoc));
+        cnt += __builtin_popcount(~_mm_movemask_epi8(ok) & 0xFFFF) >> 1;
+    }
+    return cnt+_scan_count_bad(data+idx, len-idx, limit);
+}
 
-    return 0;
+__attribute__((target("avx2")))
+static uint32_t _scan_count_zero_avx2(const uint16_t* data, uint32_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t cnt = 0;
+    uint32_t idx = 0;
+    for( ; idx+16 <= len; idx += 16){
+        __m256i hit = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(data+idx)), zero);
+        cnt += __builtin_popcount((uint32_t)_mm256_movemask_epi8(hit)) >> 1;
+    }
+    return cnt+_scan_count_zero(data+idx, len-idx);
 }
 
-static int16_t _find_empty_entry(void)
+__attribute__((target("avx2")))
+static uint32_t _scan_find_avx2(const uint16_t* data, uint32_t start, uint32_t len, uint32_t flip)
 {
-    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
-        if(0 == g_rootDirInfo.files[idx].start_data_block_idx){
-            return idx;
+    const __m256i zero = _mm256_setzero_si256();
+    for( ; start+16 <= len; start += 16){
+        __m256i hit = _mm256_cmpeq_epi16(_mm256_loadu_si256((const __m256i*)(data+start)), zero);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hit)^flip;
+        if(0 != mask){
+            return start+(__builtin_ctz(mask) >> 1);
         }
     }
+    return (0 == flip)?_scan_find_zero(data, start, len):_scan_find_nonzero(data, start, len);
+}
 
-    return -1;
+static uint32_t _scan_find_zero_avx2(const uint16_t* data, uint32_t start, uint32_t len)
+{
+    return _scan_find_avx2(data, start, len, 0);
 }
 
-static uint16_t _get_block_idx_for_new_pos(uint16_t file_idx, uint32_t start_pos, uint32_t step_len)
+static uint32_t _scan_find_nonzero_avx2(const uint16_t* data, uint32_t start, uint32_t len)
 {
-    uint32_t len_total = start_pos+step_len;
-    uint16_t offset_to_block_num = len_total/BLOCK_SIZE;
-    uint16_t block_idx = g_rootDirInfo.files[file_idx].start_data_block_idx;
+    return _scan_find_avx2(data, start, len, 0xFFFFFFFF);
+}
 
-    for(uint16_t cnt = 0; cnt < offset_to_block_num; ++cnt){
-        if(FAT_EOC != g_FATInfo.data[block_idx]){
-            block_idx = g_FATInfo.data[block_idx];
-        }
+__attribute__((target("avx2")))
+static uint32_t _scan_count_bad_avx2(const uint16_t* data, uint32_t len, uint16_t limit)
+{
+    if(0 == limit){
+        return _scan_count_bad(data, len, limit);
     }
-
-    return block_idx;
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i eoc = _mm256_set1_epi16((short)FAT_EOC);
+    const __m256i below = _mm256_set1_epi16((short)(limit-1));
+    uint32_t cnt = 0;
+    uint32_t idx = 0;
+    for( ; idx+16 <= len; idx += 16){
+        __m256i entries = _mm256_loadu_si256((const __m256i*)(data+idx));
+        __m256i in = _mm256_cmpeq_epi16(_mm256_subs_epu16(entries, below), zero);
+        __m256i ok = _mm256_or_si256(in, _mm256_cmpeq_epi16(entries, eoc));
+        cnt += __builtin_popcount(~(uint32_t)_mm256_movemask_epi8(ok)) >> 1;
+    }
+    return cnt+_scan_count_bad(data+idx, len-idx, limit);
 }
+#endif
 
-static int32_t _find_empty_FAT(void)
+static void _fat_scan_init(void)
 {
-    for(uint32_t idx = 1; idx < g_FATLen; ++idx){
-        if(0 == g_FATInfo.data[idx]){
-            return idx;
-        }
+    g_fatScan = (Fat_Scan){ _scan_count_zero, _scan_find_zero, _scan_find_nonzero, _scan_count_bad };
+#if defined(__x86_64__)||defined(__i386__)
+    if(0 == g_fatSimd){
+        return;
     }
-
-    return -1;
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        g_fatScan = (Fat_Scan){ _scan_count_zero_avx2, _scan_find_zero_avx2, _scan_find_nonzero_avx2, _scan_count_bad_avx2 };
+    }
+    else if(__builtin_cpu_supports("sse2")){
+        g_fatScan = (Fat_Scan){ _scan_count_zero_sse2, _scan_find_zero_sse2, _scan_find_nonzero_sse2, _scan_count_bad_sse2 };
+    }
+#endif
 }
 
+/*
+ * CRC32C (Castagnoli) of a block. With SSE4.2 the crc32 instruction takes 8
+ * bytes at a time; one block is a single dependency chain, so batches of
+ * blocks are checksummed three at a time with their chains interleaved, which
+ * hides the latency of the instruction without folding partial CRCs together.
+ */
+#define CRC32C_POLY     (0x82F63B78)
 
+static uint32_t g_crcTable[256] = {0};
 
-/////////////////////API
-int fs_mount(const char *diskname)
+static uint32_t _crc32c(const uint8_t* data, uint32_t len)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(0 != g_mounted_flag){
-        //has mounted
-        return -1;
+    uint32_t crc = 0xFFFFFFFF;
+    for(uint32_t idx = 0; idx < len; ++idx){
+        crc = g_crcTable[(crc ^ data[idx]) & 0xFF] ^ (crc >> 8);
     }
+    return ~crc;
+}
 
-    int mnt_ret = block_disk_open(diskname);
-    if (0 != mnt_ret)
-    {
-        return mnt_ret;
+static void _crc32c_three(const uint8_t* const data[3], uint32_t len, uint32_t crcs[3])
+{
+    for(uint32_t cnt = 0; cnt < 3; ++cnt){
+        crcs[cnt] = _crc32c(data[cnt], len);
     }
-    else
-    {
-        //mount fs
-        //read super block
-        if(-1 == block_read(0, &g_superBlockInfo)){
-            return -1;
-        }
-
-        //fs_info();
-
-        //check signature
-        if(0 != strncmp(DEFAULT_SIGN, g_superBlockInfo.sign, strlen(DEFAULT_SIGN))){
-            return -1;
-        }
-
-        //invalidate amount of block
-        if(g_superBlockInfo.block_num_total != block_disk_count()){
-            return -1;
-        }
-
-        //read fat
-        g_FATLen = g_superBlockInfo.data_block_num;
-        //real len should be g_FATLen
-        //but easy for reading or writing, malloc max len of memory
-        g_FATInfo.data = (uint16_t*)malloc(BLOCK_SIZE*g_superBlockInfo.fat_block_num);
-        if(NULL == g_FATInfo.data){
-            return -1;
-        }
+}
 
-        uint32_t read_cnt = 0;
-        for(uint8_t cnt = 0; cnt < g_superBlockInfo.fat_block_num; ++cnt){
-            if( -1 == block_read(1+cnt, g_FATInfo.data+read_cnt) ){
-                return -1;
-            }
-            read_cnt += BLOCK_SIZE;
-        }
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(const uint8_t* data, uint32_t len)
+{
+    uint64_t crc = 0xFFFFFFFF;
+    uint32_t idx = 0;
+    for( ; idx+8 <= len; idx += 8){
+        uint64_t word;
+        memcpy(&word, data+idx, sizeof(word));
+        crc = _mm_crc32_u64(crc, word);
+    }
+    for( ; idx < len; ++idx){
+        crc = _mm_crc32_u8((uint32_t)crc, data[idx]);
+    }
+    return ~(uint32_t)crc;
+}
 
-#if 0
-        for(uint32_t idx = 0; idx < g_FATLen; idx++){
-            if(0 != g_FATInfo.data[idx]){
-                printf("idx(%d),val(%d)\n", idx, g_FATInfo.data[idx]);
-            }
-        }
+__attribute__((target("sse4.2")))
+static void _crc32c_three_sse42(const uint8_t* const data[3], uint32_t len, uint32_t crcs[3])
+{
+    uint64_t crc0 = 0xFFFFFFFF;
+    uint64_t crc1 = 0xFFFFFFFF;
+    uint64_t crc2 = 0xFFFFFFFF;
+    uint32_t idx = 0;
+    for( ; idx+8 <= len; idx += 8){
+        uint64_t word0, word1, word2;
+        memcpy(&word0, data[0]+idx, sizeof(word0));
+        memcpy(&word1, data[1]+idx, sizeof(word1));
+        memcpy(&word2, data[2]+idx, sizeof(word2));
+        crc0 = _mm_crc32_u64(crc0, word0);
+        crc1 = _mm_crc32_u64(crc1, word1);
+        crc2 = _mm_crc32_u64(crc2, word2);
+    }
+    for( ; idx < len; ++idx){
+        crc0 = _mm_crc32_u8((uint32_t)crc0, data[0][idx]);
+        crc1 = _mm_crc32_u8((uint32_t)crc1, data[1][idx]);
+        crc2 = _mm_crc32_u8((uint32_t)crc2, data[2][idx]);
+    }
+    crcs[0] = ~(uint32_t)crc0;
+    crcs[1] = ~(uint32_t)crc1;
+    crcs[2] = ~(uint32_t)crc2;
+}
 #endif
 
-        //read root dir info
-        if( -1 == block_read(g_superBlockInfo.fat_block_num+1, &g_rootDirInfo) ){
-            return -1;
-        }
-
-#if 0
-        for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; idx++){
-            if(0 != g_rootDirInfo.files[idx].start_data_block_idx){
-                printf("[%d]filename(%s),size(%d),idx(%d)\n", idx,
-                    g_rootDirInfo.files[idx].filename,
-                    g_rootDirInfo.files[idx].file_size,
-                    g_rootDirInfo.files[idx].start_data_block_idx);
+static void _csum_kernel_init(void)
+{
+    if(0 == g_crcTable[1]){
+        for(uint32_t idx = 0; idx < 256; ++idx){
+            uint32_t crc = idx;
+            for(int bit = 0; bit < 8; ++bit){
+                crc = (crc >> 1) ^ ((0 != (crc & 1))?CRC32C_POLY:0);
             }
+            g_crcTable[idx] = crc;
         }
-#endif
+    }
 
-        //read all data
-        g_all_data.data_all = (Data_Block**)malloc(sizeof(Data_Block*)*g_superBlockInfo.data_block_num);
-        memset(g_all_data.data_all, 0, sizeof(Data_Block*)*g_superBlockInfo.data_block_num);
-        for(uint16_t cnt = 0; cnt < g_superBlockInfo.data_block_num; ++cnt){
-            Data_Block* tmp_db = (Data_Block*)malloc(sizeof(Data_Block));
-            memset(tmp_db, 0, sizeof(Data_Block));
-            if( -1 == block_read(g_superBlockInfo.data_block_idx+cnt, tmp_db) ){
-                return -1;
-            }
+    g_csumKernel = (Csum_Kernel){ _crc32c, _crc32c_three };
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")){
+        g_csumKernel = (Csum_Kernel){ _crc32c_sse42, _crc32c_three_sse42 };
+    }
+#endif
+}
 
-            g_all_data.data_all[cnt] = tmp_db;
+static uint16_t _get_fs_file_num(void)
+{
+    uint16_t cnt = 0;
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        if(0 != g_rootDirInfo.files[idx].start_data_block_idx){
+            cnt++;
         }
-
-        g_fileNumTotal = _get_fs_file_num();
-        g_mounted_flag = 1;
     }
 
-    return 0;
+    return cnt;
 }
 
-int fs_umount(void)
+static uint16_t _get_free_FAT_num(void)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(0 != g_openedFileNum){
-        return -1;
+    return g_fatScan.count_zero(g_FATInfo.data, g_FATLen);
+}
+
+static File_Des* _get_file_des(int fd)
+{
+    if( (0 > fd)||(g_openedFiles.slot_num <= (uint32_t)fd) ){
+        return NULL;
     }
 
-    if(1 != g_mounted_flag){
-        return -1;
+    File_Des* fDes = &(g_openedFiles.chunks[fd >> FD_CHUNK_SHIFT][fd & (FD_CHUNK_LEN-1)]);
+    if(0 == fDes->in_use){
+        return NULL;
     }
 
-    //write super block
-    if( -1 == block_write(0, &g_superBlockInfo) ){
-        return -1;
+    return fDes;
+}
+
+static int32_t _alloc_file_des(void)
+{
+    int32_t fd = g_openedFiles.free_head;
+    if(-1 != fd){
+        File_Des* fDes = &(g_openedFiles.chunks[fd >> FD_CHUNK_SHIFT][fd & (FD_CHUNK_LEN-1)]);
+        g_openedFiles.free_head = fDes->next_free;
+        fDes->in_use = 1;
+        return fd;
     }
 
-    //write fat
-    const uint16_t block_step = BLOCK_SIZE/sizeof(uint16_t);
-    for(uint8_t cnt = 0; cnt < g_superBlockInfo.fat_block_num; ++cnt){
-        if( -1 == block_write(1+cnt, g_FATInfo.data+(cnt*block_step)) ){
+    //no closed descriptor to reuse, carve a new one
+    fd = g_openedFiles.slot_num;
+    uint32_t chunk_idx = fd >> FD_CHUNK_SHIFT;
+    if(chunk_idx == g_openedFiles.chunk_num){
+        File_Des** chunks = (File_Des**)realloc(g_openedFiles.chunks, sizeof(File_Des*)*(chunk_idx+1));
+        if(NULL == chunks){
             return -1;
         }
-    }
-    free(g_FATInfo.data);
-
-    //write root dir
-    if( -1 == block_write(g_superBlockInfo.fat_block_num+1, &g_rootDirInfo) ){
-        return -1;
-    }
+        g_openedFiles.chunks = chunks;
 
-    //write all data
-    for(uint16_t cnt = 0; cnt < g_superBlockInfo.data_block_num; ++cnt){
-        if( -1 == block_write(g_superBlockInfo.data_block_idx+cnt, 
-                    g_all_data.data_all[cnt]) ){
+        chunks[chunk_idx] = (File_Des*)calloc(FD_CHUNK_LEN, sizeof(File_Des));
+        if(NULL == chunks[chunk_idx]){
             return -1;
         }
-        free(g_all_data.data_all[cnt]);
+        g_openedFiles.chunk_num++;
     }
-    free(g_all_data.data_all);
 
-    int close_ret = block_disk_close();
-    if(-1 == close_ret){
-        return -1;
-    }
+    g_openedFiles.slot_num++;
+    g_openedFiles.chunks[chunk_idx][fd & (FD_CHUNK_LEN-1)].in_use = 1;
+    return fd;
+}
 
-    g_mounted_flag = 0;
-    return close_ret;
+static void _free_file_des(int fd)
+{
+    File_Des* fDes = &(g_openedFiles.chunks[fd >> FD_CHUNK_SHIFT][fd & (FD_CHUNK_LEN-1)]);
+    fDes->in_use = 0;
+    fDes->next_free = g_openedFiles.free_head;
+    g_openedFiles.free_head = fd;
 }
 
-int fs_info(void)
+static void _release_fd_table(void)
 {
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", g_superBlockInfo.block_num_total);
-    printf("fat_blk_count=%d\n", g_superBlockInfo.fat_block_num);
-    printf("rdir_blk=%d\n", g_superBlockInfo.root_dir_block_idx);
-    printf("data_blk=%d\n", g_superBlockInfo.data_block_idx);
-    printf("data_blk_count=%d\n", g_superBlockInfo.data_block_num);
-    printf("fat_free_ratio=%d/%d\n", _get_free_FAT_num(),
-        g_superBlockInfo.data_block_num);
-    printf("rdir_free_ratio=%d/%d\n", FS_FILE_MAX_COUNT-g_fileNumTotal, FS_FILE_MAX_COUNT);
+    for(uint32_t idx = 0; idx < g_openedFiles.chunk_num; ++idx){
+        free(g_openedFiles.chunks[idx]);
+    }
+    free(g_openedFiles.chunks);
 
-    return 0;
+    g_openedFiles.chunks = NULL;
+    g_openedFiles.chunk_num = 0;
+    g_openedFiles.slot_num = 0;
+    g_openedFiles.free_head = -1;
 }
 
-int fs_create(const char *filename)
+static inline uint8_t* _frame(uint16_t block_idx)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(FS_FILE_MAX_COUNT <= g_fileNumTotal){
-        return -1;
-    }
+    return g_all_data.arena + ((size_t)block_idx << g_blockShift);
+}
 
-    if(0 != _check_filename(filename)){
-        return -1;
+//make room for need entries in an array of block indexes
+static int _reserve_idx_array(uint16_t** arr, uint32_t* cap, uint32_t need)
+{
+    if(need <= *cap){
+        return 0;
     }
 
-    if(-1 != _search_file_by_filename(filename)){
-        //already existed
-        return -1;
+    uint32_t new_cap = (0 == *cap)?8:(*cap*2);
+    while(new_cap < need){
+        new_cap *= 2;
     }
-
-    int16_t idx = _find_empty_entry();
-    if(-1 == idx){
+    uint16_t* new_arr = (uint16_t*)realloc(*arr, sizeof(uint16_t)*new_cap);
+    if(NULL == new_arr){
         return -1;
     }
 
-    strncpy(g_rootDirInfo.files[idx].filename, filename, strlen(filename));
-    g_rootDirInfo.files[idx].file_size = 0;
-    g_rootDirInfo.files[idx].start_data_block_idx = FAT_EOC;
-
-    g_fileNumTotal++;
+    *arr = new_arr;
+    *cap = new_cap;
     return 0;
 }
 
-int fs_delete(const char *filename)
+//make room for cnt more blocks in the block map
+static int _inode_reserve_blocks(Inode* ino, uint32_t cnt)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(0 != _check_filename(filename)){
-        return -1;
-    }
+    return _reserve_idx_array(&(ino->blocks), &(ino->block_cap), ino->block_num+cnt);
+}
 
-    int16_t file_idx = _search_file_by_filename(filename);
-    if(-1 == file_idx){
-        //not found
-        return -1;
+/*
+ * A mapped file has no FAT chain through its data blocks, whose FAT entries
+ * are all FAT_EOC. Its entry points instead at a FAT chain of map blocks, each
+ * one an array of data block indexes for consecutive logical blocks, where 0
+ * is a hole that reads as zeros and takes no space. Files only become mapped
+ * when a write leaves a hole behind it.
+ */
+static int _inode_load_map(Inode* ino, uint16_t block_idx)
+{
+    const uint32_t entry_shift = g_blockShift-1;
+    ino->map_num = 0;
+    while( (FAT_EOC != block_idx)&&(ino->map_num < g_FATLen) ){
+        if(-1 == _reserve_idx_array(&(ino->map_blocks), &(ino->map_cap), ino->map_num+1)){
+            return -1;
+        }
+        ino->map_blocks[ino->map_num++] = block_idx;
+        block_idx = g_FATInfo.data[block_idx];
     }
 
-    int16_t idx = _find_openedFile_by_name(filename);
-    if(-1 != idx){
-        //opened
+    if(-1 == _inode_reserve_blocks(ino, ino->map_num << entry_shift)){
         return -1;
     }
 
-    //clear FAT
-    uint16_t tmp = 0;
-    uint16_t next_idx = g_rootDirInfo.files[file_idx].start_data_block_idx;
-    while(FAT_EOC != next_idx){
-        //clear data content
-        memset(g_all_data.data_all[next_idx]->data, 0, BLOCK_SIZE);
-
-        tmp = next_idx;
-        next_idx = g_FATInfo.data[next_idx];
-        g_FATInfo.data[tmp] = FAT_EOC;
+    //the block map stops at the last block mapped
+    for(uint32_t map = 0; map < ino->map_num; ++map){
+        const uint16_t* entries = (const uint16_t*)_frame(ino->map_blocks[map]);
+        for(uint32_t entry = 0; entry < ((uint32_t)1 << entry_shift); ++entry){
+            uint32_t lblk = (map << entry_shift)+entry;
+            ino->blocks[lblk] = entries[entry];
+            if(0 != entries[entry]){
+                ino->block_num = lblk+1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+//take a reference on the inode of a file, loading it on first use
+static Inode* _inode_get(uint16_t file_idx)
+{
+    Inode* ino = &(g_inodes[file_idx]);
+    if(0 == ino->refcnt){
+        File_Entry* pFE = &(g_rootDirInfo.files[file_idx]);
+        ino->idx = file_idx;
+        ino->size = pFE->file_size;
+        ino->block_num = 0;
+        ino->tail_block = 0;
+        ino->mapped = (0 != (FE_FLAG_MAPPED & pFE->flags));
+        ino->packed = (0 != (FE_FLAG_PACKED & pFE->flags));
+        ino->compressed = (0 != (FE_FLAG_COMPRESSED & pFE->flags));
+        ino->zdirty = UINT32_MAX;
+
+        //build the block map once for all the descriptors
+        uint16_t block_idx = pFE->start_data_block_idx;
+        if( (0 != ino->mapped)&&(-1 == _inode_load_map(ino, block_idx)) ){
+            return NULL;
+        }
+        while( (0 == ino->mapped)&&(0 == ino->packed)&&(FAT_EOC != block_idx)&&(ino->block_num < g_FATLen) ){
+            if(-1 == _inode_reserve_blocks(ino, 1)){
+                return NULL;
+            }
+            ino->blocks[ino->block_num++] = block_idx;
+            block_idx = g_FATInfo.data[block_idx];
+        }
+
+        pthread_mutex_init(&(ino->lock), NULL);
+    }
+
+    ino->refcnt++;
+    return ino;
+}
+
+//drop the content of a compressed file, changes not stored are lost
+static void _zrelease(Inode* ino)
+{
+    for(uint32_t cl = 0; cl < ino->zcl_cap; ++cl){
+        free(ino->zcl[cl]);
+    }
+    free(ino->zcl);
+    ino->zcl = NULL;
+    free(ino->zcl_dirty);
+    ino->zcl_dirty = NULL;
+    ino->zcl_cap = 0;
+    free(ino->zoff);
+    ino->zoff = NULL;
+    ino->zsize = 0;
+    ino->zstored = 0;
+    ino->zdirty = UINT32_MAX;
+}
+
+static void _inode_put(Inode* ino)
+{
+    if(0 != --ino->refcnt){
+        return;
+    }
+
+    pthread_mutex_destroy(&(ino->lock));
+    _zrelease(ino);
+    free(ino->blocks);
+    ino->blocks = NULL;
+    ino->block_num = 0;
+    ino->block_cap = 0;
+    free(ino->map_blocks);
+    ino->map_blocks = NULL;
+    ino->map_num = 0;
+    ino->map_cap = 0;
+}
+
+static void _inode_set_size(Inode* ino, uint32_t size)
+{
+    ino->size = size;
+    g_rootDirInfo.files[ino->idx].file_size = size;
+}
+
+static int16_t _dir_search(const Root_Dir_Info* root, const char* filename)
+{
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        if( (0 != root->files[idx].start_data_block_idx)
+            &&(0 == strncmp(filename, root->files[idx].filename, FS_FILENAME_LEN)) ){
+            return idx;
+        }
+    }
+
+    //not found
+    return -1;
+}
+
+static int16_t _search_file_by_filename(const char* filename)
+{
+    return _dir_search(&g_rootDirInfo, filename);
+}
+
+static int8_t _check_filename(const char* filename)
+{
+    if(NULL == filename){
+        return -1;
+    }
+
+    size_t name_len = strlen(filename);
+    if( (0 == name_len)||(FS_FILENAME_LEN <= name_len) ){
+        return -1;
+    }
+
+    return 0;
+}
+
+static int16_t _dir_find_empty(const Root_Dir_Info* root)
+{
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        if(0 == root->files[idx].start_data_block_idx){
+            return idx;
+        }
+    }
+
+    return -1;
+}
+
+static int16_t _find_empty_entry(void)
+{
+    return _dir_find_empty(&g_rootDirInfo);
+}
+
+//an empty file in entry idx
+static void _dir_fill(Root_Dir_Info* root, int16_t idx, const char* filename)
+{
+    memset(root->files[idx].filename, 0, FS_FILENAME_LEN);
+    memcpy(root->files[idx].filename, filename, strnlen(filename, FS_FILENAME_LEN-1));
+    root->files[idx].file_size = 0;
+    root->files[idx].start_data_block_idx = FAT_EOC;
+    root->files[idx].flags = 0;
+}
+
+static void _dir_clear(Root_Dir_Info* root, int16_t idx)
+{
+    memset(root->files[idx].filename, 0, FS_FILENAME_LEN);
+    root->files[idx].file_size = 0;
+    root->files[idx].start_data_block_idx = 0;
+    root->files[idx].flags = 0;
+}
+
+/*
+ * Free-space index: a count of free FAT entries, and a hint below which no
+ * entry is free. Allocation stays first-fit but starts its scan at the hint,
+ * freeing an entry lowers the hint. With a journal a freed block keeps its
+ * entry taken until the commit that frees it on disk, but is counted free:
+ * an allocation that finds no entry commits to get back those freed by the
+ * operations before.
+ */
+static int _journal_sync(void);
+
+static int _reclaim_FAT(void)
+{
+    return ( (0 != g_journal.freed_done)&&(0 == _journal_sync()) )?0:-1;
+}
+
+static int32_t _find_empty_FAT(void)
+{
+    uint32_t idx = g_fatScan.find_zero(g_FATInfo.data, g_FATInfo.free_hint, g_FATLen);
+    if( (g_FATLen <= idx)&&(0 == _reclaim_FAT()) ){
+        idx = g_fatScan.find_zero(g_FATInfo.data, g_FATInfo.free_hint, g_FATLen);
+    }
+    g_FATInfo.free_hint = idx;
+    return (idx < g_FATLen)?(int32_t)idx:-1;
+}
+
+static int32_t _scan_FAT_run(uint32_t cnt)
+{
+    uint32_t idx = g_FATInfo.free_hint;
+    while(idx < g_FATLen){
+        uint32_t run_start = g_fatScan.find_zero(g_FATInfo.data, idx, g_FATLen);
+        if(g_FATLen-run_start < cnt){
+            break;
+        }
+        idx = g_fatScan.find_nonzero(g_FATInfo.data, run_start, run_start+cnt);
+        if(run_start+cnt == idx){
+            return run_start;
+        }
+    }
+
+    return -1;
+}
+
+//first run of cnt free entries, -1 if there is none
+static int32_t _find_empty_FAT_run(uint32_t cnt)
+{
+    int32_t run_start = _scan_FAT_run(cnt);
+    if( (-1 == run_start)&&(0 == _reclaim_FAT()) ){
+        run_start = _scan_FAT_run(cnt);
+    }
+    return run_start;
+}
+
+/*
+ * Freeing a block is metadata work only: its content is left as is, and a
+ * dirty frame is not written back anymore. On request, freed runs are punched
+ * out of the disk image, and freed blocks are zeroed on disk by a background
+ * thread.
+ */
+static void* _scrub_main(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&(g_scrubInfo.lock));
+    while( (0 != g_scrubInfo.pending_num)||(0 == g_scrubInfo.stop) ){
+        if(0 == g_scrubInfo.pending_num){
+            pthread_cond_wait(&(g_scrubInfo.cond), &(g_scrubInfo.lock));
+            continue;
+        }
+
+        uint32_t idx = g_scrubInfo.cursor;
+        while(0 == (SCRUB_PENDING & g_scrubInfo.map[idx])){
+            idx = (idx+1 < g_FATLen)?(idx+1):0;
+        }
+        memset(_frame(idx), 0, g_blockSize);
+        //a block that fails to be zeroed is given up on
+        block_write(g_superBlockInfo.data_block_idx+idx, _frame(idx));
+        g_scrubInfo.map[idx] = 0;
+        g_scrubInfo.pending_num--;
+        g_scrubInfo.cursor = idx;
+
+        //let allocations through between blocks
+        pthread_mutex_unlock(&(g_scrubInfo.lock));
+        pthread_mutex_lock(&(g_scrubInfo.lock));
+    }
+    pthread_mutex_unlock(&(g_scrubInfo.lock));
+    return NULL;
+}
+
+static int _scrub_start(void)
+{
+    g_scrubInfo.pending_num = 0;
+    g_scrubInfo.cursor = 0;
+    g_scrubInfo.stop = 0;
+    g_scrubInfo.map = (uint8_t*)calloc(g_FATLen, sizeof(uint8_t));
+    if(NULL == g_scrubInfo.map){
+        return -1;
+    }
+    if(0 != pthread_create(&(g_scrubInfo.thread), NULL, _scrub_main, NULL)){
+        free(g_scrubInfo.map);
+        g_scrubInfo.map = NULL;
+        return -1;
+    }
+
+    g_scrubInfo.running = 1;
+    return 0;
+}
+
+//wait for every pending block to be zeroed
+static void _scrub_stop(void)
+{
+    if(0 == g_scrubInfo.running){
+        return;
+    }
+
+    pthread_mutex_lock(&(g_scrubInfo.lock));
+    g_scrubInfo.stop = 1;
+    pthread_cond_signal(&(g_scrubInfo.cond));
+    pthread_mutex_unlock(&(g_scrubInfo.lock));
+    pthread_join(g_scrubInfo.thread, NULL);
+    free(g_scrubInfo.map);
+    g_scrubInfo.map = NULL;
+    g_scrubInfo.running = 0;
+}
+
+static void _free_run_flush(void)
+{
+    if(0 == g_freeRun.len){
+        return;
+    }
+
+    uint16_t start = g_freeRun.start;
+    uint32_t len = g_freeRun.len;
+    g_freeRun.len = 0;
+    uint8_t punched = (0 != g_punchHole)
+        &&(0 == block_discard(g_superBlockInfo.data_block_idx+start, len));
+    if(0 == g_scrubInfo.running){
+        return;
+    }
+
+    //once punched the disk reads as zeros, only the frames are left
+    pthread_mutex_lock(&(g_scrubInfo.lock));
+    memset(g_scrubInfo.map+start, (0 != punched)?SCRUB_STALE:SCRUB_PENDING, len);
+    if(0 == punched){
+        g_scrubInfo.pending_num += len;
+        pthread_cond_signal(&(g_scrubInfo.cond));
+    }
+    pthread_mutex_unlock(&(g_scrubInfo.lock));
+}
+
+static void _take_FAT(uint16_t idx, uint16_t next)
+{
+    if( (idx >= g_freeRun.start)&&(idx < g_freeRun.start+g_freeRun.len) ){
+        _free_run_flush();
+    }
+
+    if(0 != g_scrubInfo.running){
+        //the old content does not get out through the new owner
+        pthread_mutex_lock(&(g_scrubInfo.lock));
+        if(0 != g_scrubInfo.map[idx]){
+            memset(_frame(idx), 0, g_blockSize);
+            if(0 != (SCRUB_PENDING & g_scrubInfo.map[idx])){
+                g_scrubInfo.pending_num--;
+            }
+            g_scrubInfo.map[idx] = 0;
+        }
+        pthread_mutex_unlock(&(g_scrubInfo.lock));
+    }
+
+    g_FATInfo.data[idx] = next;
+    g_FATInfo.free_num--;
+    if(NULL != g_csum.data){
+        //written, and checksummed, at the latest by the next sync
+        g_all_data.flags[idx] |= FRAME_DIRTY;
+    }
+}
+
+//the entry can be taken again, and the block punched or scrubbed
+static void _free_FAT(uint16_t idx)
+{
+    g_FATInfo.data[idx] = 0;
+    if(idx < g_FATInfo.free_hint){
+        g_FATInfo.free_hint = idx;
+    }
+    if( (0 == g_punchHole)&&(0 == g_scrubInfo.running) ){
+        return;
+    }
+
+    if( (0 != g_freeRun.len)&&((uint32_t)g_freeRun.start+g_freeRun.len == idx) ){
+        g_freeRun.len++;
+        return;
+    }
+    _free_run_flush();
+    g_freeRun.start = idx;
+    g_freeRun.len = 1;
+}
+
+static void _release_FAT(uint16_t idx)
+{
+    //the content is not needed anymore
+    g_all_data.flags[idx] &= ~(FRAME_DIRTY | FRAME_DEDUP);
+    g_FATInfo.free_num++;
+
+    //the committed metadata may still point to the block, it keeps its content
+    //until the commit; without room to track it, it is freed now
+    if( (0 != g_journal.running)
+        &&(0 == _reserve_idx_array(&(g_journal.freed), &(g_journal.freed_cap), g_journal.freed_num+1)) ){
+        g_FATInfo.data[idx] = FAT_EOC;
+        g_journal.freed[g_journal.freed_num++] = idx;
+        return;
+    }
+    _free_FAT(idx);
+}
+
+//the first num blocks freed since the last commit are free in a copy of the FAT
+static void _fat_drop_freed(uint16_t* fat, uint32_t num)
+{
+    for(uint32_t cnt = 0; cnt < num; ++cnt){
+        fat[g_journal.freed[cnt]] = 0;
+    }
+}
+
+static inline int _block_shared(uint16_t idx)
+{
+    return (NULL != g_refcnt.data)&&(0 != g_refcnt.data[idx]);
+}
+
+//drop one owner of a data block, freeing it with the last one
+static void _put_block(uint16_t idx)
+{
+    if(0 != _block_shared(idx)){
+        g_refcnt.data[idx]--;
+        g_refcnt.dirty = 1;
+    }
+    else{
+        _release_FAT(idx);
+    }
+}
+
+//one more owner of a data block, once the table exists
+static void _get_block(uint16_t idx)
+{
+    g_refcnt.data[idx]++;
+    g_refcnt.dirty = 1;
+}
+
+static int8_t _get_block_shift(size_t block_size)
+{
+    for(uint8_t shift = BLOCK_SHIFT_MIN; shift <= BLOCK_SHIFT_MAX; ++shift){
+        if(((size_t)1 << shift) == block_size){
+            return shift;
+        }
+    }
+
+    return -1;
+}
+
+static uint32_t _blocks_for_len(uint32_t len)
+{
+    return ((uint64_t)len+g_blockSize-1) >> g_blockShift;
+}
+
+//read len bytes of metadata laid out from block first_block on
+static int _meta_read(uint16_t first_block, void* dst, uint32_t len)
+{
+    uint8_t* pos = dst;
+    uint32_t full_num = len >> g_blockShift;
+    if( (0 != full_num)&&(-1 == block_read_many(first_block, full_num, pos)) ){
+        return -1;
+    }
+    first_block += full_num;
+    pos += (size_t)full_num << g_blockShift;
+    len -= full_num << g_blockShift;
+
+    if(0 != len){
+        if(-1 == block_read(first_block, g_blockBuf)){
+            return -1;
+        }
+        memcpy(pos, g_blockBuf, len);
+    }
+
+    return 0;
+}
+
+//write len bytes of metadata from block first_block on, padding the last block
+static int _meta_write(uint16_t first_block, const void* src, uint32_t len)
+{
+    const uint8_t* pos = src;
+    uint32_t full_num = len >> g_blockShift;
+    if( (0 != full_num)&&(-1 == block_write_many(first_block, full_num, pos)) ){
+        return -1;
+    }
+    first_block += full_num;
+    pos += (size_t)full_num << g_blockShift;
+    len -= full_num << g_blockShift;
+
+    if(0 != len){
+        memset(g_blockBuf, 0, g_blockSize);
+        memcpy(g_blockBuf, pos, len);
+        if(-1 == block_write(first_block, g_blockBuf)){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+//one mapping for every frame, page aligned and zeroed
+static int _alloc_arena(size_t len)
+{
+    void* arena = MAP_FAILED;
+    if( (0 != g_hugePages)&&(HUGE_PAGE_SIZE <= len) ){
+        size_t huge_len = (len+HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+        arena = mmap(NULL, huge_len, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if(MAP_FAILED != arena){
+            len = huge_len;
+        }
+    }
+
+    if(MAP_FAILED == arena){
+        arena = mmap(NULL, len, PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(MAP_FAILED == arena){
+            return -1;
+        }
+        if( (0 != g_hugePages)&&(HUGE_PAGE_SIZE <= len) ){
+            //no reserved huge pages, let THP back the arena when it can
+            madvise(arena, len, MADV_HUGEPAGE);
+        }
+    }
+
+    g_all_data.arena = (uint8_t*)arena;
+    g_all_data.arena_len = len;
+    return 0;
+}
+
+static void _release_mount(void)
+{
+    if(NULL != g_all_data.arena){
+        munmap(g_all_data.arena, g_all_data.arena_len);
+        g_all_data.arena = NULL;
+        g_all_data.arena_len = 0;
+    }
+    free(g_all_data.flags);
+    g_all_data.flags = NULL;
+
+    free(g_FATInfo.data);
+    g_FATInfo.data = NULL;
+    free(g_refcnt.data);
+    g_refcnt.data = NULL;
+    free(g_csum.data);
+    g_csum.data = NULL;
+    free(g_dedupIndex.hash);
+    g_dedupIndex.hash = NULL;
+    free(g_dedupIndex.table);
+    g_dedupIndex.table = NULL;
+    free(g_journal.shadow);
+    g_journal.shadow = NULL;
+    free(g_journal.stage);
+    g_journal.stage = NULL;
+    free(g_journal.txn);
+    g_journal.txn = NULL;
+    free(g_journal.home_dirty);
+    g_journal.home_dirty = NULL;
+    free(g_journal.freed);
+    g_journal.freed = NULL;
+    g_journal.freed_num = 0;
+    g_journal.freed_cap = 0;
+    g_journal.freed_done = 0;
+    free(g_blockBuf);
+    g_blockBuf = NULL;
+
+    g_blockSize = BLOCK_SIZE;
+    g_blockShift = BLOCK_SHIFT_DEFAULT;
+}
+
+static int _fail_mount(void)
+{
+    _release_mount();
+    block_disk_close();
+    return -1;
+}
+
+/*
+ * Data path. The block size is only known at mount time, so the loops below
+ * take it as a parameter and are inlined into a dispatch on the common sizes:
+ * for those the compiler sees a constant, offsets become shifts and masks and
+ * whole-block copies become fixed-size memcpy.
+ */
+#define _ALWAYS_INLINE  inline __attribute__((always_inline))
+
+#define _BLOCK_SIZE_DISPATCH(ret, fn, ...) \
+    switch(g_blockSize){ \
+    case 512:   ret = fn(__VA_ARGS__, 512); break; \
+    case 1024:  ret = fn(__VA_ARGS__, 1024); break; \
+    case 4096:  ret = fn(__VA_ARGS__, 4096); break; \
+    case 65536: ret = fn(__VA_ARGS__, 65536); break; \
+    default:    ret = fn(__VA_ARGS__, g_blockSize); break; \
+    }
+
+//visit every block owned by the files of root, following fat: the entries of
+//a map block are visited before the map block, the link of a block is read
+//before it
+static void _walk_file_blocks(const Root_Dir_Info* root, const uint16_t* fat, void (*visit)(uint16_t))
+{
+    const uint32_t entry_num = g_blockSize/sizeof(uint16_t);
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        const File_Entry* pFE = &(root->files[idx]);
+        uint16_t block_idx = pFE->start_data_block_idx;
+        for(uint32_t cnt = 0; (0 != block_idx)&&(FAT_EOC != block_idx)&&(cnt < g_FATLen); ++cnt){
+            uint16_t next_idx = fat[block_idx];
+            if(0 != (FE_FLAG_MAPPED & pFE->flags)){
+                const uint16_t* entries = (const uint16_t*)_frame(block_idx);
+                for(uint32_t entry = 0; entry < entry_num; ++entry){
+                    if(0 != entries[entry]){
+                        visit(entries[entry]);
+                    }
+                }
+            }
+            visit(block_idx);
+            block_idx = next_idx;
+        }
+    }
+}
+
+/*
+ * Per-block checksums. Every write of data frames goes through
+ * _frames_write(), which checksums them first; with a checksum table, taking a
+ * block dirties its frame so that it is written, and checksummed, by the next
+ * sync even if nothing writes to it. The table is stored once the dirty frames
+ * are written back, and the blocks of the files are checked against it when
+ * they are loaded at mount.
+ */
+//call fn with the CRC32C of the frames of count blocks from first on that
+//carry one of the mask flags, or of all of them for 0; three at a time
+static void _csum_each(uint32_t first, uint32_t count, uint8_t mask, void (*fn)(uint32_t, uint32_t))
+{
+    if(NULL == g_csum.data){
+        return;
+    }
+
+    uint32_t batch[3];
+    uint32_t batch_num = 0;
+    for(uint32_t idx = first; idx < first+count; ++idx){
+        uint8_t flags = g_all_data.flags[idx];
+        if( (0 != (FRAME_NOSUM & flags))||( (0 != mask)&&(0 == (mask & flags)) ) ){
+            continue;
+        }
+
+        batch[batch_num++] = idx;
+        if(3 == batch_num){
+            const uint8_t* data[3] = { _frame(batch[0]), _frame(batch[1]), _frame(batch[2]) };
+            uint32_t crcs[3];
+            g_csumKernel.three(data, g_blockSize, crcs);
+            for(uint32_t cnt = 0; cnt < 3; ++cnt){
+                fn(batch[cnt], crcs[cnt]);
+            }
+            batch_num = 0;
+        }
+    }
+    for(uint32_t cnt = 0; cnt < batch_num; ++cnt){
+        fn(batch[cnt], g_csumKernel.one(_frame(batch[cnt]), g_blockSize));
+    }
+}
+
+static void _csum_set(uint32_t block_idx, uint32_t crc)
+{
+    if(g_csum.data[block_idx] != crc){
+        g_csum.data[block_idx] = crc;
+        g_csum.dirty = 1;
+    }
+    //rewritten, whatever was there before
+    g_all_data.flags[block_idx] &= ~FRAME_BAD;
+}
+
+static void _csum_check(uint32_t block_idx, uint32_t crc)
+{
+    g_all_data.flags[block_idx] &= ~FRAME_VERIFY;
+    if(g_csum.data[block_idx] != crc){
+        g_all_data.flags[block_idx] |= FRAME_BAD;
+        g_csum.bad_num++;
+    }
+}
+
+static void _csum_mark(uint16_t block_idx)
+{
+    g_all_data.flags[block_idx] |= FRAME_VERIFY;
+}
+
+//write the frames of count blocks from first on to the disk
+static int _frames_write(uint32_t first, uint32_t count)
+{
+    //written again, out of the dedup index until indexed anew
+    for(uint32_t idx = first; idx < first+count; ++idx){
+        g_all_data.flags[idx] &= ~FRAME_DEDUP;
+    }
+    _csum_each(first, count, 0, _csum_set);
+    return block_write_many(g_superBlockInfo.data_block_idx+first, count, _frame(first));
+}
+
+static int _flush_frame(uint16_t block_idx)
+{
+    if( (0 == g_FATInfo.data[block_idx])||(0 == (FRAME_DIRTY & g_all_data.flags[block_idx])) ){
+        //free, or same as the disk
+        return 0;
+    }
+
+    if(-1 == _frames_write(block_idx, 1)){
+        return -1;
+    }
+    g_all_data.flags[block_idx] &= ~FRAME_DIRTY;
+    return 0;
+}
+
+//write back the dirty frames of count blocks from first on, consecutive ones
+//in one go
+static int _flush_frames(uint32_t first, uint32_t count)
+{
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+    for(uint32_t idx = first; idx <= first+count; ++idx){
+        if( (idx < first+count)&&(0 != g_FATInfo.data[idx])
+            &&(0 != (FRAME_DIRTY & g_all_data.flags[idx])) ){
+            run_start = (0 == run_len)?idx:run_start;
+            run_len++;
+            continue;
+        }
+
+        if(0 == run_len){
+            continue;
+        }
+        if(-1 == _frames_write(run_start, run_len)){
+            return -1;
+        }
+        for(uint32_t cnt = run_start; cnt < run_start+run_len; ++cnt){
+            g_all_data.flags[cnt] &= ~FRAME_DIRTY;
+        }
+        run_len = 0;
+    }
+
+    return 0;
+}
+
+//write the frames of the num blocks of a chain, each run of consecutive
+//blocks in one go
+static int _chain_write(uint16_t block_idx, uint32_t num)
+{
+    while(0 != num){
+        uint16_t run_start = block_idx;
+        uint32_t run_len = 1;
+        while( (run_len < num)&&((uint32_t)block_idx+1 == g_FATInfo.data[block_idx]) ){
+            block_idx++;
+            run_len++;
+        }
+        if(-1 == _frames_write(run_start, run_len)){
+            return -1;
+        }
+        block_idx = g_FATInfo.data[block_idx];
+        num -= run_len;
+    }
+
+    return 0;
+}
+
+//write back a block that has been combining writes, pending is cleared
+static int _flush_pending(uint16_t* pending)
+{
+    uint16_t block_idx = *pending;
+    *pending = 0;
+    return (0 == block_idx)?0:_flush_frame(block_idx);
+}
+
+//take a chain of block_num free blocks for metadata, return its first block;
+//the caller made sure there are enough
+static uint16_t _take_chain(uint32_t block_num)
+{
+    //one run of free blocks if there is one, so that it is written in one go
+    int32_t run_start = (1 < block_num)?_find_empty_FAT_run(block_num):-1;
+    uint16_t first_idx = 0;
+    uint16_t prev_idx = 0;
+    for(uint32_t cnt = 0; cnt < block_num; ++cnt){
+        uint16_t new_idx = (-1 == run_start)?_find_empty_FAT():(run_start+cnt);
+        _take_FAT(new_idx, FAT_EOC);
+        if(0 == prev_idx){
+            first_idx = new_idx;
+        }
+        else{
+            g_FATInfo.data[prev_idx] = new_idx;
+        }
+        prev_idx = new_idx;
+    }
+
+    return first_idx;
+}
+
+//blocks holding the refcount table
+static uint32_t _refcnt_block_num(void)
+{
+    return _blocks_for_len(g_FATLen*sizeof(uint16_t));
+}
+
+//start sharing blocks: the table takes a chain of data blocks
+static int _refcnt_init(void)
+{
+    if(NULL != g_refcnt.data){
+        return 0;
+    }
+
+    uint32_t block_num = _refcnt_block_num();
+    if(g_FATInfo.free_num < block_num){
+        return -1;
+    }
+    g_refcnt.data = (uint16_t*)calloc(block_num << (g_blockShift-1), sizeof(uint16_t));
+    if(NULL == g_refcnt.data){
+        return -1;
+    }
+
+    g_superBlockInfo.refcnt_block_idx = _take_chain(block_num);
+    g_refcnt.dirty = 1;
+    return 0;
+}
+
+static int _refcnt_load(void)
+{
+    uint16_t block_idx = g_superBlockInfo.refcnt_block_idx;
+    if(0 == block_idx){
+        return 0;
+    }
+
+    uint32_t block_num = _refcnt_block_num();
+    g_refcnt.data = (uint16_t*)malloc((size_t)block_num << g_blockShift);
+    if(NULL == g_refcnt.data){
+        return -1;
+    }
+    for(uint32_t cnt = 0; cnt < block_num; ++cnt){
+        if( (0 == block_idx)||(g_FATLen <= block_idx) ){
+            return -1;
+        }
+        memcpy((uint8_t*)g_refcnt.data+((size_t)cnt << g_blockShift), _frame(block_idx), g_blockSize);
+        block_idx = g_FATInfo.data[block_idx];
+    }
+
+    g_refcnt.dirty = 0;
+    return 0;
+}
+
+//copy the table back to its frames, the frames get written with the others
+static void _refcnt_store(void)
+{
+    if(0 == g_refcnt.dirty){
+        return;
+    }
+
+    uint16_t block_idx = g_superBlockInfo.refcnt_block_idx;
+    for(uint32_t cnt = 0; cnt < _refcnt_block_num(); ++cnt){
+        memcpy(_frame(block_idx), (uint8_t*)g_refcnt.data+((size_t)cnt << g_blockShift), g_blockSize);
+        g_all_data.flags[block_idx] |= FRAME_DIRTY;
+        block_idx = g_FATInfo.data[block_idx];
+    }
+    g_refcnt.dirty = 0;
+}
+
+//blocks holding the checksum table
+static uint32_t _csum_block_num(void)
+{
+    return _blocks_for_len(g_FATLen*sizeof(uint32_t));
+}
+
+//read the table, then check the blocks of the files against it
+static int _csum_load(void)
+{
+    uint16_t block_idx = g_superBlockInfo.csum_block_idx;
+    g_csum.bad_num = 0;
+    if(0 == block_idx){
+        return 0;
+    }
+
+    uint32_t block_num = _csum_block_num();
+    g_csum.data = (uint32_t*)malloc((size_t)block_num << g_blockShift);
+    if(NULL == g_csum.data){
+        return -1;
+    }
+    for(uint32_t cnt = 0; cnt < block_num; ++cnt){
+        if( (0 == block_idx)||(g_FATLen <= block_idx) ){
+            return -1;
+        }
+        memcpy((uint8_t*)g_csum.data+((size_t)cnt << g_blockShift), _frame(block_idx), g_blockSize);
+        g_all_data.flags[block_idx] |= FRAME_NOSUM;
+        block_idx = g_FATInfo.data[block_idx];
+    }
+    g_csum.dirty = 0;
+
+    _walk_file_blocks(&g_rootDirInfo, g_FATInfo.data, _csum_mark);
+    _csum_each(0, g_FATLen, FRAME_VERIFY, _csum_check);
+    return 0;
+}
+
+//the table takes a chain of data blocks and starts from the cached frames,
+//which hold what the disk holds; left out if the disk is too full
+static int _csum_create(void)
+{
+    uint32_t block_num = _csum_block_num();
+    if(g_FATInfo.free_num < block_num){
+        return 0;
+    }
+    g_csum.data = (uint32_t*)calloc((size_t)block_num << (g_blockShift-2), sizeof(uint32_t));
+    if(NULL == g_csum.data){
+        return -1;
+    }
+
+    g_superBlockInfo.csum_block_idx = _take_chain(block_num);
+    for(uint16_t block_idx = g_superBlockInfo.csum_block_idx; FAT_EOC != block_idx; block_idx = g_FATInfo.data[block_idx]){
+        g_all_data.flags[block_idx] |= FRAME_NOSUM;
+    }
+    _csum_each(0, g_FATLen, 0, _csum_set);
+    g_csum.dirty = 1;
+    return 0;
+}
+
+//write the blocks of the table that changed; a dirty frame not written yet
+//keeps the checksum of what the disk holds
+static int _csum_store(void)
+{
+    if( (NULL == g_csum.data)||(0 == g_csum.dirty) ){
+        return 0;
+    }
+
+    uint16_t block_idx = g_superBlockInfo.csum_block_idx;
+    for(uint32_t cnt = 0; cnt < _csum_block_num(); ++cnt){
+        const uint8_t* part = (const uint8_t*)g_csum.data+((size_t)cnt << g_blockShift);
+        if(0 != memcmp(_frame(block_idx), part, g_blockSize)){
+            memcpy(_frame(block_idx), part, g_blockSize);
+            if(-1 == block_write(g_superBlockInfo.data_block_idx+block_idx, _frame(block_idx))){
+                return -1;
+            }
+        }
+        block_idx = g_FATInfo.data[block_idx];
+    }
+    g_csum.dirty = 0;
+    return 0;
+}
+
+//link a free block at the end of the file, return its index or -1 if disk full
+static int32_t _inode_append_block(Inode* ino)
+{
+    if(-1 == _inode_reserve_blocks(ino, 1)){
+        return -1;
+    }
+
+    int32_t new_idx = _find_empty_FAT();
+    if(-1 == new_idx){
+        return -1;
+    }
+
+    _take_FAT(new_idx, FAT_EOC);
+    if(0 == ino->block_num){
+        g_rootDirInfo.files[ino->idx].start_data_block_idx = new_idx;
+    }
+    else{
+        g_FATInfo.data[ino->blocks[ino->block_num-1]] = new_idx;
+    }
+    ino->blocks[ino->block_num++] = new_idx;
+
+    return new_idx;
+}
+
+//point logical block lblk of a mapped file at block_idx, the chain of map
+//blocks grows to reach it
+static int _map_set(Inode* ino, uint32_t lblk, uint16_t block_idx)
+{
+    const uint32_t entry_shift = g_blockShift-1;
+    uint32_t map = lblk >> entry_shift;
+    uint32_t map_need = map+1;
+    if(ino->map_num < map_need){
+        if( (g_FATInfo.free_num < map_need-ino->map_num)
+            ||(-1 == _reserve_idx_array(&(ino->map_blocks), &(ino->map_cap), map_need)) ){
+            return -1;
+        }
+
+        while(ino->map_num < map_need){
+            int32_t new_idx = _find_empty_FAT();
+            _take_FAT(new_idx, FAT_EOC);
+            memset(_frame(new_idx), 0, g_blockSize);
+            g_all_data.flags[new_idx] |= FRAME_DIRTY;
+            if(0 == ino->map_num){
+                g_rootDirInfo.files[ino->idx].start_data_block_idx = new_idx;
+            }
+            else{
+                g_FATInfo.data[ino->map_blocks[ino->map_num-1]] = new_idx;
+            }
+            ino->map_blocks[ino->map_num++] = new_idx;
+        }
+    }
+
+    uint16_t map_idx = ino->map_blocks[map];
+    if(0 != _block_shared(map_idx)){
+        //copy-on-write, the copy takes the place of the map block in the chain
+        int32_t new_idx = _find_empty_FAT();
+        if(-1 == new_idx){
+            return -1;
+        }
+        _take_FAT(new_idx, g_FATInfo.data[map_idx]);
+        memcpy(_frame(new_idx), _frame(map_idx), g_blockSize);
+        if(0 == map){
+            g_rootDirInfo.files[ino->idx].start_data_block_idx = new_idx;
+        }
+        else{
+            g_FATInfo.data[ino->map_blocks[map-1]] = new_idx;
+        }
+        ino->map_blocks[map] = new_idx;
+        _put_block(map_idx);
+        map_idx = new_idx;
+    }
+
+    ((uint16_t*)_frame(map_idx))[lblk & (((uint32_t)1 << entry_shift)-1)] = block_idx;
+    g_all_data.flags[map_idx] |= FRAME_DIRTY;
+    return 0;
+}
+
+//move the block map of a chained file to map blocks, so that it can have holes
+static int _inode_make_mapped(Inode* ino)
+{
+    const uint32_t entry_shift = g_blockShift-1;
+    uint32_t map_need = (0 == ino->block_num)?1:(((ino->block_num-1) >> entry_shift)+1);
+    if( (g_FATInfo.free_num < map_need)
+        ||(-1 == _reserve_idx_array(&(ino->map_blocks), &(ino->map_cap), map_need)) ){
+        return -1;
+    }
+
+    ino->mapped = 1;
+    ino->map_num = 0;
+    for(uint32_t lblk = 0; lblk < ino->block_num; ++lblk){
+        g_FATInfo.data[ino->blocks[lblk]] = FAT_EOC;
+        _map_set(ino, lblk, ino->blocks[lblk]);
+    }
+    if(0 == ino->map_num){
+        _map_set(ino, 0, 0);
+    }
+
+    g_rootDirInfo.files[ino->idx].flags |= FE_FLAG_MAPPED;
+    return 0;
+}
+
+//give logical block lblk its own copy of a shared block, which takes its
+//place in the chain or the map, return the new block or 0 if disk full
+static uint16_t _inode_unshare_block(Inode* ino, uint32_t lblk)
+{
+    uint16_t old_idx = ino->blocks[lblk];
+    int32_t new_idx = _find_empty_FAT();
+    if(-1 == new_idx){
+        return 0;
+    }
+
+    if(0 != ino->mapped){
+        _take_FAT(new_idx, FAT_EOC);
+        if(-1 == _map_set(ino, lblk, new_idx)){
+            _release_FAT(new_idx);
+            return 0;
+        }
+    }
+    else{
+        //the old block keeps its link for the other owner
+        _take_FAT(new_idx, g_FATInfo.data[old_idx]);
+        if(0 == lblk){
+            g_rootDirInfo.files[ino->idx].start_data_block_idx = new_idx;
+        }
+        else{
+            g_FATInfo.data[ino->blocks[lblk-1]] = new_idx;
+        }
+    }
+
+    memcpy(_frame(new_idx), _frame(old_idx), g_blockSize);
+    g_all_data.flags[new_idx] |= FRAME_DIRTY;
+    ino->blocks[lblk] = new_idx;
+    if(old_idx == ino->tail_block){
+        ino->tail_block = 0;
+    }
+
+    _put_block(old_idx);
+    return new_idx;
+}
+
+//give logical block lblk a free block, at the end of a chained file or
+//anywhere in a mapped one, return its index or -1 if disk full
+static int32_t _inode_alloc_block(Inode* ino, uint32_t lblk)
+{
+    if(0 == ino->mapped){
+        return _inode_append_block(ino);
+    }
+
+    uint32_t more = (lblk < ino->block_num)?0:(lblk+1-ino->block_num);
+    if(-1 == _inode_reserve_blocks(ino, more)){
+        return -1;
+    }
+
+    int32_t new_idx = _find_empty_FAT();
+    if(-1 == new_idx){
+        return -1;
+    }
+
+    _take_FAT(new_idx, FAT_EOC);
+    if(-1 == _map_set(ino, lblk, new_idx)){
+        _release_FAT(new_idx);
+        return -1;
+    }
+    while(ino->block_num <= lblk){
+        ino->blocks[ino->block_num++] = 0;
+    }
+    ino->blocks[lblk] = new_idx;
+
+    return new_idx;
+}
+
+//give every hole from logical block first to block_num a zeroed block, all or
+//nothing
+static int _inode_fill_holes(Inode* ino, uint32_t first, uint32_t block_num)
+{
+    if(first >= block_num){
+        return 0;
+    }
+
+    uint32_t hole_num = block_num-my_max(first, my_min(block_num, ino->block_num));
+    for(uint32_t lblk = first; lblk < my_min(block_num, ino->block_num); ++lblk){
+        if(0 == ino->blocks[lblk]){
+            hole_num++;
+        }
+    }
+    uint32_t map_need = ((block_num-1) >> (g_blockShift-1))+1;
+    uint32_t map_more = (ino->map_num < map_need)?(map_need-ino->map_num):0;
+    if(g_FATInfo.free_num < hole_num+map_more){
+        return -1;
+    }
+
+    for(uint32_t lblk = first; lblk < block_num; ++lblk){
+        if( (lblk < ino->block_num)&&(0 != ino->blocks[lblk]) ){
+            continue;
+        }
+
+        int32_t new_idx = _inode_alloc_block(ino, lblk);
+        if(-1 == new_idx){
+            return -1;
+        }
+        memset(_frame(new_idx), 0, g_blockSize);
+        g_all_data.flags[new_idx] |= FRAME_DIRTY;
+    }
+
+    return 0;
+}
+
+//release the map blocks past logical block keep, a mapped file left without
+//any goes back to an empty chain
+static void _inode_trim_map(Inode* ino, uint32_t keep)
+{
+    const uint32_t entry_shift = g_blockShift-1;
+    uint32_t map_keep = ((uint64_t)keep+((uint32_t)1 << entry_shift)-1) >> entry_shift;
+    if(ino->map_num <= map_keep){
+        return;
+    }
+
+    for(uint32_t map = map_keep; map < ino->map_num; ++map){
+        _put_block(ino->map_blocks[map]);
+    }
+    ino->map_num = map_keep;
+
+    if(0 == map_keep){
+        g_rootDirInfo.files[ino->idx].start_data_block_idx = FAT_EOC;
+        g_rootDirInfo.files[ino->idx].flags &= ~FE_FLAG_MAPPED;
+        ino->mapped = 0;
+    }
+    else{
+        g_FATInfo.data[ino->map_blocks[map_keep-1]] = FAT_EOC;
+    }
+}
+
+//link cnt free blocks at the end of the file, as one extent when possible,
+//all or nothing
+static int _inode_append_blocks(Inode* ino, uint32_t cnt)
+{
+    if( (g_FATInfo.free_num < cnt)||(-1 == _inode_reserve_blocks(ino, cnt)) ){
+        return -1;
+    }
+
+    //right after the current last block is best, then the first run that fits
+    int32_t run_start = -1;
+    if(0 != ino->block_num){
+        uint32_t next = ino->blocks[ino->block_num-1]+1;
+        uint32_t len = 0;
+        while( (len < cnt)&&(next+len < g_FATLen)&&(0 == g_FATInfo.data[next+len]) ){
+            len++;
+        }
+        if(cnt == len){
+            run_start = next;
+        }
+    }
+    if(-1 == run_start){
+        run_start = _find_empty_FAT_run(cnt);
+    }
+
+    uint32_t idx = (-1 == run_start)?g_FATInfo.free_hint:(uint32_t)run_start;
+    for(; 0 < cnt; ++idx){
+        if(0 != g_FATInfo.data[idx]){
+            //fragmented, take free blocks in order
+            continue;
+        }
+
+        _take_FAT(idx, FAT_EOC);
+        if(0 == ino->block_num){
+            g_rootDirInfo.files[ino->idx].start_data_block_idx = idx;
+        }
+        else{
+            g_FATInfo.data[ino->blocks[ino->block_num-1]] = idx;
+        }
+        ino->blocks[ino->block_num++] = idx;
+        cnt--;
+    }
+
+    return 0;
+}
+
+//cut the chain after the last block still needed, or zero what was allocated
+//past the old end: the rest reads as zeros until it is written. Fails only if
+//a shared block cannot be copied
+static int _inode_truncate(Inode* ino, uint32_t length)
+{
+    if(length <= ino->size){
+        const uint32_t entry_shift = g_blockShift-1;
+        uint32_t keep = _blocks_for_len(length);
+        uint32_t map_keep = ((uint64_t)keep+((uint32_t)1 << entry_shift)-1) >> entry_shift;
+
+        //entries are only cleared in the map block kept in part: setting one
+        //to its own value copies that block first if it is shared
+        if( (0 != ino->mapped)&&(keep < ino->block_num)&&(keep < (map_keep << entry_shift))
+            &&(-1 == _map_set(ino, keep, ino->blocks[keep])) ){
+            return -1;
+        }
+
+        for(uint32_t lblk = keep; lblk < ino->block_num; ++lblk){
+            uint16_t block_idx = ino->blocks[lblk];
+            if(0 == block_idx){
+                //hole
+                continue;
+            }
+            if(block_idx == ino->tail_block){
+                ino->tail_block = 0;
+            }
+            _put_block(block_idx);
+            if( (0 != ino->mapped)&&(lblk < (map_keep << entry_shift)) ){
+                _map_set(ino, lblk, 0);
+            }
+        }
+
+        if(0 != ino->mapped){
+            _inode_trim_map(ino, keep);
+            ino->block_num = my_min(keep, ino->block_num);
+        }
+        else if(keep < ino->block_num){
+            if(0 == keep){
+                g_rootDirInfo.files[ino->idx].start_data_block_idx = FAT_EOC;
+            }
+            else{
+                g_FATInfo.data[ino->blocks[keep-1]] = FAT_EOC;
+            }
+            ino->block_num = keep;
+        }
+        _free_run_flush();
+    }
+    else{
+        uint64_t end = my_min((uint64_t)length, (uint64_t)ino->block_num << g_blockShift);
+        for(uint64_t pos = ino->size; pos < end; ){
+            uint16_t block_idx = ino->blocks[pos >> g_blockShift];
+            uint32_t in_block = pos & (g_blockSize-1);
+            uint32_t chunk = my_min(g_blockSize-in_block, end-pos);
+            if( (0 != _block_shared(block_idx))
+                &&(0 == (block_idx = _inode_unshare_block(ino, pos >> g_blockShift))) ){
+                return -1;
+            }
+            if(0 != block_idx){
+                memset(_frame(block_idx)+in_block, 0, chunk);
+                g_all_data.flags[block_idx] |= FRAME_DIRTY;
+            }
+            pos += chunk;
+        }
+    }
+
+    _inode_set_size(ino, length);
+    return 0;
+}
+
+//blocks _inode_swap_tail may take when num blocks replace the ones from
+//logical block first on: the new ones, and for a mapped file the map blocks
+//it may have to copy or add
+static uint32_t _inode_swap_need(const Inode* ino, uint32_t first, uint32_t num)
+{
+    uint32_t end = my_max(first+num, ino->block_num);
+    if( (0 == ino->mapped)||(end <= first) ){
+        return num;
+    }
+    return num+((end-1) >> (g_blockShift-1))-(first >> (g_blockShift-1))+1;
+}
+
+//replace the blocks from logical block first on with the num blocks of the
+//FAT chain starting at chain, whose content is already written. Only the
+//block map changes, not the size; the caller checked the room for the map
+//blocks with _inode_swap_need
+static void _inode_swap_tail(Inode* ino, uint32_t first, uint16_t chain, uint32_t num)
+{
+    uint32_t old_num = ino->block_num;
+    for(uint32_t lblk = first; lblk < my_max(old_num, first+num); ++lblk){
+        uint16_t new_idx = 0;
+        if(lblk < first+num){
+            new_idx = chain;
+            chain = g_FATInfo.data[chain];
+            if(0 != ino->mapped){
+                g_FATInfo.data[new_idx] = FAT_EOC;
+                _map_set(ino, lblk, new_idx);
+            }
+        }
+        else if( (0 != ino->mapped)&&(lblk < (ino->map_num << (g_blockShift-1))) ){
+            _map_set(ino, lblk, 0);
+        }
+
+        if(lblk < old_num){
+            uint16_t old_idx = ino->blocks[lblk];
+            if(old_idx == ino->tail_block){
+                ino->tail_block = 0;
+            }
+            if(0 != old_idx){
+                _put_block(old_idx);
+            }
+        }
+        ino->blocks[lblk] = new_idx;
+    }
+
+    if(0 != ino->mapped){
+        _inode_trim_map(ino, first+num);
+    }
+    else{
+        uint16_t link = (0 == num)?FAT_EOC:ino->blocks[first];
+        if(0 == first){
+            g_rootDirInfo.files[ino->idx].start_data_block_idx = link;
+        }
+        else{
+            g_FATInfo.data[ino->blocks[first-1]] = link;
+        }
+    }
+    ino->block_num = first+num;
+    _free_run_flush();
+}
+
+static _ALWAYS_INLINE uint32_t _read_at(const Inode* ino, uint32_t pos,
+    uint8_t* buf, uint32_t len, const uint32_t bs)
+{
+    const uint32_t shift = __builtin_ctz(bs);
+    uint32_t lblk = pos >> shift;
+    uint32_t read_cnt = 0;
+    while(read_cnt < len){
+        uint32_t in_block = pos & (bs-1);
+        uint32_t chunk = my_min(bs-in_block, len-read_cnt);
+        if(lblk >= ino->block_num){
+            //grown by truncate but never written
+            memset(buf+read_cnt, 0, len-read_cnt);
+            read_cnt = len;
+            break;
+        }
+
+        const uint8_t* frame = _frame(ino->blocks[lblk]);
+        if(0 == ino->blocks[lblk]){
+            //hole
+            memset(buf+read_cnt, 0, chunk);
+        }
+        else if(0 != (FRAME_BAD & g_all_data.flags[ino->blocks[lblk]])){
+            //failed its checksum
+            break;
+        }
+        else if(bs == chunk){
+            memcpy(buf+read_cnt, frame, bs);
+        }
+        else{
+            memcpy(buf+read_cnt, frame+in_block, chunk);
+        }
+
+        read_cnt += chunk;
+        pos += chunk;
+        lblk++;
+    }
+
+    return read_cnt;
+}
+
+//pending, when not NULL, tracks the one block whose write-back is deferred
+//until it fills
+static _ALWAYS_INLINE uint32_t _write_at(Inode* ino, uint16_t* pending,
+    uint32_t pos, const uint8_t* buf, uint32_t len, const uint32_t bs)
+{
+    const uint32_t shift = __builtin_ctz(bs);
+    uint32_t lblk = pos >> shift;
+    uint32_t write_cnt = 0;
+
+    //blocks skipped over are left as holes
+    if( (ino->block_num < lblk)&&(0 == ino->mapped)&&(-1 == _inode_make_mapped(ino)) ){
+        return 0;
+    }
+
+    while(write_cnt < len){
+        uint32_t in_block = pos & (bs-1);
+        uint32_t chunk = my_min(bs-in_block, len-write_cnt);
+        if( (ino->block_num <= lblk)||(0 == ino->blocks[lblk]) ){
+            int32_t new_idx = _inode_alloc_block(ino, lblk);
+            if(-1 == new_idx){
+                //disk full
+                break;
+            }
+            if(bs != chunk){
+                memset(_frame(new_idx), 0, bs);
+            }
+        }
+
+        uint16_t block_idx = ino->blocks[lblk];
+        if( (0 != _block_shared(block_idx))&&(0 == (block_idx = _inode_unshare_block(ino, lblk))) ){
+            //disk full
+            break;
+        }
+        uint8_t* frame = _frame(block_idx);
+        if(bs == chunk){
+            memcpy(frame, buf+write_cnt, bs);
+        }
+        else{
+            memcpy(frame+in_block, buf+write_cnt, chunk);
+        }
+
+        if( (NULL != pending)&&(bs > in_block+chunk) ){
+            //block not filled yet, the cache absorbs the write
+            if( (block_idx != *pending)&&(-1 == _flush_pending(pending)) ){
+                break;
+            }
+            *pending = block_idx;
+            g_all_data.flags[block_idx] |= FRAME_DIRTY;
+        }
+        else{
+            if(-1 == _frames_write(block_idx, 1)){
+                break;
+            }
+            g_all_data.flags[block_idx] &= ~FRAME_DIRTY;
+            if( (NULL != pending)&&(block_idx == *pending) ){
+                *pending = 0;
+            }
+        }
+
+        write_cnt += chunk;
+        pos += chunk;
+        lblk++;
+    }
+
+    return write_cnt;
+}
+
+//whether the bytes from pos to pos+len of a file all fall in holes
+static int _range_is_hole(const Inode* ino, uint32_t pos, uint32_t len)
+{
+    uint32_t last = (pos+len-1) >> g_blockShift;
+    for(uint32_t lblk = pos >> g_blockShift; lblk <= last; ++lblk){
+        if( (lblk < ino->block_num)&&(0 != ino->blocks[lblk]) ){
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+//write back logical blocks first to last of a file, runs of consecutive data
+//blocks in one go
+static int _write_back_blocks(const Inode* ino, uint32_t first, uint32_t last)
+{
+    for(uint32_t lblk = first; lblk <= last; ){
+        uint16_t start = ino->blocks[lblk];
+        if(0 == start){
+            //hole
+            lblk++;
+            continue;
+        }
+
+        uint32_t len = 1;
+        while( (lblk+len <= last)&&(ino->blocks[lblk+len] == start+len) ){
+            len++;
+        }
+        if(-1 == _frames_write(start, len)){
+            return -1;
+        }
+        for(uint32_t idx = start; idx < start+len; ++idx){
+            g_all_data.flags[idx] &= ~FRAME_DIRTY;
+        }
+        lblk += len;
+    }
+
+    return 0;
+}
+
+/*
+ * Compression. The blocks of a compressed file hold a stream of records, one
+ * per cluster of ZCLUSTER_SIZE bytes of content: a 32-bit length, with
+ * ZREC_RAW set when the cluster did not shrink and is stored as is, then the
+ * bytes. The number of clusters follows from file_size. The codec is of the
+ * LZ4 kind: a token with the lengths of literals and of a match in its two
+ * nibbles, longer lengths in extra bytes, the literals, then a 16-bit offset
+ * back to the match.
+ *
+ * The records are indexed on first access, and a cluster is decompressed when
+ * first read or written and then kept while the file is open. Changed clusters
+ * are compressed again when the last descriptor closes or on sync: the stream
+ * is rewritten from the first changed cluster on, the records of unchanged
+ * clusters after it moved as they are. Until then file_size stays at what the
+ * stream holds.
+ */
+#define ZCLUSTER_SIZE   (16384)
+#define ZREC_RAW        (0x80000000)
+#define LZ_HASH_BITS    (12)
+#define LZ_MIN_MATCH    (4)
+
+static uint32_t _lz_read32(const uint8_t* data)
+{
+    uint32_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+//length past what a nibble holds: 255 while more follows, then the rest
+static uint32_t _lz_put_len(uint8_t* dst, uint32_t op, uint32_t len)
+{
+    for( ; 255 <= len; len -= 255){
+        dst[op++] = 255;
+    }
+    dst[op++] = len;
+    return op;
+}
+
+static int _lz_get_len(const uint8_t* src, uint32_t len, uint32_t* ip, uint32_t* val)
+{
+    uint8_t byte = 255;
+    while(255 == byte){
+        if(*ip >= len){
+            return -1;
+        }
+        byte = src[(*ip)++];
+        *val += byte;
+    }
+    return 0;
+}
+
+//offset 0 ends the stream with literals only
+static uint32_t _lz_put_seq(uint8_t* dst, uint32_t op, const uint8_t* lit, uint32_t lit_len,
+    uint32_t offset, uint32_t match_len)
+{
+    uint32_t match_code = (0 != offset)?(match_len-LZ_MIN_MATCH):0;
+    dst[op++] = (my_min(lit_len, 15) << 4) | my_min(match_code, 15);
+    if(15 <= lit_len){
+        op = _lz_put_len(dst, op, lit_len-15);
+    }
+    memcpy(dst+op, lit, lit_len);
+    op += lit_len;
+    if(0 != offset){
+        dst[op++] = offset & 0xFF;
+        dst[op++] = offset >> 8;
+        if(15 <= match_code){
+            op = _lz_put_len(dst, op, match_code-15);
+        }
+    }
+    return op;
+}
+
+//compress len bytes into at most cap, return the compressed length or 0 if
+//it does not fit. Matches are found through a hash of the next 4 bytes; the
+//search steps further after each miss so that data that does not compress
+//costs little
+static uint32_t _lz_compress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];    //position+1 of the last 4 bytes with that hash
+    memset(table, 0, sizeof(table));
+
+    uint32_t pos = 0;
+    uint32_t anchor = 0;
+    uint32_t op = 0;
+    uint32_t miss = 0;
+    while(pos+LZ_MIN_MATCH <= len){
+        uint32_t seq = _lz_read32(src+pos);
+        uint32_t hash = (seq*2654435761u) >> (32-LZ_HASH_BITS);
+        uint32_t ref = table[hash];
+        table[hash] = pos+1;
+        if( (0 == ref)||(UINT16_MAX < pos-(ref-1))||(seq != _lz_read32(src+ref-1)) ){
+            pos += 1+(miss++ >> 5);
+            continue;
+        }
+
+        ref--;
+        uint32_t match_len = LZ_MIN_MATCH;
+        while( (pos+match_len < len)&&(src[ref+match_len] == src[pos+match_len]) ){
+            match_len++;
+        }
+        uint32_t lit_len = pos-anchor;
+        if(cap-op < 1+lit_len/255+1+lit_len+2+match_len/255+1){
+            return 0;
+        }
+        op = _lz_put_seq(dst, op, src+anchor, lit_len, pos-ref, match_len);
+        pos += match_len;
+        anchor = pos;
+        miss = 0;
+    }
+
+    uint32_t lit_len = len-anchor;
+    if(0 != lit_len){
+        if(cap-op < 1+lit_len/255+1+lit_len){
+            return 0;
+        }
+        op = _lz_put_seq(dst, op, src+anchor, lit_len, 0, 0);
+    }
+    return op;
+}
+
+//decompress len bytes that must give exactly out_len
+static int _lz_decompress(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t out_len)
+{
+    uint32_t ip = 0;
+    uint32_t op = 0;
+    while(ip < len){
+        uint8_t token = src[ip++];
+        uint32_t lit_len = token >> 4;
+        if( ( (15 == lit_len)&&(-1 == _lz_get_len(src, len, &ip, &lit_len)) )
+            ||(len-ip < lit_len)||(out_len-op < lit_len) ){
+            return -1;
+        }
+        memcpy(dst+op, src+ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if(ip == len){
+            break;
+        }
+
+        if(2 > len-ip){
+            return -1;
+        }
+        uint32_t offset = src[ip] | ((uint32_t)src[ip+1] << 8);
+        ip += 2;
+        uint32_t match_len = token & 0x0F;
+        if( (15 == match_len)&&(-1 == _lz_get_len(src, len, &ip, &match_len)) ){
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if( (0 == offset)||(op < offset)||(out_len-op < match_len) ){
+            return -1;
+        }
+        if(offset >= match_len){
+            memcpy(dst+op, dst+op-offset, match_len);
+        }
+        else{
+            //overlapping, repeats the last offset bytes
+            for(uint32_t cnt = 0; cnt < match_len; ++cnt){
+                dst[op+cnt] = dst[op-offset+cnt];
+            }
+        }
+        op += match_len;
+    }
+
+    return (op == out_len)?0:-1;
+}
+
+static uint32_t _zcluster_num(uint32_t size)
+{
+    return ((uint64_t)size+ZCLUSTER_SIZE-1)/ZCLUSTER_SIZE;
+}
+
+//make room for the clusters of len bytes of content
+static int _zreserve(Inode* ino, uint32_t len)
+{
+    uint32_t cl_num = _zcluster_num(len);
+    if(cl_num <= ino->zcl_cap){
+        return 0;
+    }
+
+    uint32_t cap = my_max(ino->zcl_cap*2, cl_num);
+    uint8_t** zcl = (uint8_t**)realloc(ino->zcl, cap*sizeof(uint8_t*));
+    if(NULL == zcl){
+        return -1;
+    }
+    ino->zcl = zcl;
+    uint8_t* zcl_dirty = (uint8_t*)realloc(ino->zcl_dirty, cap);
+    if(NULL == zcl_dirty){
+        return -1;
+    }
+    ino->zcl_dirty = zcl_dirty;
+    memset(zcl+ino->zcl_cap, 0, (cap-ino->zcl_cap)*sizeof(uint8_t*));
+    memset(zcl_dirty+ino->zcl_cap, 0, cap-ino->zcl_cap);
+    ino->zcl_cap = cap;
+    return 0;
+}
+
+//read len bytes of the stream from pos on, -1 if they cannot all be read
+static int _zstream_read(const Inode* ino, uint32_t pos, uint8_t* buf, uint32_t len)
+{
+    uint32_t read_len = 0;
+    if(0 != len){
+        _BLOCK_SIZE_DISPATCH(read_len, _read_at, ino, pos, buf, len);
+    }
+    return (read_len == len)?0:-1;
+}
+
+//find the record of every cluster, once, from their headers. Fails if the
+//stream is damaged or runs into a block that failed its checksum
+static int _zindex(Inode* ino)
+{
+    if(NULL != ino->zoff){
+        return 0;
+    }
+
+    uint32_t cl_num = _zcluster_num(ino->size);
+    uint64_t stream_len = my_min((uint64_t)ino->block_num << g_blockShift, UINT32_MAX);
+    uint32_t* zoff = (uint32_t*)malloc((cl_num+1)*sizeof(uint32_t));
+    if( (NULL == zoff)||(-1 == _zreserve(ino, ino->size)) ){
+        free(zoff);
+        return -1;
+    }
+
+    uint64_t off = 0;
+    for(uint32_t cl = 0; cl < cl_num; ++cl){
+        uint32_t raw_len = my_min(ZCLUSTER_SIZE, ino->size-cl*ZCLUSTER_SIZE);
+        uint32_t head = 0;
+        zoff[cl] = off;
+        if( (off+sizeof(head) > stream_len)||(-1 == _zstream_read(ino, off, (uint8_t*)&head, sizeof(head))) ){
+            free(zoff);
+            return -1;
+        }
+        off += sizeof(head)+(head & ~ZREC_RAW);
+        if( (off > stream_len)||( (0 != (ZREC_RAW & head))&&((head & ~ZREC_RAW) != raw_len) ) ){
+            free(zoff);
+            return -1;
+        }
+    }
+    zoff[cl_num] = off;
+
+    ino->zoff = zoff;
+    ino->zsize = ino->size;
+    ino->zstored = cl_num;
+    return 0;
+}
+
+//the content of cluster cl, decompressed on first use, zeros past the stream.
+//NULL if its record is damaged or runs into a block that failed its checksum
+static uint8_t* _zcluster(Inode* ino, uint32_t cl)
+{
+    if(NULL != ino->zcl[cl]){
+        return ino->zcl[cl];
+    }
+
+    uint8_t* raw = (uint8_t*)calloc(1, ZCLUSTER_SIZE);
+    if(NULL == raw){
+        return NULL;
+    }
+    if(cl < ino->zstored){
+        uint32_t raw_len = my_min(ZCLUSTER_SIZE, ino->zsize-cl*ZCLUSTER_SIZE);
+        uint32_t rec_len = ino->zoff[cl+1]-ino->zoff[cl];
+        uint8_t* rec = (uint8_t*)malloc(rec_len);
+        int ret = (NULL == rec)?-1:_zstream_read(ino, ino->zoff[cl], rec, rec_len);
+        if(0 == ret){
+            uint32_t head;
+            memcpy(&head, rec, sizeof(head));
+            if(0 != (ZREC_RAW & head)){
+                memcpy(raw, rec+sizeof(head), raw_len);
+            }
+            else{
+                ret = _lz_decompress(rec+sizeof(head), rec_len-sizeof(head), raw, raw_len);
+            }
+        }
+        free(rec);
+        if(-1 == ret){
+            free(raw);
+            return NULL;
+        }
+    }
+
+    ino->zcl[cl] = raw;
+    return raw;
+}
+
+static void _zmark(Inode* ino, uint32_t cl)
+{
+    ino->zcl_dirty[cl] = 1;
+    ino->zdirty = my_min(ino->zdirty, cl);
+}
+
+//set the size: the cluster of the old end grows, or the one of the new end
+//is cut, and the clusters past the new end are dropped
+static int _zresize(Inode* ino, uint32_t length)
+{
+    uint32_t edge = my_min(ino->size, length);
+    if(0 != (edge % ZCLUSTER_SIZE)){
+        uint8_t* raw = _zcluster(ino, edge/ZCLUSTER_SIZE);
+        if(NULL == raw){
+            return -1;
+        }
+        memset(raw+edge%ZCLUSTER_SIZE, 0, ZCLUSTER_SIZE-edge%ZCLUSTER_SIZE);
+        _zmark(ino, edge/ZCLUSTER_SIZE);
+    }
+    ino->zdirty = my_min(ino->zdirty, edge/ZCLUSTER_SIZE);
+
+    uint32_t cl_num = _zcluster_num(length);
+    for(uint32_t cl = cl_num; cl < _zcluster_num(ino->size); ++cl){
+        free(ino->zcl[cl]);
+        ino->zcl[cl] = NULL;
+        ino->zcl_dirty[cl] = 0;
+    }
+    ino->zstored = my_min(ino->zstored, cl_num);
+    ino->size = length;
+    return 0;
+}
+
+static uint32_t _zread(Inode* ino, uint32_t pos, uint8_t* buf, uint32_t len)
+{
+    len = (ino->size > pos)?my_min(len, ino->size-pos):0;
+    if( (0 == len)||(-1 == _zindex(ino)) ){
+        return 0;
+    }
+
+    uint32_t read_cnt = 0;
+    while(read_cnt < len){
+        uint32_t at = pos+read_cnt;
+        uint32_t chunk = my_min(ZCLUSTER_SIZE-at%ZCLUSTER_SIZE, len-read_cnt);
+        const uint8_t* raw = _zcluster(ino, at/ZCLUSTER_SIZE);
+        if(NULL == raw){
+            break;
+        }
+        memcpy(buf+read_cnt, raw+at%ZCLUSTER_SIZE, chunk);
+        read_cnt += chunk;
+    }
+    return read_cnt;
+}
+
+//check the disk has room for _zstore to write the stream again from cluster
+//first on, were every cluster of the size bytes stored as is
+static int _zroom(const Inode* ino, uint32_t first, uint32_t size)
+{
+    uint32_t cl_num = _zcluster_num(size);
+    first = my_min(first, cl_num);
+    uint64_t start = ino->zoff[first];
+    uint64_t end = start+(uint64_t)(cl_num-first)*sizeof(uint32_t)+(size-first*ZCLUSTER_SIZE);
+    uint32_t first_blk = start >> g_blockShift;
+    if(UINT32_MAX < end){
+        return -1;
+    }
+    uint32_t num = _blocks_for_len(end)-first_blk;
+    return (g_FATInfo.free_num < _inode_swap_need(ino, first_blk, num))?-1:0;
+}
+
+//a gap before pos reads as zeros. Nothing is written if the disk could not
+//take the content stored as is
+static uint32_t _zwrite(Inode* ino, uint32_t pos, const uint8_t* buf, uint32_t len)
+{
+    len = my_min(len, UINT32_MAX-pos);
+    uint32_t end = pos+len;
+    if( (0 == len)||(-1 == _zindex(ino))
+        ||(-1 == _zroom(ino, my_min(my_min(ino->zdirty, ino->zstored), my_min(pos, ino->size)/ZCLUSTER_SIZE), my_max(end, ino->size)))
+        ||(-1 == _zreserve(ino, my_max(end, ino->size)))
+        ||( (ino->size < pos)&&(-1 == _zresize(ino, pos)) ) ){
+        return 0;
+    }
+
+    //the cluster of the old end is among those written once past the gap
+    uint32_t write_cnt = 0;
+    while(write_cnt < len){
+        uint32_t at = pos+write_cnt;
+        uint32_t chunk = my_min(ZCLUSTER_SIZE-at%ZCLUSTER_SIZE, len-write_cnt);
+        uint8_t* raw = _zcluster(ino, at/ZCLUSTER_SIZE);
+        if(NULL == raw){
+            break;
+        }
+        memcpy(raw+at%ZCLUSTER_SIZE, buf+write_cnt, chunk);
+        _zmark(ino, at/ZCLUSTER_SIZE);
+        write_cnt += chunk;
+    }
+    ino->size = my_max(ino->size, pos+write_cnt);
+    return write_cnt;
+}
+
+static int _ztruncate(Inode* ino, uint32_t length)
+{
+    if( (-1 == _zindex(ino))||(-1 == _zreserve(ino, length)) ){
+        return -1;
+    }
+    return _zresize(ino, length);
+}
+
+//compress the clusters from the first changed one on. The new end of the
+//stream goes to fresh blocks, the block holding its start copied, and only
+//once they are written do they take the place of the old ones, with the size:
+//until then the entry still describes the old stream. If that fails nothing
+//changed and the changes stay to store again
+static int _zstore(Inode* ino)
+{
+    if( (NULL == ino->zoff)||(UINT32_MAX == ino->zdirty) ){
+        return 0;
+    }
+
+    //the records follow what the first block rewritten keeps of the stream
+    uint32_t size = ino->size;
+    uint32_t cl_num = _zcluster_num(size);
+    uint32_t first = my_min(my_min(ino->zdirty, ino->zstored), cl_num);
+    const uint32_t start = ino->zoff[first];
+    const uint32_t first_blk = start >> g_blockShift;
+    const uint32_t keep = start & (g_blockSize-1);
+    uint32_t* zoff = (uint32_t*)malloc((cl_num+1)*sizeof(uint32_t));
+    uint8_t* rec = (uint8_t*)malloc(keep+my_max((size_t)(cl_num-first)*(sizeof(uint32_t)+ZCLUSTER_SIZE), 1));
+    int ret = ( (NULL == zoff)||(NULL == rec) )?-1:_zstream_read(ino, first_blk << g_blockShift, rec, keep);
+
+    uint32_t len = keep;
+    for(uint32_t cl = first; (0 == ret)&&(cl < cl_num); ++cl){
+        zoff[cl] = (first_blk << g_blockShift)+len;
+        if( (cl < ino->zstored)&&(0 == ino->zcl_dirty[cl]) ){
+            //unchanged, the record moves as it is
+            uint32_t rec_len = ino->zoff[cl+1]-ino->zoff[cl];
+            ret = _zstream_read(ino, ino->zoff[cl], rec+len, rec_len);
+            len += rec_len;
+            continue;
+        }
+
+        const uint8_t* raw = _zcluster(ino, cl);
+        if(NULL == raw){
+            ret = -1;
+            break;
+        }
+        uint32_t raw_len = my_min(ZCLUSTER_SIZE, size-cl*ZCLUSTER_SIZE);
+        uint8_t* out = rec+len+sizeof(uint32_t);
+        uint32_t head = _lz_compress(raw, raw_len, out, raw_len-1);
+        if(0 == head){
+            //does not shrink
+            memcpy(out, raw, raw_len);
+            head = raw_len | ZREC_RAW;
+        }
+        memcpy(rec+len, &head, sizeof(head));
+        len += sizeof(head)+(head & ~ZREC_RAW);
+    }
+    if(0 == ret){
+        memcpy(zoff, ino->zoff, first*sizeof(uint32_t));
+        zoff[cl_num] = (first_blk << g_blockShift)+len;
+    }
+
+    uint32_t num = _blocks_for_len(len);
+    if( (0 == ret)&&( (UINT32_MAX-(first_blk << g_blockShift) < len)
+        ||(g_FATInfo.free_num < _inode_swap_need(ino, first_blk, num))
+        ||(-1 == _inode_reserve_blocks(ino, (first_blk+num > ino->block_num)?(first_blk+num-ino->block_num):0)) ) ){
+        ret = -1;
+    }
+    uint16_t chain = (0 == ret)?_take_chain(num):FAT_EOC;
+    uint16_t block_idx = chain;
+    for(uint32_t cnt = 0; (0 == ret)&&(cnt < num); ++cnt){
+        uint32_t chunk = my_min(g_blockSize, len-(cnt << g_blockShift));
+        memcpy(_frame(block_idx), rec+((size_t)cnt << g_blockShift), chunk);
+        memset(_frame(block_idx)+chunk, 0, g_blockSize-chunk);
+        block_idx = g_FATInfo.data[block_idx];
+    }
+    free(rec);
+    if( (0 == ret)&&(-1 == _chain_write(chain, num)) ){
+        ret = -1;
+    }
+
+    if(-1 == ret){
+        for(block_idx = chain; (0 != num)&&(FAT_EOC != block_idx); ){
+            uint16_t next = g_FATInfo.data[block_idx];
+            _release_FAT(block_idx);
+            block_idx = next;
+        }
+        _free_run_flush();
+        free(zoff);
+        return -1;
+    }
+
+    _inode_swap_tail(ino, first_blk, chain, num);
+    _inode_set_size(ino, size);
+    free(ino->zoff);
+    ino->zoff = zoff;
+    ino->zsize = size;
+    ino->zstored = cl_num;
+    memset(ino->zcl_dirty, 0, cl_num);
+    ino->zdirty = UINT32_MAX;
+    return 0;
+}
+
+//store every open compressed file
+static int _zstore_all(void)
+{
+    int ret = 0;
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        Inode* ino = &(g_inodes[idx]);
+        if( (0 != ino->refcnt)&&(0 != ino->compressed) ){
+            pthread_mutex_lock(&(ino->lock));
+            ret |= _zstore(ino);
+            pthread_mutex_unlock(&(ino->lock));
+        }
+    }
+    return ret;
+}
+
+/*
+ * Packing. With FS_OPT_PACK a file of at most half a block starts out in a
+ * run of slots, 1/64th of a block each, of a fragment block shared with other
+ * small files: its entry points at the block, with FE_FLAG_PACKED and the
+ * byte offset of the run in frag_off. Each file is one owner of the block in
+ * the reference counts. A packed file that grows past half a block gets a
+ * block of its own. A fragment block also owned by a snapshot is left alone:
+ * a file in it moves out before it is written.
+ */
+#define FRAG_SLOT_NUM   (64)
+
+static uint32_t _frag_max(void)
+{
+    return g_blockSize/2;
+}
+
+static uint32_t _frag_slots(uint32_t len)
+{
+    uint32_t slot_len = g_blockSize/FRAG_SLOT_NUM;
+    return ((uint64_t)len+slot_len-1)/slot_len;
+}
+
+static uint64_t _frag_bits(uint32_t first, uint32_t num)
+{
+    return (FRAG_SLOT_NUM == num)?UINT64_MAX:((((uint64_t)1 << num)-1) << first);
+}
+
+static Frag* _frag_find(uint16_t block_idx)
+{
+    for(uint32_t cnt = 0; cnt < FS_FILE_MAX_COUNT; ++cnt){
+        if(block_idx == g_frags[cnt].block_idx){
+            return &(g_frags[cnt]);
+        }
+    }
+    return NULL;
+}
+
+//owned by more than its packed files
+static int _frag_shared(const Frag* frag)
+{
+    return (NULL != g_refcnt.data)&&(g_refcnt.data[frag->block_idx] >= frag->owners);
+}
+
+//the slots in use, from the packed files of the root directory
+static void _frag_load(void)
+{
+    memset(g_frags, 0, sizeof(g_frags));
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        const File_Entry* pFE = &(g_rootDirInfo.files[idx]);
+        if( (0 == (FE_FLAG_PACKED & pFE->flags))||(g_FATLen <= pFE->start_data_block_idx) ){
+            continue;
+        }
+
+        Frag* frag = _frag_find(pFE->start_data_block_idx);
+        if(NULL == frag){
+            frag = _frag_find(0);
+            frag->block_idx = pFE->start_data_block_idx;
+        }
+        uint32_t first = pFE->frag_off/(g_blockSize/FRAG_SLOT_NUM);
+        uint32_t num = _frag_slots(pFE->file_size);
+        frag->owners++;
+        if(first+num <= FRAG_SLOT_NUM){
+            frag->used |= _frag_bits(first, num);
+        }
+    }
+}
+
+//num free slots in a run, in a fragment block not shared with a snapshot or
+//else in a new one
+static Frag* _frag_alloc(uint32_t num, uint32_t* first)
+{
+    for(uint32_t cnt = 0; cnt < FS_FILE_MAX_COUNT; ++cnt){
+        Frag* frag = &(g_frags[cnt]);
+        if( (0 == frag->block_idx)||(0 != _frag_shared(frag)) ){
+            continue;
+        }
+        uint32_t slot = 0;
+        while( (slot+num <= FRAG_SLOT_NUM)&&(0 != (frag->used & _frag_bits(slot, num))) ){
+            slot++;
+        }
+        if(slot+num > FRAG_SLOT_NUM){
+            continue;
+        }
+
+        //sharing needs the refcount table, without it the file takes a new block
+        if(-1 == _refcnt_init()){
+            break;
+        }
+        _get_block(frag->block_idx);
+        frag->used |= _frag_bits(slot, num);
+        frag->owners++;
+        *first = slot;
+        return frag;
+    }
+
+    Frag* frag = _frag_find(0);
+    int32_t new_idx = _find_empty_FAT();
+    if( (NULL == frag)||(-1 == new_idx) ){
+        return NULL;
+    }
+    _take_FAT(new_idx, FAT_EOC);
+    memset(_frame(new_idx), 0, g_blockSize);
+    frag->block_idx = new_idx;
+    frag->used = _frag_bits(0, num);
+    frag->owners = 1;
+    *first = 0;
+    return frag;
+}
+
+//give back the slots of a packed file, not its entry
+static void _frag_release(const Inode* ino)
+{
+    const File_Entry* pFE = &(g_rootDirInfo.files[ino->idx]);
+    Frag* frag = _frag_find(pFE->start_data_block_idx);
+    uint32_t first = pFE->frag_off/(g_blockSize/FRAG_SLOT_NUM);
+    frag->used &= ~_frag_bits(first, _frag_slots(ino->size));
+    frag->owners--;
+    _put_block(frag->block_idx);
+    if(0 == frag->owners){
+        frag->block_idx = 0;
+        frag->used = 0;
+    }
+}
+
+static uint8_t* _pack_data(const Inode* ino)
+{
+    const File_Entry* pFE = &(g_rootDirInfo.files[ino->idx]);
+    return _frame(pFE->start_data_block_idx)+pFE->frag_off;
+}
+
+//make room for len bytes, in place when the slots after it are free, or by
+//moving the file, which becomes packed if it was empty
+static int _pack_resize(Inode* ino, uint32_t len)
+{
+    File_Entry* pFE = &(g_rootDirInfo.files[ino->idx]);
+    uint32_t num = _frag_slots(len);
+    if(0 != ino->packed){
+        Frag* frag = _frag_find(pFE->start_data_block_idx);
+        uint32_t first = pFE->frag_off/(g_blockSize/FRAG_SLOT_NUM);
+        uint32_t old_num = _frag_slots(ino->size);
+        if( (0 == _frag_shared(frag))&&(num <= old_num) ){
+            frag->used &= ~_frag_bits(first+num, old_num-num);
+            return 0;
+        }
+        if( (0 == _frag_shared(frag))&&(first+num <= FRAG_SLOT_NUM)
+            &&(0 == (frag->used & _frag_bits(first+old_num, num-old_num))) ){
+            frag->used |= _frag_bits(first+old_num, num-old_num);
+            return 0;
+        }
+    }
+
+    uint32_t first = 0;
+    Frag* frag = _frag_alloc(num, &first);
+    if(NULL == frag){
+        return -1;
+    }
+
+    uint8_t* data = _frame(frag->block_idx)+first*(g_blockSize/FRAG_SLOT_NUM);
+    if(0 != ino->packed){
+        memcpy(data, _pack_data(ino), my_min(ino->size, len));
+        _frag_release(ino);
+    }
+    g_all_data.flags[frag->block_idx] |= FRAME_DIRTY;
+    pFE->start_data_block_idx = frag->block_idx;
+    pFE->frag_off = first*(g_blockSize/FRAG_SLOT_NUM);
+    pFE->flags |= FE_FLAG_PACKED;
+    ino->packed = 1;
+    return 0;
+}
+
+//move the content of a packed file to a block of its own
+static int _pack_undo(Inode* ino)
+{
+    File_Entry* pFE = &(g_rootDirInfo.files[ino->idx]);
+    int32_t new_idx = _find_empty_FAT();
+    if( (-1 == new_idx)||(-1 == _inode_reserve_blocks(ino, 1)) ){
+        return -1;
+    }
+
+    _take_FAT(new_idx, FAT_EOC);
+    memset(_frame(new_idx), 0, g_blockSize);
+    memcpy(_frame(new_idx), _pack_data(ino), ino->size);
+    g_all_data.flags[new_idx] |= FRAME_DIRTY;
+    _frag_release(ino);
+
+    pFE->start_data_block_idx = new_idx;
+    pFE->frag_off = 0;
+    pFE->flags &= ~FE_FLAG_PACKED;
+    ino->packed = 0;
+    ino->blocks[0] = new_idx;
+    ino->block_num = 1;
+    ino->tail_block = new_idx;
+    return 0;
+}
+
+/*
+ * Get a file ready to be written up to end: 1 if the write goes to its slots,
+ * 0 if it goes to blocks, the file was never packed or just left its fragment
+ * block, -1 if that failed.
+ */
+static int _pack_prepare(Inode* ino, uint64_t end)
+{
+    if( (0 == ino->packed)
+        &&( (0 == g_pack)||(0 != ino->size)||(0 != ino->block_num)||(0 != ino->mapped)
+            ||(0 != ino->compressed)||(0 == end)||(end > _frag_max()) ) ){
+        return 0;
+    }
+    if(end > _frag_max()){
+        return _pack_undo(ino);
+    }
+    //also moves the file out of a fragment block shared with a snapshot
+    if(-1 == _pack_resize(ino, my_max(end, ino->size))){
+        return -1;
+    }
+
+    //the fragment block is written back when the last descriptor closes
+    ino->tail_block = g_rootDirInfo.files[ino->idx].start_data_block_idx;
+    return 1;
+}
+
+//after _pack_prepare(), a gap before pos reads as zeros
+static uint32_t _pack_write(Inode* ino, uint32_t pos, const uint8_t* buf, uint32_t len)
+{
+    uint8_t* data = _pack_data(ino);
+    if(ino->size < pos){
+        memset(data+ino->size, 0, pos-ino->size);
+    }
+    memcpy(data+pos, buf, len);
+    g_all_data.flags[g_rootDirInfo.files[ino->idx].start_data_block_idx] |= FRAME_DIRTY;
+    if(ino->size < pos+len){
+        _inode_set_size(ino, pos+len);
+    }
+    return len;
+}
+
+static uint32_t _pack_read(const Inode* ino, uint32_t pos, uint8_t* buf, uint32_t len)
+{
+    len = (ino->size > pos)?my_min(len, ino->size-pos):0;
+    if( (0 == len)||(0 != (FRAME_BAD & g_all_data.flags[g_rootDirInfo.files[ino->idx].start_data_block_idx])) ){
+        return 0;
+    }
+
+    memcpy(buf, _pack_data(ino)+pos, len);
+    return len;
+}
+
+static int _pack_truncate(Inode* ino, uint32_t length)
+{
+    File_Entry* pFE = &(g_rootDirInfo.files[ino->idx]);
+    if(0 == length){
+        //back to an empty file
+        if(ino->tail_block == pFE->start_data_block_idx){
+            ino->tail_block = 0;
+        }
+        _frag_release(ino);
+        pFE->start_data_block_idx = FAT_EOC;
+        pFE->frag_off = 0;
+        pFE->flags &= ~FE_FLAG_PACKED;
+        ino->packed = 0;
+        _inode_set_size(ino, 0);
+        return 0;
+    }
+    if(length > _frag_max()){
+        return ( (-1 == _pack_undo(ino))||(-1 == _inode_truncate(ino, length)) )?-1:0;
+    }
+
+    if(-1 == _pack_resize(ino, length)){
+        return -1;
+    }
+    if(ino->size < length){
+        memset(_pack_data(ino)+ino->size, 0, length-ino->size);
+    }
+    g_all_data.flags[pFE->start_data_block_idx] |= FRAME_DIRTY;
+    ino->tail_block = pFE->start_data_block_idx;
+    _inode_set_size(ino, length);
+    return 0;
+}
+
+//read, write or truncate a file whatever the way its blocks hold the data
+static uint32_t _file_read(Inode* ino, uint32_t pos, uint8_t* buf, uint32_t len)
+{
+    if(0 != ino->compressed){
+        return _zread(ino, pos, buf, len);
+    }
+    if(0 != ino->packed){
+        return _pack_read(ino, pos, buf, len);
+    }
+
+    uint32_t read_cnt = 0;
+    len = (ino->size > pos)?my_min(len, ino->size-pos):0;
+    _BLOCK_SIZE_DISPATCH(read_cnt, _read_at, ino, pos, buf, len);
+    return read_cnt;
+}
+
+static uint32_t _file_write(Inode* ino, uint32_t pos, const uint8_t* buf, uint32_t len)
+{
+    if(0 != ino->compressed){
+        return _zwrite(ino, pos, buf, len);
+    }
+    int packed = _pack_prepare(ino, (uint64_t)pos+len);
+    if(-1 == packed){
+        return 0;
+    }
+    if(1 == packed){
+        return _pack_write(ino, pos, buf, len);
+    }
+
+    uint32_t write_cnt = 0;
+    if( (ino->size < pos)&&(-1 == _inode_truncate(ino, pos)) ){
+        return 0;
+    }
+    _BLOCK_SIZE_DISPATCH(write_cnt, _write_at, ino, NULL, pos, buf, len);
+    if(ino->size < pos+write_cnt){
+        _inode_set_size(ino, pos+write_cnt);
+    }
+    return write_cnt;
+}
+
+static int _file_truncate(Inode* ino, uint32_t length)
+{
+    if(0 != ino->compressed){
+        return _ztruncate(ino, length);
+    }
+    return (0 != ino->packed)?_pack_truncate(ino, length):_inode_truncate(ino, length);
+}
+
+/*
+ * Deduplication. With FS_OPT_DEDUP a block written whole is looked up by its
+ * CRC32C among the blocks of mapped files: when one holds the same bytes, the
+ * file maps that block instead, as one more owner in the reference counts,
+ * and nothing is written. A write to a shared block copies it first, as for
+ * clones. The FAT links of a chained file cannot be shared, so only blocks of
+ * mapped files are indexed and a file gets map blocks on its first whole
+ * block written. A block leaves the index when it is freed or written again;
+ * the bytes are compared before sharing in case its frame changed since.
+ */
+#define DEDUP_PROBE_MAX (64)
+
+static int _dedup_alloc(void)
+{
+    if(NULL != g_dedupIndex.table){
+        return 0;
+    }
+
+    uint32_t slot_num = 1;
+    while(slot_num < 2*g_FATLen){
+        slot_num <<= 1;
+    }
+    g_dedupIndex.hash = (uint32_t*)malloc(g_FATLen*sizeof(uint32_t));
+    g_dedupIndex.table = (uint16_t*)calloc(slot_num, sizeof(uint16_t));
+    if( (NULL == g_dedupIndex.hash)||(NULL == g_dedupIndex.table) ){
+        free(g_dedupIndex.hash);
+        free(g_dedupIndex.table);
+        g_dedupIndex.hash = NULL;
+        g_dedupIndex.table = NULL;
+        return -1;
+    }
+    g_dedupIndex.mask = slot_num-1;
+    return 0;
+}
+
+static void _dedup_reset(void)
+{
+    free(g_dedupIndex.hash);
+    g_dedupIndex.hash = NULL;
+    free(g_dedupIndex.table);
+    g_dedupIndex.table = NULL;
+    for(uint32_t idx = 0; (NULL != g_all_data.flags)&&(idx < g_FATLen); ++idx){
+        g_all_data.flags[idx] &= ~FRAME_DEDUP;
+    }
+}
+
+//a block with the same bytes as data, 0 if none
+static uint16_t _dedup_find(const uint8_t* data, uint32_t hash)
+{
+    uint32_t slot = hash & g_dedupIndex.mask;
+    for(uint32_t probe = 0; probe < DEDUP_PROBE_MAX; ++probe, slot = (slot+1) & g_dedupIndex.mask){
+        uint16_t block_idx = g_dedupIndex.table[slot];
+        if(0 == block_idx){
+            break;
+        }
+        if( (FRAME_DEDUP == ((FRAME_DEDUP | FRAME_BAD) & g_all_data.flags[block_idx]))
+            &&(hash == g_dedupIndex.hash[block_idx])
+            &&( (NULL == g_refcnt.data)||(UINT16_MAX > g_refcnt.data[block_idx]) )
+            &&(0 == memcmp(_frame(block_idx), data, g_blockSize)) ){
+            return block_idx;
+        }
+    }
+
+    return 0;
+}
+
+//a slot is taken over from a block that left the index, the block stays out
+//of it if the probes run out
+static void _dedup_add(uint16_t block_idx, uint32_t hash)
+{
+    g_dedupIndex.hash[block_idx] = hash;
+    uint32_t slot = hash & g_dedupIndex.mask;
+    for(uint32_t probe = 0; probe < DEDUP_PROBE_MAX; ++probe, slot = (slot+1) & g_dedupIndex.mask){
+        uint16_t old_idx = g_dedupIndex.table[slot];
+        if( (0 == old_idx)||(block_idx == old_idx)||(0 == (FRAME_DEDUP & g_all_data.flags[old_idx])) ){
+            g_dedupIndex.table[slot] = block_idx;
+            g_all_data.flags[block_idx] |= FRAME_DEDUP;
+            return;
+        }
+    }
+}
+
+//the index starts with the blocks of the mapped files
+static int _dedup_init(void)
+{
+    if(NULL != g_dedupIndex.table){
+        return 0;
+    }
+    if(-1 == _dedup_alloc()){
+        return -1;
+    }
+
+    const uint32_t entry_num = g_blockSize/sizeof(uint16_t);
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        const File_Entry* pFE = &(g_rootDirInfo.files[idx]);
+        if(0 == (FE_FLAG_MAPPED & pFE->flags)){
+            continue;
+        }
+        uint16_t map_idx = pFE->start_data_block_idx;
+        for(uint32_t cnt = 0; (0 != map_idx)&&(FAT_EOC != map_idx)&&(cnt < g_FATLen); ++cnt){
+            const uint16_t* entries = (const uint16_t*)_frame(map_idx);
+            for(uint32_t entry = 0; entry < entry_num; ++entry){
+                uint16_t block_idx = entries[entry];
+                if( (0 != block_idx)&&(0 == (FRAME_BAD & g_all_data.flags[block_idx])) ){
+                    _dedup_add(block_idx, g_csumKernel.one(_frame(block_idx), g_blockSize));
+                }
+            }
+            map_idx = g_FATInfo.data[map_idx];
+        }
+    }
+    return 0;
+}
+
+//map logical block lblk of a mapped file to block_idx, which has the same
+//bytes, and drop the block it had
+static int _dedup_map(Inode* ino, uint16_t* pending, uint32_t lblk, uint16_t block_idx)
+{
+    uint32_t more = (lblk < ino->block_num)?0:(lblk+1-ino->block_num);
+    if( (-1 == _refcnt_init())||(-1 == _inode_reserve_blocks(ino, more))
+        ||(-1 == _map_set(ino, lblk, block_idx)) ){
+        return -1;
+    }
+
+    _get_block(block_idx);
+    while(ino->block_num <= lblk){
+        ino->blocks[ino->block_num++] = 0;
+    }
+    uint16_t old_idx = ino->blocks[lblk];
+    ino->blocks[lblk] = block_idx;
+    if(0 != old_idx){
+        if(old_idx == ino->tail_block){
+            ino->tail_block = 0;
+        }
+        if( (NULL != pending)&&(old_idx == *pending) ){
+            *pending = 0;
+        }
+        _put_block(old_idx);
+    }
+    return 0;
+}
+
+//write whole blocks through the index, those already on the disk are shared
+static uint32_t _dedup_write(Inode* ino, uint16_t* pending, uint32_t pos, const uint8_t* buf, uint32_t len)
+{
+    uint32_t write_cnt = 0;
+    while(write_cnt < len){
+        uint32_t lblk = pos >> g_blockShift;
+        uint32_t chunk = my_min(g_blockSize-(pos & (g_blockSize-1)), len-write_cnt);
+        uint8_t whole = (g_blockSize == chunk)&&(0 == _dedup_init())
+            &&( (0 != ino->mapped)||(0 == _inode_make_mapped(ino)) );
+        uint32_t hash = (0 != whole)?g_csumKernel.one(buf+write_cnt, g_blockSize):0;
+        uint16_t match = (0 != whole)?_dedup_find(buf+write_cnt, hash):0;
+
+        //the same bytes as the block already there need no write either
+        uint8_t same = (0 != match)&&(lblk < ino->block_num)&&(match == ino->blocks[lblk]);
+        uint32_t cnt = chunk;
+        if( (0 == same)&&( (0 == match)||(-1 == _dedup_map(ino, pending, lblk, match)) ) ){
+            _BLOCK_SIZE_DISPATCH(cnt, _write_at, ino, pending, pos, buf+write_cnt, chunk);
+            if( (0 != whole)&&(chunk == cnt) ){
+                _dedup_add(ino->blocks[lblk], hash);
+            }
+        }
+
+        write_cnt += cnt;
+        pos += cnt;
+        if(cnt < chunk){
+            break;
+        }
+    }
+
+    return write_cnt;
+}
+
+//_copy_range() through a buffer, when either file is compressed or packed
+static int64_t _copy_range_bounce(Inode* src, uint32_t off_in, Inode* dst, uint32_t off_out, uint32_t len)
+{
+    uint8_t* buf = (uint8_t*)malloc(ZCLUSTER_SIZE);
+    if(NULL == buf){
+        return -1;
+    }
+
+    uint32_t copy_cnt = 0;
+    while(copy_cnt < len){
+        uint32_t chunk = my_min(ZCLUSTER_SIZE, len-copy_cnt);
+        uint32_t read_cnt = _file_read(src, off_in+copy_cnt, buf, chunk);
+        uint32_t write_cnt = (0 == read_cnt)?0:_file_write(dst, off_out+copy_cnt, buf, read_cnt);
+        copy_cnt += write_cnt;
+        if( (0 == write_cnt)||(write_cnt < chunk) ){
+            break;
+        }
+    }
+    free(buf);
+
+    return (0 == copy_cnt)?-1:copy_cnt;
+}
+
+/*
+ * Copy len bytes of src from off_in on to dst at off_out, without going
+ * through the caller. The destination blocks are allocated up front, as one
+ * extent when the file stays without holes, the data moves from frame to
+ * frame, and the destination is written back in runs of consecutive blocks.
+ * A destination block that would only get holes of the source stays a hole.
+ * Return the number of bytes copied, or -1 if nothing was.
+ */
+static int64_t _copy_range(Inode* src, uint32_t off_in, Inode* dst, uint32_t off_out, uint32_t len)
+{
+    len = (src->size > off_in)?my_min(len, src->size-off_in):0;
+    if(0 == len){
+        return 0;
+    }
+    if( (UINT32_MAX-off_out < len)
+        ||((src == dst)&&(off_in < off_out+len)&&(off_out < off_in+len)) ){
+        //too large, or overlapping
+        return -1;
+    }
+    if( (0 != src->compressed)||(0 != dst->compressed)||(0 != src->packed)||(0 != dst->packed)
+        ||( (0 != g_pack)&&(0 == dst->size)&&(0 == dst->block_num)&&(off_out+len <= _frag_max()) ) ){
+        return _copy_range_bounce(src, off_in, dst, off_out, len);
+    }
+
+    const uint32_t end = off_out+len;
+    const uint32_t first = off_out >> g_blockShift;
+    const uint32_t last = (end-1) >> g_blockShift;
+
+    //count the blocks to allocate, a hole left before one of them needs a
+    //mapped file
+    uint32_t need = 0;
+    uint8_t gap = (first > dst->block_num);
+    uint8_t skipped = 0;
+    for(uint32_t lblk = first; lblk <= last; ++lblk){
+        if( (lblk < dst->block_num)&&(0 != dst->blocks[lblk]) ){
+            //shared blocks get copied
+            need += _block_shared(dst->blocks[lblk]);
+            continue;
+        }
+
+        uint32_t d_start = my_max(lblk << g_blockShift, off_out);
+        uint32_t d_len = my_min((uint64_t)(lblk+1) << g_blockShift, end)-d_start;
+        if(0 != _range_is_hole(src, off_in+(d_start-off_out), d_len)){
+            skipped = 1;
+            continue;
+        }
+        gap |= skipped;
+        need++;
+    }
+
+    uint8_t mapped = (0 != dst->mapped)||(0 != gap);
+    uint32_t map_need = my_max(last, dst->block_num) >> (g_blockShift-1);
+    uint32_t map_more = ( (0 != mapped)&&(dst->map_num <= map_need) )?(map_need+1-dst->map_num):0;
+    if(g_FATInfo.free_num < need+map_more){
+        return -1;
+    }
+
+    if( (dst->size < off_out)&&(-1 == _inode_truncate(dst, off_out)) ){
+        return -1;
+    }
+    if( (0 != mapped)&&(0 == dst->mapped)&&(-1 == _inode_make_mapped(dst)) ){
+        return -1;
+    }
+
+    //blocks copied in part start zeroed
+    uint32_t old_block_num = dst->block_num;
+    if( (0 == dst->mapped)&&(0 != need) ){
+        if(-1 == _inode_append_blocks(dst, need)){
+            return -1;
+        }
+        for(uint32_t lblk = old_block_num; lblk < dst->block_num; ++lblk){
+            if( ((lblk == first)&&(0 != (off_out & (g_blockSize-1))))
+                ||((lblk == last)&&(0 != (end & (g_blockSize-1)))) ){
+                memset(_frame(dst->blocks[lblk]), 0, g_blockSize);
+            }
+        }
+    }
+    for(uint32_t lblk = first; (0 != dst->mapped)&&(lblk <= last); ++lblk){
+        if( (lblk < dst->block_num)&&(0 != dst->blocks[lblk]) ){
+            continue;
+        }
+
+        uint32_t d_start = my_max(lblk << g_blockShift, off_out);
+        uint32_t d_len = my_min((uint64_t)(lblk+1) << g_blockShift, end)-d_start;
+        if(0 != _range_is_hole(src, off_in+(d_start-off_out), d_len)){
+            continue;
+        }
+        int32_t new_idx = _inode_alloc_block(dst, lblk);
+        if(-1 == new_idx){
+            return -1;
+        }
+        memset(_frame(new_idx), 0, g_blockSize);
+    }
+
+    for(uint32_t done = 0; done < len; ){
+        uint32_t s_pos = off_in+done;
+        uint32_t d_pos = off_out+done;
+        uint32_t s_in = s_pos & (g_blockSize-1);
+        uint32_t d_in = d_pos & (g_blockSize-1);
+        uint32_t chunk = my_min(my_min(g_blockSize-s_in, g_blockSize-d_in), len-done);
+
+        uint32_t s_lblk = s_pos >> g_blockShift;
+        uint32_t d_lblk = d_pos >> g_blockShift;
+        uint16_t s_idx = (s_lblk < src->block_num)?src->blocks[s_lblk]:0;
+        uint16_t d_idx = (d_lblk < dst->block_num)?dst->blocks[d_lblk]:0;
+        if(0 != _block_shared(d_idx)){
+            d_idx = _inode_unshare_block(dst, d_lblk);
+        }
+        if(0 != d_idx){
+            if(0 == s_idx){
+                memset(_frame(d_idx)+d_in, 0, chunk);
+            }
+            else{
+                memcpy(_frame(d_idx)+d_in, _frame(s_idx)+s_in, chunk);
+            }
+            g_all_data.flags[d_idx] |= FRAME_DIRTY;
+        }
+        done += chunk;
+    }
+
+    if(dst->size < end){
+        _inode_set_size(dst, end);
+    }
+
+    //frames that fail to be written stay dirty, umount writes them back
+    if(first < dst->block_num){
+        _write_back_blocks(dst, first, my_min(last, dst->block_num-1));
+    }
+    return len;
+}
+
+/*
+ * Snapshot: a copy of the root dir and of the FAT, kept in a chain of data
+ * blocks whose head is in the super block. The snapshot owns a reference on
+ * every block used by its files, data blocks and map blocks alike, so a write
+ * to one of them copies it first and the frozen metadata stays valid.
+ */
+static uint32_t _snapshot_block_num(void)
+{
+    return _blocks_for_len(sizeof(Root_Dir_Info)+g_FATLen*sizeof(uint16_t));
+}
+
+//copy len bytes between buf and the frames of a chain of data blocks
+static void _chain_copy(uint16_t block_idx, uint8_t* buf, uint32_t len, int to_chain)
+{
+    for(uint32_t pos = 0; pos < len; pos += g_blockSize){
+        uint32_t chunk = my_min(g_blockSize, len-pos);
+        if(0 != to_chain){
+            memcpy(_frame(block_idx), buf+pos, chunk);
+            g_all_data.flags[block_idx] |= FRAME_DIRTY;
+        }
+        else{
+            memcpy(buf+pos, _frame(block_idx), chunk);
+        }
+        block_idx = g_FATInfo.data[block_idx];
+    }
+}
+
+//root dir then FAT of the snapshot, in one buffer to free
+static uint8_t* _snapshot_load(void)
+{
+    uint32_t len = sizeof(Root_Dir_Info)+g_FATLen*sizeof(uint16_t);
+    uint8_t* buf = (uint8_t*)malloc(len);
+    if(NULL != buf){
+        _chain_copy(g_superBlockInfo.snapshot_block_idx, buf, len, 0);
+    }
+
+    return buf;
+}
+
+//the snapshot lets go of its blocks, its chain is kept
+static int _snapshot_drop(void)
+{
+    uint8_t* buf = _snapshot_load();
+    if(NULL == buf){
+        return -1;
+    }
+
+    _walk_file_blocks((const Root_Dir_Info*)buf, (const uint16_t*)(buf+sizeof(Root_Dir_Info)), _put_block);
+    _free_run_flush();
+    free(buf);
+    return 0;
+}
+
+//write the super block, the FAT and the root dir to their home blocks
+static int _meta_write_home(void)
+{
+    //write super block
+    if( -1 == _meta_write(0, &g_superBlockInfo, sizeof(Super_Block_Info)) ){
+        return -1;
+    }
+
+    //write fat
+    if( -1 == _meta_write(1, g_FATInfo.data, (uint32_t)g_superBlockInfo.fat_block_num << g_blockShift) ){
+        return -1;
+    }
+
+    //write root dir
+    if( -1 == _meta_write(g_superBlockInfo.root_dir_block_idx, &g_rootDirInfo, sizeof(Root_Dir_Info)) ){
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Metadata journal: a run of data blocks, declared in the super block, whose
+ * first block says which transaction to replay first. A commit compares the
+ * super block, FAT and root dir with their state at the last commit, and logs
+ * the blocks that changed, after a header giving their home, in one write.
+ * Commits come from fs_sync() and, after each operation, once the commit
+ * interval has passed since the last one, so operations are committed in
+ * groups. A background thread commits what the last operations left once the
+ * interval passes without another one, and checkpoints: it writes the
+ * committed blocks to their home and empties the journal once it is half full. fs_mount() replays
+ * the valid transactions left in the journal. A block freed since the last
+ * commit is only reused, punched or scrubbed after the commit that frees it,
+ * so the committed metadata never points to a block holding something else.
+ */
+static uint32_t _journal_sum(uint32_t sum, const uint8_t* data, size_t len)
+{
+    //FNV-1a
+    for(size_t idx = 0; idx < len; ++idx){
+        sum = (sum ^ data[idx])*16777619u;
+    }
+
+    return sum;
+}
+
+static uint32_t _journal_head_blocks(uint32_t count)
+{
+    return _blocks_for_len(sizeof(Journal_Head)+count*sizeof(uint16_t));
+}
+
+//checksum of a transaction, its checksum field zeroed
+static uint32_t _journal_txn_sum(Journal_Head* head, const uint8_t* images)
+{
+    uint32_t saved = head->checksum;
+    head->checksum = 0;
+    uint32_t sum = _journal_sum(2166136261u, (const uint8_t*)head, sizeof(Journal_Head)+head->count*sizeof(uint16_t));
+    sum = _journal_sum(sum, images, (size_t)head->count << g_blockShift);
+    head->checksum = saved;
+    return sum;
+}
+
+//first block of the journal says which transaction comes first, buf is one
+//block of scratch space
+static int _journal_write_super(uint8_t* buf, uint32_t seq)
+{
+    memset(buf, 0, g_blockSize);
+    Journal_Head* head = (Journal_Head*)buf;
+    memcpy(head->sign, JOURNAL_SUPER_SIGN, sizeof(head->sign));
+    head->seq = seq;
+    if( (-1 == block_write(g_journal.first_block, buf))||(-1 == block_disk_sync()) ){
+        return -1;
+    }
+
+    return 0;
+}
+
+//the metadata as its home blocks would hold it
+static void _journal_stage(uint8_t* image)
+{
+    memset(image, 0, (size_t)g_journal.meta_num << g_blockShift);
+    memcpy(image, &g_superBlockInfo, sizeof(Super_Block_Info));
+    memcpy(image+g_blockSize, g_FATInfo.data, (size_t)g_superBlockInfo.fat_block_num << g_blockShift);
+    _fat_drop_freed((uint16_t*)(image+g_blockSize), g_journal.freed_done);
+    memcpy(image+((size_t)g_superBlockInfo.root_dir_block_idx << g_blockShift), &g_rootDirInfo, sizeof(Root_Dir_Info));
+}
+
+//write the committed blocks to their home and empty the journal, under the lock
+static int _journal_checkpoint_locked(void)
+{
+    for(uint32_t idx = 0; idx < g_journal.meta_num; ++idx){
+        if( (0 != g_journal.home_dirty[idx])
+            &&(-1 == block_write(idx, g_journal.shadow+((size_t)idx << g_blockShift))) ){
+            return -1;
+        }
+    }
+    if( (-1 == block_disk_sync())||(-1 == _journal_write_super(g_journal.txn, g_journal.seq)) ){
+        return -1;
+    }
+
+    memset(g_journal.home_dirty, 0, g_journal.meta_num);
+    g_journal.head = 1;
+    return 0;
+}
+
+//microseconds until the commit interval since the last commit passes, under
+//the lock
+static uint64_t _journal_wait_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed_us = (uint64_t)(now.tv_sec-g_journal.last_commit.tv_sec)*1000000
+        +(now.tv_nsec-g_journal.last_commit.tv_nsec)/1000;
+    uint64_t interval_us = (uint64_t)g_commitInterval*1000;
+    return (elapsed_us >= interval_us)?0:(interval_us-elapsed_us);
+}
+
+static void* _journal_main(void* arg)
+{
+    (void)arg;
+    pthread_mutex_lock(&(g_journal.lock));
+    while(0 == g_journal.stop){
+        if(g_journal.head > g_journal.block_num/2){
+            //a checkpoint that fails is tried again by the next commit
+            if(-1 == _journal_checkpoint_locked()){
+                pthread_cond_wait(&(g_journal.cond), &(g_journal.lock));
+            }
+            continue;
+        }
+        if(0 == g_journal.pending){
+            pthread_cond_wait(&(g_journal.cond), &(g_journal.lock));
+            continue;
+        }
+
+        uint64_t wait_us = _journal_wait_us();
+        if(0 != wait_us){
+            struct timespec due;
+            clock_gettime(CLOCK_MONOTONIC, &due);
+            wait_us += (uint64_t)due.tv_nsec/1000;
+            due.tv_sec += wait_us/1000000;
+            due.tv_nsec = (wait_us%1000000)*1000;
+            pthread_cond_timedwait(&(g_journal.cond), &(g_journal.lock), &due);
+            continue;
+        }
+
+        //no operation committed them in time; operations take their lock
+        //before this one
+        pthread_mutex_unlock(&(g_journal.lock));
+        pthread_mutex_lock(&g_opLock);
+        pthread_mutex_lock(&(g_journal.lock));
+        uint8_t pending = (0 != g_journal.pending)&&(0 == g_journal.stop);
+        pthread_mutex_unlock(&(g_journal.lock));
+        int ret = (0 != pending)?_journal_sync():0;
+        pthread_mutex_unlock(&g_opLock);
+        pthread_mutex_lock(&(g_journal.lock));
+        if(-1 == ret){
+            //tried again after the interval
+            clock_gettime(CLOCK_MONOTONIC, &(g_journal.last_commit));
+        }
+    }
+    pthread_mutex_unlock(&(g_journal.lock));
+    return NULL;
+}
+
+//log every metadata block changed since the last commit, in one write
+static int _journal_commit(void)
+{
+    pthread_mutex_lock(&(g_journal.lock));
+    _journal_stage(g_journal.stage);
+    //the blocks it frees are committed with it
+    uint32_t freed_num = g_journal.freed_done;
+
+    Journal_Head* head = (Journal_Head*)g_journal.txn;
+    memset(head, 0, sizeof(Journal_Head));
+    for(uint32_t idx = 0; idx < g_journal.meta_num; ++idx){
+        size_t offset = (size_t)idx << g_blockShift;
+        if(0 != memcmp(g_journal.stage+offset, g_journal.shadow+offset, g_blockSize)){
+            head->blocks[head->count++] = idx;
+        }
+    }
+
+    int ret = 0;
+    if(0 != head->count){
+        uint32_t head_num = _journal_head_blocks(head->count);
+        uint32_t txn_num = head_num+head->count;
+        if( (g_journal.head+txn_num > g_journal.block_num)&&(-1 == _journal_checkpoint_locked()) ){
+            pthread_mutex_unlock(&(g_journal.lock));
+            return -1;
+        }
+
+        uint8_t* images = g_journal.txn+((size_t)head_num << g_blockShift);
+        for(uint32_t cnt = 0; cnt < head->count; ++cnt){
+            memcpy(images+((size_t)cnt << g_blockShift), g_journal.stage+((size_t)head->blocks[cnt] << g_blockShift), g_blockSize);
+        }
+        memcpy(head->sign, JOURNAL_SIGN, sizeof(head->sign));
+        head->seq = g_journal.seq;
+        head->checksum = _journal_txn_sum(head, images);
+
+        //the data written so far reaches the disk before the metadata pointing to it
+        ret = block_disk_sync();
+        if(0 == ret){
+            ret = block_write_many(g_journal.first_block+g_journal.head, txn_num, g_journal.txn);
+        }
+        if( (0 == ret)&&(0 == (ret = block_disk_sync())) ){
+            //committed, the home blocks are now behind
+            for(uint32_t cnt = 0; cnt < head->count; ++cnt){
+                g_journal.home_dirty[head->blocks[cnt]] = 1;
+            }
+            memcpy(g_journal.shadow, g_journal.stage, (size_t)g_journal.meta_num << g_blockShift);
+            g_journal.head += txn_num;
+            g_journal.seq++;
+            if(g_journal.head > g_journal.block_num/2){
+                pthread_cond_signal(&(g_journal.cond));
+            }
+        }
+    }
+
+    if(0 == ret){
+        g_journal.pending = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &(g_journal.last_commit));
+    pthread_mutex_unlock(&(g_journal.lock));
+    if(0 == ret){
+        for(uint32_t cnt = 0; cnt < freed_num; ++cnt){
+            _free_FAT(g_journal.freed[cnt]);
+        }
+        g_journal.freed_num -= freed_num;
+        memmove(g_journal.freed, g_journal.freed+freed_num, g_journal.freed_num*sizeof(uint16_t));
+        g_journal.freed_done = 0;
+        _free_run_flush();
+    }
+    return ret;
+}
+
+//commit now; the data, the refcount table and the checksums covering them
+//reach the disk first, as in _sync_all
+static int _journal_sync(void)
+{
+    _refcnt_store();
+    if( (-1 == _flush_frames(0, g_superBlockInfo.data_block_num))||(-1 == _csum_store()) ){
+        return -1;
+    }
+    return _journal_commit();
+}
+
+//group commit: an operation commits the ones before it once the interval passed
+static void _journal_tick(void)
+{
+    if(0 == g_journal.running){
+        return;
+    }
+
+    //between operations the metadata no longer points to what they freed
+    g_journal.freed_done = g_journal.freed_num;
+    //what is not committed now the thread commits once the interval passed
+    pthread_mutex_lock(&(g_journal.lock));
+    g_journal.pending = 1;
+    uint8_t due = (0 == _journal_wait_us());
+    if(0 == due){
+        pthread_cond_signal(&(g_journal.cond));
+    }
+    pthread_mutex_unlock(&(g_journal.lock));
+    if(0 != due){
+        //a failed commit is retried by the next one
+        _journal_sync();
+    }
+}
+
+/*
+ * Operations that change the metadata run one at a time, and each commits
+ * those before it on its way out once the interval passed, so a commit never
+ * sees one half done. The lock of a file is taken after this one, it still
+ * keeps reads of the file apart from its writes.
+ */
+static void _op_begin(void)
+{
+    pthread_mutex_lock(&g_opLock);
+}
+
+static void _op_end(void)
+{
+    _journal_tick();
+    pthread_mutex_unlock(&g_opLock);
+}
+
+//apply the valid transactions left by a crash, then empty the journal
+static int _journal_replay(void)
+{
+    uint32_t meta_num = g_superBlockInfo.data_block_idx;
+    uint32_t block_num = g_superBlockInfo.journal_block_num;
+    g_journal.first_block = g_superBlockInfo.data_block_idx+g_superBlockInfo.journal_block_idx;
+    if(-1 == block_read(g_journal.first_block, g_blockBuf)){
+        return -1;
+    }
+    Journal_Head* jsb = (Journal_Head*)g_blockBuf;
+    if(0 != memcmp(jsb->sign, JOURNAL_SUPER_SIGN, sizeof(jsb->sign))){
+        //nothing to trust in there
+        return _journal_write_super(g_blockBuf, 1);
+    }
+    uint32_t seq = jsb->seq;
+
+    uint32_t head_max = _journal_head_blocks(meta_num);
+    uint8_t* buf = (uint8_t*)malloc((size_t)(head_max+meta_num) << g_blockShift);
+    if(NULL == buf){
+        return -1;
+    }
+
+    Journal_Head* head = (Journal_Head*)buf;
+    uint32_t replay_num = 0;
+    for(uint32_t pos = 1; pos < block_num; ){
+        if(-1 == block_read(g_journal.first_block+pos, buf)){
+            free(buf);
+            return -1;
+        }
+        if( (0 != memcmp(head->sign, JOURNAL_SIGN, sizeof(head->sign)))||(seq != head->seq)
+            ||(0 == head->count)||(meta_num < head->count) ){
+            break;
+        }
+        uint32_t head_num = _journal_head_blocks(head->count);
+        uint32_t txn_num = head_num+head->count;
+        if(pos+txn_num > block_num){
+            break;
+        }
+        if(-1 == block_read_many(g_journal.first_block+pos+1, txn_num-1, buf+g_blockSize)){
+            free(buf);
+            return -1;
+        }
+        uint8_t* images = buf+((size_t)head_num << g_blockShift);
+        if(head->checksum != _journal_txn_sum(head, images)){
+            //torn write, the transaction was not committed
+            break;
+        }
+
+        for(uint32_t cnt = 0; cnt < head->count; ++cnt){
+            if( (meta_num <= head->blocks[cnt])
+                ||(-1 == block_write(head->blocks[cnt], images+((size_t)cnt << g_blockShift))) ){
+                free(buf);
+                return -1;
+            }
+        }
+        pos += txn_num;
+        seq++;
+        replay_num++;
+    }
+    free(buf);
+
+    if( (0 != replay_num)&&(-1 == block_disk_sync()) ){
+        return -1;
+    }
+    return _journal_write_super(g_blockBuf, seq);
+}
+
+//take a run of free blocks for the journal, and write the metadata home so that
+//it knows about the journal before anything is logged to it
+static int _journal_create(void)
+{
+    uint32_t meta_num = g_superBlockInfo.data_block_idx;
+    uint32_t block_num = my_max(g_journalSize, 1+_journal_head_blocks(meta_num)+meta_num);
+    int32_t run_start = _find_empty_FAT_run(block_num);
+    if(-1 == run_start){
+        //no room, go on without a journal
+        return 0;
+    }
+
+    for(uint32_t cnt = 0; cnt < block_num; ++cnt){
+        _take_FAT(run_start+cnt, (cnt+1 < block_num)?(run_start+cnt+1):FAT_EOC);
+    }
+    g_superBlockInfo.journal_block_idx = run_start;
+    g_superBlockInfo.journal_block_num = block_num;
+    g_journal.first_block = g_superBlockInfo.data_block_idx+run_start;
+    if( (-1 == _journal_write_super(g_blockBuf, 1))||(-1 == _meta_write_home())||(-1 == block_disk_sync()) ){
+        return -1;
+    }
+
+    return 0;
+}
+
+static int _journal_start(void)
+{
+    if(0 == g_superBlockInfo.journal_block_num){
+        return 0;
+    }
+
+    g_journal.first_block = g_superBlockInfo.data_block_idx+g_superBlockInfo.journal_block_idx;
+    g_journal.block_num = g_superBlockInfo.journal_block_num;
+    g_journal.meta_num = g_superBlockInfo.data_block_idx;
+    g_journal.head = 1;
+    g_journal.stop = 0;
+
+    //the journal super block holds the next sequence number
+    if(-1 == block_read(g_journal.first_block, g_blockBuf)){
+        return -1;
+    }
+    g_journal.seq = ((Journal_Head*)g_blockBuf)->seq;
+
+    size_t meta_len = (size_t)g_journal.meta_num << g_blockShift;
+    g_journal.shadow = (uint8_t*)malloc(meta_len);
+    g_journal.stage = (uint8_t*)malloc(meta_len);
+    g_journal.txn = (uint8_t*)malloc(((size_t)_journal_head_blocks(g_journal.meta_num) << g_blockShift)+meta_len);
+    g_journal.home_dirty = (uint8_t*)calloc(g_journal.meta_num, sizeof(uint8_t));
+    if( (NULL == g_journal.shadow)||(NULL == g_journal.stage)||(NULL == g_journal.txn)
+        ||(NULL == g_journal.home_dirty) ){
+        return -1;
+    }
+
+    //home blocks are up to date at mount
+    _journal_stage(g_journal.shadow);
+    clock_gettime(CLOCK_MONOTONIC, &(g_journal.last_commit));
+    g_journal.pending = 0;
+
+    //the thread waits for the commit interval on the clock it is measured with
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(g_journal.cond), &attr);
+    pthread_condattr_destroy(&attr);
+    if(0 != pthread_create(&(g_journal.thread), NULL, _journal_main, NULL)){
+        pthread_cond_destroy(&(g_journal.cond));
+        return -1;
+    }
+
+    g_journal.running = 1;
+    return 0;
+}
+
+//checkpoint whatever is left and stop the thread
+//stop the checkpoint thread, after bringing the home blocks up to date with
+//checkpoint, otherwise leaving the journal on disk as it is
+static int _journal_stop(uint8_t checkpoint)
+{
+    if(0 == g_journal.running){
+        return 0;
+    }
+
+    pthread_mutex_lock(&(g_journal.lock));
+    int ret = (0 != checkpoint)?_journal_checkpoint_locked():0;
+    g_journal.stop = 1;
+    pthread_cond_signal(&(g_journal.cond));
+    pthread_mutex_unlock(&(g_journal.lock));
+    pthread_join(g_journal.thread, NULL);
+    pthread_cond_destroy(&(g_journal.cond));
+    g_journal.running = 0;
+    return ret;
+}
+
+/*
+ * Defragmentation: a file whose chain is split in several runs of blocks is
+ * copied whole into one free run, and its entry switched over to the new
+ * chain. The old chains are only freed once the metadata naming the new ones
+ * is on disk, so that a crash leaves either chain intact. Open files, files
+ * with holes and files sharing blocks are left as they are.
+ */
+static uint32_t _chain_fragments(uint16_t block_idx)
+{
+    uint32_t frag_num = 0;
+    uint16_t prev_idx = 0;
+    for(uint32_t cnt = 0; (0 != block_idx)&&(FAT_EOC != block_idx)&&(cnt < g_FATLen); ++cnt){
+        if( (0 == cnt)||(prev_idx+1 != block_idx) ){
+            frag_num++;
+        }
+        prev_idx = block_idx;
+        block_idx = g_FATInfo.data[block_idx];
+    }
+
+    return frag_num;
+}
+
+//runs of consecutive blocks over all the chained files
+static uint32_t _fs_fragments(void)
+{
+    uint32_t frag_num = 0;
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        if(0 == (FE_FLAG_MAPPED & g_rootDirInfo.files[idx].flags)){
+            frag_num += _chain_fragments(g_rootDirInfo.files[idx].start_data_block_idx);
+        }
+    }
+
+    return frag_num;
+}
+
+//copy the chain of entry file_idx into a free run of block_num blocks and
+//switch the entry over; the old chain is left taken. -1 if it cannot move
+static int _defrag_file(uint16_t file_idx, uint32_t block_num)
+{
+    File_Entry* pFE = &(g_rootDirInfo.files[file_idx]);
+    for(uint16_t block_idx = pFE->start_data_block_idx; FAT_EOC != block_idx; block_idx = g_FATInfo.data[block_idx]){
+        if(0 != _block_shared(block_idx)){
+            return -1;
+        }
+    }
+
+    int32_t run_start = _find_empty_FAT_run(block_num);
+    if(-1 == run_start){
+        return -1;
+    }
+
+    uint16_t block_idx = pFE->start_data_block_idx;
+    for(uint32_t cnt = 0; cnt < block_num; ++cnt){
+        _take_FAT(run_start+cnt, (cnt+1 < block_num)?(run_start+cnt+1):FAT_EOC);
+        memcpy(_frame(run_start+cnt), _frame(block_idx), g_blockSize);
+        block_idx = g_FATInfo.data[block_idx];
+    }
+
+    //the run is contiguous in the cache too, one write
+    if(-1 == _frames_write(run_start, block_num)){
+        for(uint32_t cnt = 0; cnt < block_num; ++cnt){
+            _release_FAT(run_start+cnt);
+        }
+        _free_run_flush();
+        return -1;
+    }
+
+    pFE->start_data_block_idx = run_start;
+    return 0;
+}
+
+/*
+ * Layout report: the data blocks of each file are followed in file order, and
+ * the free entries of the FAT are gathered in runs, in one pass over the FAT.
+ */
+typedef struct _layout_info_s_{
+    uint32_t block_num;
+    uint32_t extent_num;    //runs of consecutive blocks
+    uint64_t seek;          //blocks skipped over by a sequential read
+    uint16_t prev_idx;      //last block seen, 0 if none
+}Layout_Info;
+
+static void _layout_add(Layout_Info* info, uint16_t block_idx)
+{
+    if( (0 == info->prev_idx)||(info->prev_idx+1 != block_idx) ){
+        info->extent_num++;
+        if(0 != info->prev_idx){
+            info->seek += (block_idx > info->prev_idx)?(block_idx-info->prev_idx-1):(info->prev_idx-block_idx+1);
+        }
+    }
+    info->block_num++;
+    info->prev_idx = block_idx;
+}
+
+//data blocks of a file in file order, holes left out, and the blocks of its chain
+static uint32_t _layout_file(const File_Entry* pFE, Layout_Info* info)
+{
+    const uint32_t entry_num = g_blockSize/sizeof(uint16_t);
+    uint32_t chain_len = 0;
+    uint16_t block_idx = pFE->start_data_block_idx;
+    for( ; (0 != block_idx)&&(FAT_EOC != block_idx)&&(chain_len < g_FATLen); ++chain_len){
+        if(0 == (FE_FLAG_MAPPED & pFE->flags)){
+            _layout_add(info, block_idx);
+        }
+        else{
+            const uint16_t* entries = (const uint16_t*)_frame(block_idx);
+            for(uint32_t entry = 0; entry < entry_num; ++entry){
+                if(0 != entries[entry]){
+                    _layout_add(info, entries[entry]);
+                }
+            }
+        }
+        block_idx = g_FATInfo.data[block_idx];
+    }
+
+    return chain_len;
+}
+
+/*
+ * Resize: the image is rebuilt from the mounted state into a new file that
+ * replaces it. Live blocks keep their order and are packed at the front of
+ * the new data region, every reference to them is renumbered: FAT links, the
+ * first block of each file, the entries of map blocks and the refcount table.
+ * The journal is dropped, the refcount table gets a chain sized for the new
+ * FAT.
+ */
+static int _resize_write(const char* diskname, uint32_t data_block_num)
+{
+    //drop the metadata chains, they are not moved
+    if(0 != g_superBlockInfo.journal_block_num){
+        memset(g_FATInfo.data+g_superBlockInfo.journal_block_idx, 0, g_superBlockInfo.journal_block_num*sizeof(uint16_t));
+        g_superBlockInfo.journal_block_idx = 0;
+        g_superBlockInfo.journal_block_num = 0;
+    }
+    for(uint16_t block_idx = g_superBlockInfo.refcnt_block_idx; 0 != block_idx; ){
+        uint16_t next_idx = g_FATInfo.data[block_idx];
+        g_FATInfo.data[block_idx] = 0;
+        block_idx = (FAT_EOC == next_idx)?0:next_idx;
+    }
+    for(uint16_t block_idx = g_superBlockInfo.csum_block_idx; 0 != block_idx; ){
+        uint16_t next_idx = g_FATInfo.data[block_idx];
+        g_FATInfo.data[block_idx] = 0;
+        block_idx = (FAT_EOC == next_idx)?0:next_idx;
+    }
+    g_superBlockInfo.csum_block_idx = 0;
+
+    //live blocks are numbered in order from 1
+    uint16_t* new_idx = (uint16_t*)calloc(g_FATLen, sizeof(uint16_t));
+    if(NULL == new_idx){
+        return -1;
+    }
+    uint32_t live_num = 0;
+    for(uint32_t idx = 1; idx < g_FATLen; ++idx){
+        if(0 != g_FATInfo.data[idx]){
+            new_idx[idx] = ++live_num;
+        }
+    }
+
+    //0 asks for the smallest size; the refcount table covers the whole FAT, so
+    //it grows with it
+    uint32_t refcnt_num = 0;
+    uint32_t need = 1+live_num;
+    if(NULL != g_refcnt.data){
+        uint32_t len = (0 != data_block_num)?data_block_num:need;
+        refcnt_num = _blocks_for_len(len*sizeof(uint16_t));
+        while( (0 == data_block_num)&&(len < need+refcnt_num) ){
+            len = need+refcnt_num;
+            refcnt_num = _blocks_for_len(len*sizeof(uint16_t));
+        }
+        need += refcnt_num;
+    }
+    if(0 == data_block_num){
+        data_block_num = need;
+    }
+
+    uint32_t fat_block_num = _blocks_for_len(data_block_num*sizeof(uint16_t));
+    uint32_t data_block_idx = 1+fat_block_num+_blocks_for_len(sizeof(Root_Dir_Info));
+    if( (data_block_num < need)||(FAT_EOC < data_block_num)||(UINT8_MAX < fat_block_num)
+        ||(UINT16_MAX < data_block_idx+data_block_num) ){
+        free(new_idx);
+        return -1;
+    }
+
+    uint16_t* fat = (uint16_t*)calloc((size_t)fat_block_num << g_blockShift, 1);
+    uint16_t* refcnt = (uint16_t*)calloc((size_t)refcnt_num << g_blockShift, 1);
+    uint8_t* map_done = (uint8_t*)calloc(g_FATLen, sizeof(uint8_t));
+    char* tmp_name = (char*)malloc(strlen(diskname)+sizeof(".resize"));
+    if( (NULL == fat)||((0 != refcnt_num)&&(NULL == refcnt))||(NULL == map_done)||(NULL == tmp_name) ){
+        free(new_idx);
+        free(fat);
+        free(refcnt);
+        free(map_done);
+        free(tmp_name);
+        return -1;
+    }
+
+    //renumber the entries of map blocks, once for a map block shared by clones
+    const uint32_t entry_num = g_blockSize/sizeof(uint16_t);
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        File_Entry* pFE = &(g_rootDirInfo.files[idx]);
+        for(uint16_t block_idx = pFE->start_data_block_idx;
+            (0 != (FE_FLAG_MAPPED & pFE->flags))&&(FAT_EOC != block_idx)&&(0 == map_done[block_idx]);
+            block_idx = g_FATInfo.data[block_idx]){
+            uint16_t* entries = (uint16_t*)_frame(block_idx);
+            for(uint32_t entry = 0; entry < entry_num; ++entry){
+                entries[entry] = new_idx[entries[entry]];
+            }
+            map_done[block_idx] = 1;
+        }
+    }
+    free(map_done);
+
+    fat[0] = FAT_EOC;
+    for(uint32_t idx = 1; idx < g_FATLen; ++idx){
+        if(0 != new_idx[idx]){
+            fat[new_idx[idx]] = (FAT_EOC == g_FATInfo.data[idx])?FAT_EOC:new_idx[g_FATInfo.data[idx]];
+            if(NULL != g_refcnt.data){
+                refcnt[new_idx[idx]] = g_refcnt.data[idx];
+            }
+        }
+    }
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        uint16_t* start = &(g_rootDirInfo.files[idx].start_data_block_idx);
+        if( (0 != *start)&&(FAT_EOC != *start) ){
+            *start = new_idx[*start];
+        }
+    }
+    g_superBlockInfo.refcnt_block_idx = 0;
+    if(0 != refcnt_num){
+        //right after the live blocks
+        g_superBlockInfo.refcnt_block_idx = live_num+1;
+        for(uint32_t cnt = 0; cnt < refcnt_num; ++cnt){
+            fat[live_num+1+cnt] = (cnt+1 < refcnt_num)?(live_num+2+cnt):FAT_EOC;
+        }
+    }
+
+    g_superBlockInfo.block_num_total = data_block_idx+data_block_num;
+    g_superBlockInfo.data_block_idx = data_block_idx;
+    g_superBlockInfo.data_block_num = data_block_num;
+    g_superBlockInfo.fat_block_num = fat_block_num;
+    g_superBlockInfo.root_dir_block_idx = 1+fat_block_num;
+
+    //new image next to the old one, blocks never written read as zeros
+    sprintf(tmp_name, "%s.resize", diskname);
+    int ret = -1;
+    if( (0 == block_disk_create(tmp_name, g_superBlockInfo.block_num_total, g_blockSize))
+        &&(0 == block_disk_open(tmp_name)) ){
+        ret = _meta_write(0, &g_superBlockInfo, sizeof(Super_Block_Info));
+        ret |= _meta_write(1, fat, fat_block_num << g_blockShift);
+        ret |= _meta_write(g_superBlockInfo.root_dir_block_idx, &g_rootDirInfo, sizeof(Root_Dir_Info));
+
+        //runs of live blocks stay runs
+        for(uint32_t idx = 1; idx < g_FATLen; ){
+            uint32_t run_len = 0;
+            while( (idx+run_len < g_FATLen)&&(0 != new_idx[idx+run_len]) ){
+                run_len++;
+            }
+            if(0 != run_len){
+                ret |= block_write_many(data_block_idx+new_idx[idx], run_len, _frame(idx));
+            }
+            idx += run_len+1;
+        }
+        if(0 != refcnt_num){
+            ret |= block_write_many(data_block_idx+live_num+1, refcnt_num, refcnt);
+        }
+
+        ret |= block_disk_sync();
+        ret |= block_disk_close();
+        if( (0 == ret)&&(0 != rename(tmp_name, diskname)) ){
+            ret = -1;
+        }
+    }
+    if(0 != ret){
+        unlink(tmp_name);
+    }
+
+    free(new_idx);
+    free(fat);
+    free(refcnt);
+    free(tmp_name);
+    return (0 == ret)?0:-1;
+}
+
+/*
+ * Consistency check. Every file of the root dir, and of the snapshot, claims
+ * its blocks: the blocks of its chain and, for a file with holes, the blocks
+ * named by its map blocks. The files are split between threads, which count
+ * the claims with atomic adds and check the links on the way; then the FAT is
+ * split between them, and each block is checked against its claims and its
+ * reference count. Repair is serial: the files claim their blocks again in
+ * order, a chain is cut before its first bad link or before a block claimed
+ * more often than its reference count allows, and the free map and the
+ * reference counts are rebuilt from the claims.
+ */
+//claim the blocks of a file, checking its links; -1 if something is wrong
+static int _fsck_file(Fsck_Task* task, const uint16_t* fat, const File_Entry* pFE, uint32_t stamp)
+{
+    if(0 == pFE->start_data_block_idx){
+        return 0;
+    }
+
+    const uint32_t entry_num = g_blockSize/sizeof(uint16_t);
+    uint32_t* claims = task->info->claims;
+    uint8_t bad_chain = 0;
+    uint32_t chain_len = 0;
+    for(uint16_t block_idx = pFE->start_data_block_idx; FAT_EOC != block_idx; block_idx = fat[block_idx]){
+        if( (0 == block_idx)||(g_FATLen <= block_idx)||(0 == fat[block_idx])||(stamp == task->stamps[block_idx]) ){
+            //out of the disk, free, or a loop
+            bad_chain = 1;
+            break;
+        }
+        task->stamps[block_idx] = stamp;
+        __atomic_fetch_add(&(claims[block_idx]), 1, __ATOMIC_RELAXED);
+        chain_len++;
+
+        if(0 != (FE_FLAG_MAPPED & pFE->flags)){
+            const uint16_t* entries = (const uint16_t*)_frame(block_idx);
+            for(uint32_t entry = 0; entry < entry_num; ++entry){
+                uint16_t data_idx = entries[entry];
+                if(0 == data_idx){
+                    continue;
+                }
+                if( (g_FATLen <= data_idx)||(FAT_EOC != fat[data_idx]) ){
+                    bad_chain = 1;
+                    continue;
+                }
+                __atomic_fetch_add(&(claims[data_idx]), 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    //the size of a compressed file is that of its content, a packed file
+    //fits in its fragment block
+    uint8_t bad_size = ( (0 == ((FE_FLAG_MAPPED | FE_FLAG_COMPRESSED) & pFE->flags))
+            &&(pFE->file_size > ((uint64_t)chain_len << g_blockShift)) )
+        ||( (0 != (FE_FLAG_PACKED & pFE->flags))&&((uint64_t)pFE->frag_off+pFE->file_size > g_blockSize) );
+    task->bad_chains += bad_chain;
+    task->bad_sizes += bad_size;
+    return ( (0 != bad_chain)||(0 != bad_size) )?-1:0;
+}
+
+//a metadata chain, walked like a file
+static int _fsck_meta_chain(Fsck_Task* task, uint16_t first_idx, uint32_t stamp)
+{
+    File_Entry entry = {{0}};
+    entry.start_data_block_idx = first_idx;
+    return _fsck_file(task, g_FATInfo.data, &entry, stamp);
+}
+
+static inline uint32_t _fsck_extra_owners(uint32_t block_idx)
+{
+    return (NULL == g_refcnt.data)?0:g_refcnt.data[block_idx];
+}
+
+//the files of this thread
+static void* _fsck_claim_main(void* arg)
+{
+    Fsck_Task* task = (Fsck_Task*)arg;
+    Fsck_Info* info = task->info;
+    for(uint32_t root = 0; root < info->root_num; ++root){
+        for(uint32_t idx = task->id; idx < FS_FILE_MAX_COUNT; idx += info->thread_num){
+            _fsck_file(task, info->fats[root], &(info->roots[root]->files[idx]), root*FS_FILE_MAX_COUNT+idx+1);
+        }
+    }
+    return NULL;
+}
+
+//the share of the FAT of this thread, claims on free blocks were reported
+//as bad links
+static void* _fsck_scan_main(void* arg)
+{
+    Fsck_Task* task = (Fsck_Task*)arg;
+    Fsck_Info* info = task->info;
+    uint32_t share = (g_FATLen+info->thread_num-1)/info->thread_num;
+    uint32_t first = my_max(1, task->id*share);
+    uint32_t end = my_min(g_FATLen, (task->id+1)*share);
+    if(first < end){
+        task->bad_entries += g_fatScan.count_bad(g_FATInfo.data+first, end-first, g_FATLen);
+    }
+    for(uint32_t idx = first; idx < end; ++idx){
+        uint32_t claim_num = info->claims[idx];
+        if(0 == g_FATInfo.data[idx]){
+            continue;
+        }
+        if(0 == claim_num){
+            task->leaks++;
+        }
+        else if(claim_num > 1+_fsck_extra_owners(idx)){
+            task->cross_links++;
+        }
+        else if(claim_num < 1+_fsck_extra_owners(idx)){
+            task->bad_refcnts++;
+        }
+    }
+
+    return NULL;
+}
+
+//a task whose thread cannot start runs here
+static void _fsck_run(Fsck_Task* tasks, uint32_t thread_num, void* (*main)(void*))
+{
+    uint8_t started[FSCK_THREAD_MAX] = {0};
+    for(uint32_t cnt = 0; cnt < thread_num; ++cnt){
+        started[cnt] = (0 == pthread_create(&(tasks[cnt].thread), NULL, main, &(tasks[cnt])));
+        if(0 == started[cnt]){
+            main(&(tasks[cnt]));
+        }
+    }
+    for(uint32_t cnt = 0; cnt < thread_num; ++cnt){
+        if(0 != started[cnt]){
+            pthread_join(tasks[cnt].thread, NULL);
+        }
+    }
+}
+
+//claim the blocks of a file of the root dir again, cutting what cannot be
+//claimed; return the fixes
+static size_t _fsck_repair_file(File_Entry* pFE, uint32_t* claims, uint32_t* stamps, uint32_t stamp)
+{
+    if(0 == pFE->start_data_block_idx){
+        return 0;
+    }
+
+    const uint32_t entry_num = g_blockSize/sizeof(uint16_t);
+    size_t fix_num = 0;
+    uint32_t chain_len = 0;
+    uint16_t prev_idx = 0;
+    for(uint16_t block_idx = pFE->start_data_block_idx; FAT_EOC != block_idx; block_idx = g_FATInfo.data[block_idx]){
+        if( (0 == block_idx)||(g_FATLen <= block_idx)||(0 == g_FATInfo.data[block_idx])
+            ||(stamp == stamps[block_idx])||(claims[block_idx] > _fsck_extra_owners(block_idx)) ){
+            if(0 == prev_idx){
+                pFE->start_data_block_idx = FAT_EOC;
+            }
+            else{
+                g_FATInfo.data[prev_idx] = FAT_EOC;
+            }
+            fix_num++;
+            break;
+        }
+        stamps[block_idx] = stamp;
+        claims[block_idx]++;
+        chain_len++;
+
+        if(0 != (FE_FLAG_MAPPED & pFE->flags)){
+            //bad entries become holes
+            uint16_t* entries = (uint16_t*)_frame(block_idx);
+            for(uint32_t entry = 0; entry < entry_num; ++entry){
+                uint16_t data_idx = entries[entry];
+                if(0 == data_idx){
+                    continue;
+                }
+                if( (g_FATLen <= data_idx)||(FAT_EOC != g_FATInfo.data[data_idx])
+                    ||(claims[data_idx] > _fsck_extra_owners(data_idx)) ){
+                    entries[entry] = 0;
+                    g_all_data.flags[block_idx] |= FRAME_DIRTY;
+                    fix_num++;
+                    continue;
+                }
+                claims[data_idx]++;
+            }
+        }
+        prev_idx = block_idx;
+    }
+
+    if( (0 == ((FE_FLAG_MAPPED | FE_FLAG_COMPRESSED) & pFE->flags))
+        &&(pFE->file_size > ((uint64_t)chain_len << g_blockShift)) ){
+        pFE->file_size = chain_len << g_blockShift;
+        fix_num++;
+    }
+    if( (0 != (FE_FLAG_PACKED & pFE->flags))&&((uint64_t)pFE->frag_off+pFE->file_size > g_blockSize) ){
+        pFE->file_size = (pFE->frag_off < g_blockSize)?(g_blockSize-pFE->frag_off):0;
+        fix_num++;
+    }
+    return fix_num;
+}
+
+//claim everything again in order, then rebuild the free map and the
+//reference counts; a broken journal or snapshot is dropped
+static size_t _fsck_repair(Fsck_Info* info, Fsck_Task* task, uint8_t journal_bad, uint8_t snapshot_bad)
+{
+    size_t fix_num = 0;
+    size_t claim_len = g_FATLen*sizeof(uint32_t);
+    if( (0 == snapshot_bad)&&(2 == info->root_num) ){
+        memset(info->claims, 0, claim_len);
+        memset(task->stamps, 0, claim_len);
+        for(uint32_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+            if(-1 == _fsck_file(task, info->fats[1], &(info->roots[1]->files[idx]), idx+1)){
+                snapshot_bad = 1;
+            }
+        }
+    }
+    if( (0 != snapshot_bad)&&(0 != g_superBlockInfo.snapshot_block_idx) ){
+        g_superBlockInfo.snapshot_block_idx = 0;
+        fix_num++;
+    }
+    if( (0 != journal_bad)&&(0 != g_superBlockInfo.journal_block_num) ){
+        g_superBlockInfo.journal_block_idx = 0;
+        g_superBlockInfo.journal_block_num = 0;
+        fix_num++;
+    }
+
+    //metadata chains, the snapshot, then the files
+    memset(info->claims, 0, claim_len);
+    memset(task->stamps, 0, claim_len);
+    uint32_t stamp = 2*FS_FILE_MAX_COUNT;
+    _fsck_meta_chain(task, g_superBlockInfo.refcnt_block_idx, ++stamp);
+    _fsck_meta_chain(task, g_superBlockInfo.csum_block_idx, ++stamp);
+    _fsck_meta_chain(task, g_superBlockInfo.snapshot_block_idx, ++stamp);
+    if(0 != g_superBlockInfo.journal_block_num){
+        _fsck_meta_chain(task, g_superBlockInfo.journal_block_idx, ++stamp);
+    }
+    for(uint32_t idx = 0; (0 == snapshot_bad)&&(2 == info->root_num)&&(idx < FS_FILE_MAX_COUNT); ++idx){
+        _fsck_file(task, info->fats[1], &(info->roots[1]->files[idx]), FS_FILE_MAX_COUNT+idx+1);
+    }
+    for(uint32_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        fix_num += _fsck_repair_file(&(g_rootDirInfo.files[idx]), info->claims, task->stamps, idx+1);
+    }
+
+    for(uint32_t idx = 1; idx < g_FATLen; ++idx){
+        uint32_t claim_num = info->claims[idx];
+        if( (0 != g_FATInfo.data[idx])&&(0 == claim_num) ){
+            g_FATInfo.data[idx] = 0;
+            fix_num++;
+        }
+        if( (NULL != g_refcnt.data)&&(g_refcnt.data[idx] != ((0 == claim_num)?0:claim_num-1)) ){
+            g_refcnt.data[idx] = (0 == claim_num)?0:claim_num-1;
+            g_refcnt.dirty = 1;
+            fix_num++;
+        }
+    }
+    //there is nothing to rebuild a corrupted block from, its content is taken
+    //as it is
+    _csum_each(0, g_FATLen, FRAME_BAD, _csum_set);
+    fix_num += g_csum.bad_num;
+    g_csum.bad_num = 0;
+
+    g_FATInfo.free_num = _get_free_FAT_num();
+    g_FATInfo.free_hint = 1;
+    return fix_num;
+}
+
+//write back every dirty frame and the metadata
+static int _sync_all(void)
+{
+    if(-1 == _zstore_all()){
+        return -1;
+    }
+    _free_run_flush();
+    _refcnt_store();
+    //the dirty frames get their final checksums as they are written
+    if( (NULL != g_csum.data)
+        &&( (-1 == _flush_frames(0, g_superBlockInfo.data_block_num))||(-1 == _csum_store()) ) ){
+        return -1;
+    }
+
+    //write back dirty data, other writes went through to the disk already;
+    //with a journal the metadata is committed after the data it points to
+    if(0 != g_journal.running){
+        g_journal.freed_done = g_journal.freed_num;
+        if( (-1 == _flush_frames(0, g_superBlockInfo.data_block_num))||(-1 == _journal_commit()) ){
+            return -1;
+        }
+    }
+    else if( (-1 == _meta_write_home())||(-1 == _flush_frames(0, g_superBlockInfo.data_block_num)) ){
+        return -1;
+    }
+
+    //combined writes are on disk now
+    for(uint32_t fd = 0; fd < g_openedFiles.slot_num; ++fd){
+        File_Des* fDes = _get_file_des(fd);
+        if(NULL != fDes){
+            fDes->wc_block = 0;
+        }
+    }
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        g_inodes[idx].tail_block = 0;
+    }
+
+    return 0;
+}
+
+//unlink entry idx and free its blocks, the data is left behind
+static int _remove_file(int16_t file_idx)
+{
+    Inode* ino = _inode_get(file_idx);
+    if(NULL == ino){
+        return -1;
+    }
+
+    //the blocks hold the stream of a compressed file, which goes whole
+    _zrelease(ino);
+    int ret = (0 != ino->packed)?_pack_truncate(ino, 0):_inode_truncate(ino, 0);
+    _inode_put(ino);
+    if(-1 == ret){
+        return -1;
+    }
+
+    _dir_clear(&g_rootDirInfo, file_idx);
+    g_fileNumTotal--;
+    return 0;
+}
+
+/*
+ * Batch: metadata operations recorded by fs_batch_*() and applied by
+ * fs_batch_commit(). The whole batch is first played on a copy of the root
+ * dir, which gives every operation the entry it will get, so that applying it
+ * cannot fail on a name or an entry. Then the operations are applied in
+ * memory and the metadata is written once.
+ */
+static int _batch_add(uint8_t type, const char* filename, const char* new_filename, size_t length)
+{
+    if( (1 != g_mounted_flag)||(0 == g_batch.open)||(0 != _check_filename(filename))
+        ||((NULL != new_filename)&&(0 != _check_filename(new_filename)))||(UINT32_MAX < length) ){
+        return -1;
+    }
+
+    if(g_batch.op_num == g_batch.op_cap){
+        uint32_t new_cap = my_max(2*g_batch.op_cap, 16);
+        Batch_Op* new_ops = (Batch_Op*)realloc(g_batch.ops, new_cap*sizeof(Batch_Op));
+        if(NULL == new_ops){
+            return -1;
+        }
+        g_batch.ops = new_ops;
+        g_batch.op_cap = new_cap;
+    }
+
+    Batch_Op* op = &(g_batch.ops[g_batch.op_num++]);
+    memset(op, 0, sizeof(Batch_Op));
+    op->type = type;
+    strncpy(op->filename, filename, FS_FILENAME_LEN-1);
+    if(NULL != new_filename){
+        strncpy(op->new_filename, new_filename, FS_FILENAME_LEN-1);
+    }
+    op->length = length;
+    return 0;
+}
+
+static void _batch_release(void)
+{
+    free(g_batch.ops);
+    memset(&g_batch, 0, sizeof(Batch_Info));
+}
+
+//free what the mount holds, nothing is written back
+static void _drop_mount(void)
+{
+    _scrub_stop();
+    _release_mount();
+    _batch_release();
+    _release_fd_table();
+    g_mounted_flag = 0;
+}
+
+//the same, then close the disk
+static int _close_mount(void)
+{
+    _drop_mount();
+    return block_disk_close();
+}
+
+//play the batch on a copy of the root dir; size changes only need blocks to
+//copy shared ones, counted high
+static int _batch_check(void)
+{
+    Root_Dir_Info* root = (Root_Dir_Info*)malloc(sizeof(Root_Dir_Info));
+    if(NULL == root){
+        return -1;
+    }
+    memcpy(root, &g_rootDirInfo, sizeof(Root_Dir_Info));
+
+    int ret = 0;
+    uint64_t block_need = 0;
+    for(uint32_t cnt = 0; (0 == ret)&&(cnt < g_batch.op_num); ++cnt){
+        const Batch_Op* op = &(g_batch.ops[cnt]);
+        int16_t idx = _dir_search(root, op->filename);
+        if(BATCH_CREATE == op->type){
+            //no file by that name, and a free entry
+            idx = (-1 == idx)?_dir_find_empty(root):-1;
+            if(-1 == idx){
+                ret = -1;
+            }
+            else{
+                _dir_fill(root, idx, op->filename);
+            }
+        }
+        else if( (-1 == idx)
+            ||((BATCH_DELETE == op->type)&&(0 != g_inodes[idx].refcnt))
+            ||((BATCH_RENAME == op->type)&&(-1 != _dir_search(root, op->new_filename))) ){
+            ret = -1;
+        }
+        else if(BATCH_DELETE == op->type){
+            _dir_clear(root, idx);
+        }
+        else if(BATCH_RENAME == op->type){
+            memset(root->files[idx].filename, 0, FS_FILENAME_LEN);
+            strncpy(root->files[idx].filename, op->new_filename, FS_FILENAME_LEN-1);
+        }
+        else{
+            uint32_t size = root->files[idx].file_size;
+            if(NULL != g_refcnt.data){
+                block_need += (op->length <= size)?1:(_blocks_for_len(op->length)-(size >> g_blockShift));
+            }
+            root->files[idx].file_size = op->length;
+        }
+    }
+    free(root);
+
+    if(g_FATInfo.free_num < block_need){
+        ret = -1;
+    }
+    return ret;
+}
+
+//apply the checked batch to the metadata in memory
+static int _batch_apply(void)
+{
+    for(uint32_t cnt = 0; cnt < g_batch.op_num; ++cnt){
+        const Batch_Op* op = &(g_batch.ops[cnt]);
+        int16_t idx = (BATCH_CREATE == op->type)?_find_empty_entry():_search_file_by_filename(op->filename);
+        if(BATCH_CREATE == op->type){
+            _dir_fill(&g_rootDirInfo, idx, op->filename);
+            g_fileNumTotal++;
+        }
+        else if(BATCH_DELETE == op->type){
+            if(-1 == _remove_file(idx)){
+                return -1;
+            }
+        }
+        else if(BATCH_RENAME == op->type){
+            memset(g_rootDirInfo.files[idx].filename, 0, FS_FILENAME_LEN);
+            memcpy(g_rootDirInfo.files[idx].filename, op->new_filename, strnlen(op->new_filename, FS_FILENAME_LEN-1));
+        }
+        else{
+            Inode* ino = _inode_get(idx);
+            if(NULL == ino){
+                return -1;
+            }
+            pthread_mutex_lock(&(ino->lock));
+            int ret = _file_truncate(ino, op->length);
+            ret |= _zstore(ino);
+            pthread_mutex_unlock(&(ino->lock));
+            _inode_put(ino);
+            if(-1 == ret){
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+
+/////////////////////API
+int fs_format(const char *diskname, size_t data_block_num,
+    const struct fs_format_opts *opts)
+{
+    if(0 != g_mounted_flag){
+        return -1;
+    }
+
+    size_t block_size = BLOCK_SIZE;
+    if((NULL != opts)&&(0 != opts->block_size)){
+        block_size = opts->block_size;
+    }
+
+    int8_t shift = _get_block_shift(block_size);
+    if(-1 == shift){
+        return -1;
+    }
+
+    //FAT_EOC is not a valid data block index
+    if((0 == data_block_num)||(FAT_EOC < data_block_num)){
+        return -1;
+    }
+
+    size_t fat_block_num = (data_block_num*sizeof(uint16_t)+block_size-1) >> shift;
+    size_t rdir_block_num = (sizeof(Root_Dir_Info)+block_size-1) >> shift;
+    size_t block_num_total = 1+fat_block_num+rdir_block_num+data_block_num;
+    if((UINT8_MAX < fat_block_num)||(UINT16_MAX < block_num_total)){
+        return -1;
+    }
+
+    //the journal takes the first data blocks, at least enough for a
+    //transaction that changes all the metadata
+    size_t meta_block_num = 1+fat_block_num+rdir_block_num;
+    size_t journal_block_num = 0;
+    if((NULL != opts)&&(0 != opts->journal_block_num)){
+        size_t head_block_num = (sizeof(Journal_Head)+meta_block_num*sizeof(uint16_t)+block_size-1) >> shift;
+        journal_block_num = my_max(opts->journal_block_num, 1+head_block_num+meta_block_num);
+        if(data_block_num <= journal_block_num){
+            return -1;
+        }
+    }
+
+    //the image is sparse, only the metadata is written
+    if(-1 == block_disk_create(diskname, block_num_total, block_size)){
+        return -1;
+    }
+
+    uint8_t* meta = (uint8_t*)calloc(meta_block_num+1, block_size);
+    if(NULL == meta){
+        return -1;
+    }
+
+    if((-1 == block_disk_set_block_size(block_size))||(-1 == block_disk_open(diskname))){
+        block_disk_set_block_size(BLOCK_SIZE);
+        free(meta);
+        return -1;
+    }
+
+    Super_Block_Info* sb = (Super_Block_Info*)meta;
+    memcpy(sb->sign, DEFAULT_SIGN, sizeof(sb->sign));
+    sb->block_num_total = block_num_total;
+    sb->root_dir_block_idx = 1+fat_block_num;
+    sb->data_block_idx = meta_block_num;
+    sb->data_block_num = data_block_num;
+    sb->fat_block_num = fat_block_num;
+    sb->block_shift = (BLOCK_SHIFT_DEFAULT == shift)?0:shift;
+
+    //FAT entry 0 is never handed out, the root dir is empty
+    uint16_t* fat = (uint16_t*)(meta+block_size);
+    fat[0] = FAT_EOC;
+    if(0 != journal_block_num){
+        sb->journal_block_idx = 1;
+        sb->journal_block_num = journal_block_num;
+        for(size_t cnt = 1; cnt <= journal_block_num; ++cnt){
+            fat[cnt] = (cnt < journal_block_num)?(cnt+1):FAT_EOC;
+        }
+    }
+    int ret = block_write_many(0, meta_block_num, meta);
+
+    //journal super block, nothing to replay
+    if(0 != journal_block_num){
+        Journal_Head* jsb = (Journal_Head*)(meta+(meta_block_num << shift));
+        memcpy(jsb->sign, JOURNAL_SUPER_SIGN, sizeof(jsb->sign));
+        jsb->seq = 1;
+        ret |= block_write(meta_block_num+1, jsb);
+    }
+
+    free(meta);
+    block_disk_close();
+    return (0 == ret)?0:-1;
+}
+
+int fs_mount(const char *diskname)
+{
+//    printf("%s\n", __FUNCTION__);
+    if(0 != g_mounted_flag){
+        //has mounted
+        return -1;
+    }
+
+    _fat_scan_init();
+    _csum_kernel_init();
+
+    //every valid image is a multiple of the smallest block size, and the
+    //super block fits in the smallest block
+    block_disk_set_block_size(BLOCK_SIZE_MIN);
+    int mnt_ret = block_disk_open(diskname);
+    if (0 != mnt_ret)
+    {
+        block_disk_set_block_size(BLOCK_SIZE);
+        return mnt_ret;
+    }
+    else
+    {
+        //mount fs
+        //read super block
+        if(-1 == block_read(0, &g_superBlockInfo)){
+            return _fail_mount();
+        }
+
+        //fs_info();
+
+        //check signature
+        if(0 != strncmp(DEFAULT_SIGN, g_superBlockInfo.sign, strlen(DEFAULT_SIGN))){
+            return _fail_mount();
+        }
+
+        //switch to the block size of the fs
+        uint8_t shift = g_superBlockInfo.block_shift;
+        if(0 == shift){
+            shift = BLOCK_SHIFT_DEFAULT;
+        }
+        if((BLOCK_SHIFT_MIN > shift)||(BLOCK_SHIFT_MAX < shift)){
+            return _fail_mount();
+        }
+        g_blockShift = shift;
+        g_blockSize = (uint32_t)1 << shift;
+        if(-1 == block_disk_set_block_size(g_blockSize)){
+            return _fail_mount();
+        }
+
+        //invalidate amount of block
+        if(g_superBlockInfo.block_num_total != block_disk_count()){
+            return _fail_mount();
+        }
+
+        //check layout
+        g_FATLen = g_superBlockInfo.data_block_num;
+        if( (((uint32_t)g_superBlockInfo.fat_block_num << g_blockShift) < g_FATLen*sizeof(uint16_t))
+            ||(g_superBlockInfo.root_dir_block_idx != g_superBlockInfo.fat_block_num+1)
+            ||(g_superBlockInfo.data_block_idx < g_superBlockInfo.root_dir_block_idx+_blocks_for_len(sizeof(Root_Dir_Info)))
+            ||(g_superBlockInfo.data_block_idx+g_FATLen != g_superBlockInfo.block_num_total) ){
+            return _fail_mount();
+        }
+
+        g_blockBuf = (uint8_t*)malloc(g_blockSize);
+        if(NULL == g_blockBuf){
+            return _fail_mount();
+        }
+
+        //replay what a crash left in the journal, the super block may be in it
+        if(0 != g_superBlockInfo.journal_block_num){
+            if( (0 == g_superBlockInfo.journal_block_idx)
+                ||((uint32_t)g_superBlockInfo.journal_block_idx+g_superBlockInfo.journal_block_num > g_FATLen) ){
+                return _fail_mount();
+            }
+            if( (-1 == _journal_replay())
+                ||(-1 == _meta_read(0, &g_superBlockInfo, sizeof(Super_Block_Info))) ){
+                return _fail_mount();
+            }
+        }
+
+        //read fat
+        //real len should be g_FATLen
+        //but easy for reading or writing, malloc max len of memory
+        g_FATInfo.data = (uint16_t*)malloc((size_t)g_superBlockInfo.fat_block_num << g_blockShift);
+        if(NULL == g_FATInfo.data){
+            return _fail_mount();
+        }
+
+        if( -1 == _meta_read(1, g_FATInfo.data, (uint32_t)g_superBlockInfo.fat_block_num << g_blockShift) ){
+            return _fail_mount();
+        }
+
+#if 0
+        for(uint32_t idx = 0; idx < g_FATLen; idx++){
+            if(0 != g_FATInfo.data[idx]){
+                printf("idx(%d),val(%d)\n", idx, g_FATInfo.data[idx]);
+            }
+        }
+#endif
+
+        //read root dir info
+        if( -1 == _meta_read(g_superBlockInfo.root_dir_block_idx, &g_rootDirInfo, sizeof(Root_Dir_Info)) ){
+            return _fail_mount();
+        }
+
+#if 0
+        for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; idx++){
+            if(0 != g_rootDirInfo.files[idx].start_data_block_idx){
+                printf("[%d]filename(%s),size(%d),idx(%d)\n", idx,
+                    g_rootDirInfo.files[idx].filename,
+                    g_rootDirInfo.files[idx].file_size,
+                    g_rootDirInfo.files[idx].start_data_block_idx);
+            }
+        }
+#endif
+
+        //read all data
+        if(-1 == _alloc_arena((size_t)g_superBlockInfo.data_block_num << g_blockShift)){
+            return _fail_mount();
+        }
+        g_all_data.flags = (uint8_t*)calloc(g_superBlockInfo.data_block_num, sizeof(uint8_t));
+        if(NULL == g_all_data.flags){
+            return _fail_mount();
+        }
+        if( -1 == block_read_many(g_superBlockInfo.data_block_idx, g_superBlockInfo.data_block_num, _frame(0)) ){
+            return _fail_mount();
+        }
+        if( (-1 == _refcnt_load())||(-1 == _csum_load()) ){
+            return _fail_mount();
+        }
+
+        g_FATInfo.free_num = _get_free_FAT_num();
+        g_FATInfo.free_hint = 1;
+        g_fileNumTotal = _get_fs_file_num();
+        g_freeRun.len = 0;
+        _frag_load();
+        if( (0 != g_checksum)&&(NULL == g_csum.data)&&(-1 == _csum_create()) ){
+            return _fail_mount();
+        }
+        if( (0 != g_scrub)&&(-1 == _scrub_start()) ){
+            return _fail_mount();
+        }
+        if( ((0 != g_journalSize)&&(0 == g_superBlockInfo.journal_block_num)&&(-1 == _journal_create()))
+            ||(-1 == _journal_start()) ){
+            _scrub_stop();
+            return _fail_mount();
+        }
+        g_mounted_flag = 1;
+    }
+
+    return 0;
+}
+
+int fs_umount(void)
+{
+//    printf("%s\n", __FUNCTION__);
+    if(0 != g_openedFileNum){
+        return -1;
+    }
+
+    if(1 != g_mounted_flag){
+        return -1;
+    }
+
+    _op_begin();
+    int ret = _sync_all();
+    _op_end();
+    if( (-1 == ret)||(-1 == _journal_stop(1)) ){
+        return -1;
+    }
+    return _close_mount();
+}
+
+int fs_sync(void)
+{
+    if(1 != g_mounted_flag){
+        return -1;
+    }
+
+    _op_begin();
+    int ret = _sync_all();
+    _op_end();
+    return ret;
+}
+
+int fs_info(void)
+{
+    printf("FS Info:\n");
+    printf("total_blk_count=%d\n", g_superBlockInfo.block_num_total);
+    printf("fat_blk_count=%d\n", g_superBlockInfo.fat_block_num);
+    printf("rdir_blk=%d\n", g_superBlockInfo.root_dir_block_idx);
+    printf("data_blk=%d\n", g_superBlockInfo.data_block_idx);
+    printf("data_blk_count=%d\n", g_superBlockInfo.data_block_num);
+    printf("fat_free_ratio=%d/%d\n", g_FATInfo.free_num,
+        g_superBlockInfo.data_block_num);
+    printf("rdir_free_ratio=%d/%d\n", FS_FILE_MAX_COUNT-g_fileNumTotal, FS_FILE_MAX_COUNT);
+
+    return 0;
+}
+
+int fs_set_option(enum fs_option opt, size_t value)
+{
+    switch(opt){
+    case FS_OPT_OPEN_MAX:
+        if( (0 == value)||(FS_OPEN_MAX_LIMIT < value)||(value < g_openedFileNum) ){
+            return -1;
+        }
+        g_openMax = value;
+        return 0;
+    case FS_OPT_HUGEPAGES:
+        g_hugePages = (0 != value);
+        return 0;
+    case FS_OPT_WRITE_COMBINE:
+        g_writeCombine = (0 != value);
+        return 0;
+    case FS_OPT_PUNCH_HOLE:
+        g_punchHole = (0 != value);
+        return 0;
+    case FS_OPT_SCRUB:
+        g_scrub = (0 != value);
+        return 0;
+    case FS_OPT_JOURNAL:
+        if(UINT16_MAX < value){
+            return -1;
+        }
+        g_journalSize = value;
+        return 0;
+    case FS_OPT_COMMIT_INTERVAL:
+        if(UINT32_MAX/1000 < value){
+            return -1;
+        }
+        g_commitInterval = value;
+        return 0;
+    case FS_OPT_FAT_SIMD:
+        g_fatSimd = (0 != value);
+        return 0;
+    case FS_OPT_CHECKSUM:
+        g_checksum = (0 != value);
+        return 0;
+    case FS_OPT_DEDUP:
+        g_dedup = (0 != value);
+        return 0;
+    case FS_OPT_PACK:
+        g_pack = (0 != value);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+static int _create(const char *filename)
+{
+//    printf("%s\n", __FUNCTION__);
+    if(FS_FILE_MAX_COUNT <= g_fileNumTotal){
+        return -1;
+    }
+
+    if(0 != _check_filename(filename)){
+        return -1;
+    }
+
+    if(-1 != _search_file_by_filename(filename)){
+        //already existed
+        return -1;
+    }
+
+    int16_t idx = _find_empty_entry();
+    if(-1 == idx){
+        return -1;
+    }
+
+    _dir_fill(&g_rootDirInfo, idx, filename);
+    g_fileNumTotal++;
+    return 0;
+}
+
+int fs_create(const char *filename)
+{
+    _op_begin();
+    int ret = _create(filename);
+    _op_end();
+    return ret;
+}
+
+static int _delete(const char *filename)
+{
+//    printf("%s\n", __FUNCTION__);
+    if(0 != _check_filename(filename)){
+        return -1;
+    }
+
+    int16_t file_idx = _search_file_by_filename(filename);
+    if(-1 == file_idx){
+        //not found
+        return -1;
+    }
+
+    if(0 != g_inodes[file_idx].refcnt){
+        //opened
+        return -1;
+    }
+
+    if(-1 == _remove_file(file_idx)){
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_delete(const char *filename)
+{
+    _op_begin();
+    int ret = _delete(filename);
+    _op_end();
+    return ret;
+}
+
+int fs_ls(void)
+{
+    printf("FS Ls:\n");
+
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        if(0 != g_rootDirInfo.files[idx].start_data_block_idx){
+            printf("file: %s, size: %d, data_blk: %d\n",
+                g_rootDirInfo.files[idx].filename,
+                g_rootDirInfo.files[idx].file_size,
+                g_rootDirInfo.files[idx].start_data_block_idx);
+        }
+    }
+
+    return 0;
+}
+
+int fs_open(const char *filename)
+{
+    return fs_open_flags(filename, 0);
+}
+
+static int _open_flags(const char *filename, int flags)
+{
+//    printf("%s\n", __FUNCTION__);
+    if(0 != _check_filename(filename)){
+        return -1;
+    }
+
+    if(0 != (flags & ~FS_O_APPEND)){
+        return -1;
+    }
+
+    if(g_openMax <= g_openedFileNum){
+        return -1;
+    }
+
+    int16_t file_idx = _search_file_by_filename(filename);
+    if(-1 == file_idx){
+        //not found
+        return -1;
+    }
+
+    int32_t open_idx = _alloc_file_des();
+    if(-1 == open_idx){
+        return -1;
+    }
+
+    Inode* ino = _inode_get(file_idx);
+    if(NULL == ino){
+        _free_file_des(open_idx);
+        return -1;
+    }
+
+    File_Des* fDes = _get_file_des(open_idx);
+    fDes->ino = ino;
+    fDes->offset = 0;
+    fDes->flags = flags;
+    fDes->wcombine = g_writeCombine;
+    fDes->wc_block = 0;
+
+    g_openedFileNum++;
+    return open_idx;
+}
+
+int fs_open_flags(const char *filename, int flags)
+{
+    _op_begin();
+    int ret = _open_flags(filename, flags);
+    _op_end();
+    return ret;
+}
+
+int fs_close(int fd)
+{
+//    printf("%s\n", __FUNCTION__);
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
+    }
+
+    _op_begin();
+    //a frame that fails to flush stays dirty, umount writes it back
+    _flush_pending(&(fDes->wc_block));
+    if(1 == fDes->ino->refcnt){
+        _flush_pending(&(fDes->ino->tail_block));
+        //the content of a compressed file would be lost, the descriptor
+        //stays open
+        if(-1 == _zstore(fDes->ino)){
+            _op_end();
+            return -1;
+        }
+    }
+    _inode_put(fDes->ino);
+    _free_file_des(fd);
+    g_openedFileNum--;
+    //a stored stream is committed like any write
+    _op_end();
+    return 0;
+}
+
+int fs_stat(int fd)
+{
+//    printf("%s\n", __FUNCTION__);
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
+    }
+
+    return fDes->ino->size;
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+//    printf("%s\n", __FUNCTION__);
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
+    }
+
+    if(UINT32_MAX < offset){
+        return -1;
+    }
+
+    //a write elsewhere is not sequential anymore
+    _flush_pending(&(fDes->wc_block));
+    fDes->offset = offset;
+    return 0;
+}
+
+//append under the inode lock: the tail block is found from the block map and
+//stays in the cache, marked dirty, until appends fill it
+static int _append(File_Des* fDes, const void *buf, size_t count)
+{
+    Inode* ino = fDes->ino;
+    uint32_t write_cnt = 0;
+    pthread_mutex_lock(&(ino->lock));
+    if(0 != ino->compressed){
+        write_cnt = _zwrite(ino, ino->size, buf, my_min(count, (size_t)UINT32_MAX));
+        fDes->offset = ino->size;
+        pthread_mutex_unlock(&(ino->lock));
+        return write_cnt;
+    }
+    int packed = _pack_prepare(ino, (uint64_t)ino->size+count);
+    if(0 != packed){
+        write_cnt = (1 == packed)?_pack_write(ino, ino->size, buf, count):0;
+        fDes->offset = ino->size;
+        pthread_mutex_unlock(&(ino->lock));
+        return write_cnt;
+    }
+    if(0 != g_dedup){
+        write_cnt = _dedup_write(ino, &(ino->tail_block), ino->size, buf, my_min(count, (size_t)UINT32_MAX));
+    }
+    else{
+        _BLOCK_SIZE_DISPATCH(write_cnt, _write_at, ino, &(ino->tail_block), ino->size, buf, count);
+    }
+
+    _inode_set_size(ino, ino->size+write_cnt);
+    fDes->offset = ino->size;
+    pthread_mutex_unlock(&(ino->lock));
+    return write_cnt;
+}
+
+int fs_append(int fd, const void *buf, size_t count)
+{
+    if( (NULL == buf)||(0 == count) ){
+        return 0;
+    }
+
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
+    }
+
+    _op_begin();
+    int write_cnt = _append(fDes, buf, count);
+    _op_end();
+    return write_cnt;
+}
+
+int fs_fallocate(int fd, size_t length)
+{
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
+    }
+
+    if(UINT32_MAX < length){
+        return -1;
+    }
+
+    Inode* ino = fDes->ino;
+    _op_begin();
+    pthread_mutex_lock(&(ino->lock));
+    int ret = 0;
+    uint32_t block_num = _blocks_for_len(length);
+    if(0 != ino->compressed){
+        //the room the content takes is only known once it is compressed
+        ret = 0;
+    }
+    else if( (0 != ino->packed)&&(-1 == _pack_undo(ino)) ){
+        ret = -1;
+    }
+    else if(0 != ino->mapped){
+        ret = _inode_fill_holes(ino, 0, block_num);
+    }
+    else if(ino->block_num < block_num){
+        ret = _inode_append_blocks(ino, block_num-ino->block_num);
+    }
+    pthread_mutex_unlock(&(ino->lock));
+    _op_end();
+    return ret;
+}
+
+int fs_truncate(int fd, size_t length)
+{
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
+    }
+
+    if(UINT32_MAX < length){
+        return -1;
+    }
+
+    Inode* ino = fDes->ino;
+    _op_begin();
+    pthread_mutex_lock(&(ino->lock));
+    int ret = _file_truncate(ino, length);
+    pthread_mutex_unlock(&(ino->lock));
+    _op_end();
+    return ret;
+}
+
+static int _ftruncate(const char *filename, size_t length)
+{
+    if( (1 != g_mounted_flag)||(0 != _check_filename(filename)) ){
+        return -1;
+    }
+
+    if(UINT32_MAX < length){
+        return -1;
+    }
+
+    int16_t file_idx = _search_file_by_filename(filename);
+    if(-1 == file_idx){
+        //not found
+        return -1;
+    }
+
+    Inode* ino = _inode_get(file_idx);
+    if(NULL == ino){
+        return -1;
+    }
+
+    pthread_mutex_lock(&(ino->lock));
+    int ret = _file_truncate(ino, length);
+    ret |= _zstore(ino);
+    pthread_mutex_unlock(&(ino->lock));
+    _inode_put(ino);
+    return ret;
+}
+
+int fs_ftruncate(const char *filename, size_t length)
+{
+    _op_begin();
+    int ret = _ftruncate(filename, length);
+    _op_end();
+    return ret;
+}
+
+//write at the offset of the descriptor, the caller commits
+static uint32_t _write(File_Des* fDes, const void *buf, size_t count)
+{
+    Inode* ino = fDes->ino;
+    uint16_t* pending = (0 != fDes->wcombine)?&(fDes->wc_block):NULL;
+    uint32_t write_cnt = 0;
+    pthread_mutex_lock(&(ino->lock));
+    if(0 != ino->compressed){
+        write_cnt = _zwrite(ino, fDes->offset, buf, my_min(count, (size_t)UINT32_MAX));
+        fDes->offset += write_cnt;
+        pthread_mutex_unlock(&(ino->lock));
+        return write_cnt;
+    }
+    int packed = _pack_prepare(ino, (uint64_t)fDes->offset+count);
+    if(0 != packed){
+        write_cnt = (1 == packed)?_pack_write(ino, fDes->offset, buf, count):0;
+        fDes->offset += write_cnt;
+        pthread_mutex_unlock(&(ino->lock));
+        return write_cnt;
+    }
+    if( (ino->size < fDes->offset)&&(-1 == _inode_truncate(ino, fDes->offset)) ){
+        //the gap reads as zeros, but a shared block could not be copied
+        pthread_mutex_unlock(&(ino->lock));
+        return 0;
+    }
+    if(0 != g_dedup){
+        write_cnt = _dedup_write(ino, pending, fDes->offset, buf, my_min(count, (size_t)UINT32_MAX));
+    }
+    else{
+        _BLOCK_SIZE_DISPATCH(write_cnt, _write_at, ino, pending, fDes->offset, buf, count);
+    }
+
+    if(ino->size < fDes->offset+write_cnt){
+        _inode_set_size(ino, fDes->offset+write_cnt);
+    }
+    //printf("filesize(%d), wc(%d)\n", ino->size, write_cnt);
+    fDes->offset += write_cnt;
+    pthread_mutex_unlock(&(ino->lock));
+    return write_cnt;
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+//    printf("%s\n", __FUNCTION__);
+    if( (NULL == buf)||(0 == count) ){
+        return 0;
+    }
+
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
+    }
+
+    //every way of writing is committed the same
+    _op_begin();
+    uint32_t write_cnt = (0 != (FS_O_APPEND & fDes->flags))?_append(fDes, buf, count):_write(fDes, buf, count);
+    _op_end();
+    return write_cnt;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+//    printf("%s\n", __FUNCTION__);
+    if( (NULL == buf)||(0 == count) ){
+        return 0;
+    }
+
+    //get file des
+    File_Des* fDes = _get_file_des(fd);
+    if(NULL == fDes){
+        return -1;
     }
 
-    //delete
-    memset(g_rootDirInfo.files[file_idx].filename, 0, FS_FILENAME_LEN);
-    g_rootDirInfo.files[file_idx].file_size = 0;
-    g_rootDirInfo.files[file_idx].start_data_block_idx = 0;
+    Inode* ino = fDes->ino;
+    pthread_mutex_lock(&(ino->lock));
+    uint32_t file_remain_len = (ino->size > fDes->offset)?(ino->size-fDes->offset):0;
+    uint32_t read_len = my_min(file_remain_len, count);
+    uint32_t read_cnt = 0;
+    if(0 != ino->compressed){
+        read_cnt = _zread(ino, fDes->offset, buf, read_len);
+    }
+    else if(0 != ino->packed){
+        read_cnt = _pack_read(ino, fDes->offset, buf, read_len);
+    }
+    else{
+        _BLOCK_SIZE_DISPATCH(read_cnt, _read_at, ino, fDes->offset, buf, read_len);
+    }
+    if( (0 == read_cnt)&&(0 != read_len) ){
+        //starts in a block that failed its checksum, or the stream of a
+        //compressed file is damaged
+        pthread_mutex_unlock(&(ino->lock));
+        return -1;
+    }
 
-    g_fileNumTotal--;
-    return 0;
+    //printf("filesize(%d), rc(%d)\n", ino->size, read_cnt);
+    fDes->offset += read_cnt;
+    pthread_mutex_unlock(&(ino->lock));
+    return read_cnt;
 }
 
-int fs_ls(void)
+static int _copy(const char *src_filename, const char *dst_filename)
 {
-    printf("FS Ls:\n");
+    if( (1 != g_mounted_flag)||(0 != _check_filename(src_filename)) ){
+        return -1;
+    }
 
-    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
-        if(0 != g_rootDirInfo.files[idx].start_data_block_idx){
-            printf("file: %s, size: %d, data_blk: %d\n",
-                g_rootDirInfo.files[idx].filename,
-                g_rootDirInfo.files[idx].file_size,
-                g_rootDirInfo.files[idx].start_data_block_idx);
-        }
+    int16_t src_idx = _search_file_by_filename(src_filename);
+    if( (-1 == src_idx)||(-1 == _create(dst_filename)) ){
+        //no source, or destination invalid or already there
+        return -1;
+    }
+    int16_t dst_idx = _search_file_by_filename(dst_filename);
+
+    Inode* src = _inode_get(src_idx);
+    if(NULL == src){
+        _delete(dst_filename);
+        return -1;
+    }
+    Inode* dst = _inode_get(dst_idx);
+    if(NULL == dst){
+        _inode_put(src);
+        _delete(dst_filename);
+        return -1;
+    }
+
+    //the copy of a compressed file is compressed too
+    if(0 != src->compressed){
+        g_rootDirInfo.files[dst_idx].flags |= FE_FLAG_COMPRESSED;
+        dst->compressed = 1;
+    }
+    pthread_mutex_lock(&(src->lock));
+    int64_t copy_cnt = _copy_range(src, 0, dst, 0, src->size);
+    if( (-1 != copy_cnt)&&(-1 == _zstore(dst)) ){
+        copy_cnt = -1;
+    }
+    pthread_mutex_unlock(&(src->lock));
+
+    _inode_put(dst);
+    _inode_put(src);
+    if(-1 == copy_cnt){
+        _delete(dst_filename);
+        return -1;
     }
 
     return 0;
 }
 
-int fs_open(const char *filename)
+int fs_copy(const char *src_filename, const char *dst_filename)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(0 != _check_filename(filename)){
+    _op_begin();
+    int ret = _copy(src_filename, dst_filename);
+    _op_end();
+    return ret;
+}
+
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out, size_t count)
+{
+    //get file des
+    File_Des* fDesIn = _get_file_des(fd_in);
+    File_Des* fDesOut = _get_file_des(fd_out);
+    if( (NULL == fDesIn)||(NULL == fDesOut) ){
         return -1;
     }
 
-    if(FS_OPEN_MAX_COUNT <= g_openedFileNum){
+    if( (UINT32_MAX < off_in)||(UINT32_MAX < off_out) ){
         return -1;
     }
 
-    int16_t file_idx = _search_file_by_filename(filename);
-    if(-1 == file_idx){
-        //not found
+    //lock in root dir order, once for a copy within a file
+    Inode* src = fDesIn->ino;
+    Inode* dst = fDesOut->ino;
+    Inode* first = (src->idx <= dst->idx)?src:dst;
+    Inode* second = (src->idx <= dst->idx)?dst:src;
+    _op_begin();
+    pthread_mutex_lock(&(first->lock));
+    if(first != second){
+        pthread_mutex_lock(&(second->lock));
+    }
+
+    int64_t copy_cnt = _copy_range(src, off_in, dst, off_out, my_min(count, (size_t)UINT32_MAX));
+
+    if(first != second){
+        pthread_mutex_unlock(&(second->lock));
+    }
+    pthread_mutex_unlock(&(first->lock));
+    _op_end();
+    return copy_cnt;
+}
+
+static int _clone(const char *src_filename, const char *dst_filename)
+{
+    if( (1 != g_mounted_flag)||(0 != _check_filename(src_filename))
+        ||(0 != _check_filename(dst_filename)) ){
         return -1;
     }
 
-    int16_t open_idx = _find_space_for_open_file();
-    if(-1 == open_idx){
+    //the destination must be creatable before the sharing starts
+    int16_t src_idx = _search_file_by_filename(src_filename);
+    if( (-1 == src_idx)||(-1 != _search_file_by_filename(dst_filename))
+        ||(FS_FILE_MAX_COUNT <= g_fileNumTotal) ){
         return -1;
     }
 
-    File_Des* fDes = (File_Des*)malloc(sizeof(File_Des));
-    if(NULL == fDes){
+    Inode* src = _inode_get(src_idx);
+    if(NULL == src){
         return -1;
     }
 
-    fDes->idx = file_idx;
-    fDes->offset = 0;
-    g_openedFiles[open_idx] = fDes;
+    //both files need map blocks to share data blocks, the stream of a
+    //compressed file is shared once stored
+    pthread_mutex_lock(&(src->lock));
+    if( (-1 == _zstore(src))||( (0 != src->packed)&&(-1 == _pack_undo(src)) ) ){
+        pthread_mutex_unlock(&(src->lock));
+        _inode_put(src);
+        return -1;
+    }
+    uint32_t map_num = (0 == src->block_num)?1:(((src->block_num-1) >> (g_blockShift-1))+1);
+    uint32_t map_more = (0 != src->mapped)?0:map_num;
+    uint32_t refcnt_more = (NULL != g_refcnt.data)?0:_refcnt_block_num();
+    Inode* dst = NULL;
+    if( (g_FATInfo.free_num < map_num+map_more+refcnt_more)
+        ||(-1 == _refcnt_init())
+        ||( (0 == src->mapped)&&(-1 == _inode_make_mapped(src)) )
+        ||(-1 == _create(dst_filename))
+        ||(NULL == (dst = _inode_get(_search_file_by_filename(dst_filename))))
+        ||(-1 == _inode_make_mapped(dst))
+        ||(-1 == _inode_reserve_blocks(dst, src->block_num)) ){
+        pthread_mutex_unlock(&(src->lock));
+        _inode_put(src);
+        if(NULL != dst){
+            _inode_put(dst);
+        }
+        _delete(dst_filename);
+        return -1;
+    }
 
-    g_openedFileNum++;
-    return open_idx;
+    for(uint32_t lblk = 0; lblk < src->block_num; ++lblk){
+        uint16_t block_idx = src->blocks[lblk];
+        if(0 != block_idx){
+            _map_set(dst, lblk, block_idx);
+            g_refcnt.data[block_idx]++;
+        }
+        dst->blocks[lblk] = block_idx;
+    }
+    dst->block_num = src->block_num;
+    g_refcnt.dirty = 1;
+    _inode_set_size(dst, src->size);
+    g_rootDirInfo.files[dst->idx].flags |= (FE_FLAG_COMPRESSED & g_rootDirInfo.files[src->idx].flags);
+    pthread_mutex_unlock(&(src->lock));
+
+    _inode_put(dst);
+    _inode_put(src);
+    return 0;
 }
 
-int fs_close(int fd)
+int fs_clone(const char *src_filename, const char *dst_filename)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(FS_FILE_MAX_COUNT <= fd){
+    _op_begin();
+    int ret = _clone(src_filename, dst_filename);
+    _op_end();
+    return ret;
+}
+
+static int _snapshot_create(void)
+{
+    if( (1 != g_mounted_flag)||(-1 == _refcnt_init())||(-1 == _zstore_all()) ){
         return -1;
     }
 
-    //get file des
-    File_Des* fDes = g_openedFiles[fd];
-    if(NULL == fDes){
+    uint32_t len = sizeof(Root_Dir_Info)+g_FATLen*sizeof(uint16_t);
+    uint8_t* buf = (uint8_t*)malloc(len);
+    if(NULL == buf){
         return -1;
     }
 
-    free(fDes);
+    if(0 != g_superBlockInfo.snapshot_block_idx){
+        if(-1 == _snapshot_drop()){
+            free(buf);
+            return -1;
+        }
+    }
+    else{
+        uint32_t block_num = _snapshot_block_num();
+        if(g_FATInfo.free_num < block_num){
+            free(buf);
+            return -1;
+        }
+
+        g_superBlockInfo.snapshot_block_idx = _take_chain(block_num);
+    }
+
+    //every block in use gets one more owner, then the metadata is frozen
+    _walk_file_blocks(&g_rootDirInfo, g_FATInfo.data, _get_block);
+    memcpy(buf, &g_rootDirInfo, sizeof(Root_Dir_Info));
+    memcpy(buf+sizeof(Root_Dir_Info), g_FATInfo.data, g_FATLen*sizeof(uint16_t));
+    _fat_drop_freed((uint16_t*)(buf+sizeof(Root_Dir_Info)), g_journal.freed_num);
+    _chain_copy(g_superBlockInfo.snapshot_block_idx, buf, len, 1);
+    free(buf);
 
-    g_openedFiles[fd] = NULL;
-    g_openedFileNum--;
-    return 0;
+    return _sync_all();
 }
 
-int fs_stat(int fd)
+int fs_snapshot_create(void)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(FS_FILE_MAX_COUNT <= fd){
+    _op_begin();
+    int ret = _snapshot_create();
+    _op_end();
+    return ret;
+}
+
+static int _snapshot_restore(void)
+{
+    if( (1 != g_mounted_flag)||(0 != g_openedFileNum)||(0 == g_superBlockInfo.snapshot_block_idx) ){
         return -1;
     }
 
-    //get file des
-    File_Des* fDes = g_openedFiles[fd];
-    if(NULL == fDes){
+    uint8_t* buf = _snapshot_load();
+    uint16_t* csum_chain = (uint16_t*)malloc(_csum_block_num()*sizeof(uint16_t));
+    if( (NULL == buf)||(NULL == csum_chain) ){
+        free(buf);
+        free(csum_chain);
         return -1;
     }
+    uint32_t csum_num = 0;
+    for(uint16_t block_idx = g_superBlockInfo.csum_block_idx; (0 != block_idx)&&(FAT_EOC != block_idx);
+        block_idx = g_FATInfo.data[block_idx]){
+        csum_chain[csum_num++] = block_idx;
+    }
+
+    //the files let go of their blocks, blocks only they use are freed
+    _walk_file_blocks(&g_rootDirInfo, g_FATInfo.data, _put_block);
+    _free_run_flush();
+
+    //the frozen metadata comes back, and its files own their blocks again
+    memcpy(&g_rootDirInfo, buf, sizeof(Root_Dir_Info));
+    memcpy(g_FATInfo.data, buf+sizeof(Root_Dir_Info), g_FATLen*sizeof(uint16_t));
+    free(buf);
+    _walk_file_blocks(&g_rootDirInfo, g_FATInfo.data, _get_block);
+
+    //the journal may be younger than the snapshot, it keeps its blocks
+    uint16_t run_start = g_superBlockInfo.journal_block_idx;
+    for(uint32_t cnt = 0; cnt < g_superBlockInfo.journal_block_num; ++cnt){
+        g_FATInfo.data[run_start+cnt] = (cnt+1 < g_superBlockInfo.journal_block_num)?(run_start+cnt+1):FAT_EOC;
+    }
+    //so may the checksum table
+    for(uint32_t cnt = 0; cnt < csum_num; ++cnt){
+        g_FATInfo.data[csum_chain[cnt]] = (cnt+1 < csum_num)?csum_chain[cnt+1]:FAT_EOC;
+    }
+    free(csum_chain);
+    //a freed block the snapshot uses is not freed after all, the others still
+    //wait for the commit
+    uint32_t freed_num = 0;
+    for(uint32_t cnt = 0; cnt < g_journal.freed_num; ++cnt){
+        uint16_t idx = g_journal.freed[cnt];
+        if(0 == g_FATInfo.data[idx]){
+            g_FATInfo.data[idx] = FAT_EOC;
+            g_journal.freed[freed_num++] = idx;
+        }
+    }
+    g_journal.freed_num = freed_num;
+    g_journal.freed_done = freed_num;
 
-    return g_rootDirInfo.files[fDes->idx].file_size;
+    g_FATInfo.free_num = _get_free_FAT_num()+freed_num;
+    g_FATInfo.free_hint = 1;
+    g_fileNumTotal = _get_fs_file_num();
+    //blocks changed owners without being freed
+    _dedup_reset();
+    _frag_load();
+    return _sync_all();
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_snapshot_restore(void)
 {
-//    printf("%s\n", __FUNCTION__);
-    if(FS_FILE_MAX_COUNT <= fd){
-        return -1;
-    }
+    _op_begin();
+    int ret = _snapshot_restore();
+    _op_end();
+    return ret;
+}
 
-    //get file des
-    File_Des* fDes = g_openedFiles[fd];
-    if(NULL == fDes){
+int fs_batch_begin(void)
+{
+    if( (1 != g_mounted_flag)||(0 != g_batch.open) ){
         return -1;
     }
 
-    uint32_t file_size = g_rootDirInfo.files[fDes->idx].file_size;
-    if(offset > file_size){
+    g_batch.op_num = 0;
+    g_batch.open = 1;
+    return 0;
+}
+
+int fs_batch_create(const char *filename)
+{
+    return _batch_add(BATCH_CREATE, filename, NULL, 0);
+}
+
+int fs_batch_delete(const char *filename)
+{
+    return _batch_add(BATCH_DELETE, filename, NULL, 0);
+}
+
+int fs_batch_rename(const char *filename, const char *new_filename)
+{
+    if(NULL == new_filename){
         return -1;
     }
 
-    fDes->offset = offset;
-    return 0;
+    return _batch_add(BATCH_RENAME, filename, new_filename, 0);
 }
 
-int fs_write(int fd, void *buf, size_t count)
+int fs_batch_truncate(const char *filename, size_t length)
 {
-//    printf("%s\n", __FUNCTION__);
-    if( (NULL == buf)||(0 == count) ){
-        return 0;
+    return _batch_add(BATCH_TRUNCATE, filename, NULL, length);
+}
+
+static int _batch_commit(void)
+{
+    if( (1 != g_mounted_flag)||(0 == g_batch.open) ){
+        return -1;
     }
 
-    if(FS_FILE_MAX_COUNT <= fd){
+    int ret = _batch_check();
+    if(0 == ret){
+        ret = _batch_apply();
+    }
+    _batch_release();
+    if(-1 == ret){
         return -1;
     }
 
-    //get file des
-    File_Des* fDes = g_openedFiles[fd];
-    if(NULL == fDes){
+    return _sync_all();
+}
+
+int fs_batch_commit(void)
+{
+    _op_begin();
+    int ret = _batch_commit();
+    _op_end();
+    return ret;
+}
+
+int fs_batch_abort(void)
+{
+    if(0 == g_batch.open){
         return -1;
     }
 
-    File_Entry* pFE = &(g_rootDirInfo.files[fDes->idx]);
-    uint32_t write_len = count;
-    uint8_t tmp_buf[BLOCK_SIZE] = {0};
-    uint32_t write_cnt = 0;
+    _batch_release();
+    return 0;
+}
 
-    uint16_t start_block_idx = _get_block_idx_for_new_pos(fDes->idx, fDes->offset, 0);
-    if(FAT_EOC == start_block_idx){
-        //new file
-        start_block_idx = _find_empty_FAT();
-        pFE->start_data_block_idx = start_block_idx;
-        g_FATInfo.data[pFE->start_data_block_idx] = FAT_EOC;
+static int _defrag(size_t max_blocks, struct fs_defrag_stats *stats)
+{
+    if(1 != g_mounted_flag){
+        return -1;
     }
 
-    uint32_t add_len = 0;
-    if(pFE->file_size < fDes->offset+write_len){
-        add_len = (fDes->offset+write_len)-pFE->file_size;
+    uint32_t frag_before = _fs_fragments();
+    uint16_t old_heads[FS_FILE_MAX_COUNT] = {0};
+    uint32_t old_num = 0;
+    size_t moved_num = 0;
+    int ret = 0;
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        File_Entry* pFE = &(g_rootDirInfo.files[idx]);
+        if( (0 != ((FE_FLAG_MAPPED | FE_FLAG_PACKED) & pFE->flags))||(0 != g_inodes[idx].refcnt)
+            ||(1 >= _chain_fragments(pFE->start_data_block_idx)) ){
+            continue;
+        }
+        if(moved_num >= max_blocks){
+            //over budget, more to do
+            ret = 1;
+            break;
+        }
+
+        uint16_t old_head = pFE->start_data_block_idx;
+        uint32_t block_num = 0;
+        for(uint16_t block_idx = old_head; FAT_EOC != block_idx; block_idx = g_FATInfo.data[block_idx]){
+            block_num++;
+        }
+        if(0 == _defrag_file(idx, block_num)){
+            old_heads[old_num++] = old_head;
+            moved_num += block_num;
+        }
     }
 
-    if(BLOCK_SIZE < (fDes->offset+write_len)){
-        uint16_t block_step = (fDes->offset+write_len)/BLOCK_SIZE;
-        uint32_t remain_len = (fDes->offset+write_len)%BLOCK_SIZE;
-        uint16_t offset_of_first_block = fDes->offset%BLOCK_SIZE;
-        if(0 == remain_len){
-            remain_len = BLOCK_SIZE;
+    //the new chains are named on disk before the old ones can be taken again;
+    //if that fails the disk may still name the old ones, which are left taken
+    //for fsck to free
+    if( (0 != old_num)&&(-1 == _sync_all()) ){
+        ret = -1;
+        old_num = 0;
+    }
+    for(uint32_t cnt = 0; cnt < old_num; ++cnt){
+        uint16_t block_idx = old_heads[cnt];
+        while(FAT_EOC != block_idx){
+            uint16_t next_idx = g_FATInfo.data[block_idx];
+            _release_FAT(block_idx);
+            block_idx = next_idx;
         }
+    }
+    _free_run_flush();
 
-        //data in first block
-        block_read(start_block_idx, tmp_buf);
-        memcpy(tmp_buf+offset_of_first_block, buf, BLOCK_SIZE-offset_of_first_block);
-        block_write(start_block_idx, tmp_buf);
-        write_cnt = BLOCK_SIZE-offset_of_first_block;
+    if(NULL != stats){
+        stats->frags_before = frag_before;
+        stats->frags_after = _fs_fragments();
+        stats->blocks_moved = moved_num;
+    }
+    return ret;
+}
 
-        //data in middle blocks
-        uint16_t old_block_idx = start_block_idx;
-        uint16_t block_idx = g_FATInfo.data[old_block_idx];
-        //skip first and last block, so -2
-        for(uint16_t cnt = 2; cnt < block_step; ++cnt){
-            if(FAT_EOC == block_idx){
-                block_idx = _find_empty_FAT();
-                g_FATInfo.data[old_block_idx] = block_idx;
-            }
+int fs_defrag(size_t max_blocks, struct fs_defrag_stats *stats)
+{
+    _op_begin();
+    int ret = _defrag(max_blocks, stats);
+    _op_end();
+    return ret;
+}
+
+int fs_layout_report(void)
+{
+    if(1 != g_mounted_flag){
+        return -1;
+    }
 
-            block_read(block_idx, tmp_buf);
-            memcpy(tmp_buf, buf+write_cnt, BLOCK_SIZE);
-            block_write(block_idx, tmp_buf);
-            write_cnt += BLOCK_SIZE;
-            old_block_idx = block_idx;
-            block_idx = g_FATInfo.data[old_block_idx];
+    printf("FS Layout:\n");
+    for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        const File_Entry* pFE = &(g_rootDirInfo.files[idx]);
+        if(0 == pFE->start_data_block_idx){
+            continue;
         }
 
-        //data in last block
-        if(FAT_EOC == block_idx){
-            block_idx = _find_empty_FAT();
-            g_FATInfo.data[old_block_idx] = block_idx;
+        Layout_Info info = {0};
+        uint32_t chain_len = _layout_file(pFE, &info);
+        printf("file: name=%s, chain=%u, blocks=%u, extents=%u, avg_extent=%.2f, seek=%lu\n",
+            pFE->filename, chain_len, info.block_num, info.extent_num,
+            (0 == info.extent_num)?0.0:(double)info.block_num/info.extent_num, (unsigned long)info.seek);
+    }
+
+    //free runs by length: bucket k holds the runs of 2^k to 2^(k+1)-1 blocks
+    uint32_t hist[17] = {0};
+    uint32_t free_num = 0;
+    uint32_t run_num = 0;
+    uint32_t run_len = 0;
+    int bucket_max = -1;
+    for(uint32_t idx = 1; idx <= g_FATLen; ++idx){
+        if( (idx < g_FATLen)&&(0 == g_FATInfo.data[idx]) ){
+            run_len++;
+            continue;
+        }
+        if(0 != run_len){
+            int bucket = 31-__builtin_clz(run_len);
+            hist[bucket]++;
+            bucket_max = my_max(bucket_max, bucket);
+            free_num += run_len;
+            run_num++;
+            run_len = 0;
         }
-        block_read(block_idx, tmp_buf);
-        memcpy(tmp_buf, buf+write_cnt, remain_len);
-        block_write(block_idx, tmp_buf);
-        write_cnt += remain_len;
     }
-    else{
-        //write data in this block
-        block_read(start_block_idx, tmp_buf);
-        memcpy(tmp_buf+fDes->offset, buf, write_len);
-        block_write(start_block_idx, tmp_buf);
-        write_cnt += write_len;
+
+    printf("free: blocks=%u, extents=%u, avg_extent=%.2f\n", free_num, run_num,
+        (0 == run_num)?0.0:(double)free_num/run_num);
+    for(int bucket = 0; bucket <= bucket_max; ++bucket){
+        printf("free_hist: min=%u, max=%u, extents=%u\n", 1u << bucket, (2u << bucket)-1, hist[bucket]);
     }
 
-    pFE->file_size += add_len;
-    //printf("filesize(%d), addlen(%d), wc(%d)\n", pFE->file_size, add_len, write_cnt);
-    fDes->offset += write_cnt;
-    return write_cnt;
+    return 0;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_resize(const char *diskname, size_t data_block_num)
 {
-//    printf("%s\n", __FUNCTION__);
-    if( (NULL == buf)||(0 == count) ){
-        return 0;
+    if( (0 != g_mounted_flag)||(FAT_EOC < data_block_num) ){
+        return -1;
     }
 
-    if(FS_FILE_MAX_COUNT <= fd){
+    if(0 != fs_mount(diskname)){
         return -1;
     }
 
-    //get file des
-    File_Des* fDes = g_openedFiles[fd];
-    if(NULL == fDes){
+    //everything is in memory, the old image is only read from now on
+    uint8_t resizable = (0 == g_superBlockInfo.snapshot_block_idx)&&(0 == _journal_stop(1));
+    _scrub_stop();
+    block_disk_close();
+    int ret = (0 != resizable)?_resize_write(diskname, data_block_num):-1;
+
+    _drop_mount();
+    return ret;
+}
+
+int fs_fsck(const char *diskname, int repair, size_t thread_num, struct fs_fsck_report *report)
+{
+    if(0 != g_mounted_flag){
         return -1;
     }
 
-    File_Entry* pFE = &(g_rootDirInfo.files[fDes->idx]);
-    uint32_t file_remain_len = pFE->file_size - fDes->offset;
-    uint32_t read_len = my_min(file_remain_len, count);
-    uint16_t start_block_idx = _get_block_idx_for_new_pos(fDes->idx, fDes->offset, 0);
-    uint8_t tmp_buf[BLOCK_SIZE] = {0};
-    uint32_t read_cnt = 0;
+    //the image is checked as it is: no checksum table or journal added, no
+    //freed block scrubbed
+    uint8_t checksum = g_checksum;
+    uint32_t journal_size = g_journalSize;
+    uint8_t scrub = g_scrub;
+    g_checksum = 0;
+    g_journalSize = 0;
+    g_scrub = 0;
+    int mount_ret = fs_mount(diskname);
+    g_checksum = checksum;
+    g_journalSize = journal_size;
+    g_scrub = scrub;
+    if(0 != mount_ret){
+        return -1;
+    }
+
+    if(0 == thread_num){
+        long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+        thread_num = (0 < cpu_num)?cpu_num:1;
+    }
+    thread_num = my_min(thread_num, FSCK_THREAD_MAX);
+
+    Fsck_Info info = { .roots = {&g_rootDirInfo}, .fats = {g_FATInfo.data}, .root_num = 1, .thread_num = thread_num };
+    Fsck_Task* tasks = (Fsck_Task*)calloc(thread_num, sizeof(Fsck_Task));
+    info.claims = (uint32_t*)calloc(g_FATLen, sizeof(uint32_t));
+    int ret = ( (NULL == tasks)||(NULL == info.claims) )?-1:0;
+    for(uint32_t cnt = 0; (0 == ret)&&(cnt < thread_num); ++cnt){
+        tasks[cnt].id = cnt;
+        tasks[cnt].info = &info;
+        tasks[cnt].stamps = (uint32_t*)calloc(g_FATLen, sizeof(uint32_t));
+        ret = (NULL == tasks[cnt].stamps)?-1:0;
+    }
 
-    if(BLOCK_SIZE < (fDes->offset+read_len)){
-        uint16_t block_step = (fDes->offset+read_len)/BLOCK_SIZE;
-        uint32_t remain_len = (fDes->offset+read_len)%BLOCK_SIZE;
-        uint16_t offset_of_first_block = fDes->offset%BLOCK_SIZE;
-        //printf("alllen(%d), step(%d), remain(%d)\n", (fDes->offset+read_len), block_step, remain_len);
-        if(0 == remain_len){
-            remain_len = BLOCK_SIZE;
+    //the metadata chains come first, the snapshot is only read if its chain holds
+    uint8_t journal_bad = 0;
+    uint8_t snapshot_bad = 0;
+    uint8_t* snapshot = NULL;
+    if(0 == ret){
+        uint32_t stamp = 2*FS_FILE_MAX_COUNT;
+        _fsck_meta_chain(&(tasks[0]), g_superBlockInfo.refcnt_block_idx, ++stamp);
+        _fsck_meta_chain(&(tasks[0]), g_superBlockInfo.csum_block_idx, ++stamp);
+        snapshot_bad = (-1 == _fsck_meta_chain(&(tasks[0]), g_superBlockInfo.snapshot_block_idx, ++stamp));
+        journal_bad = (0 != g_superBlockInfo.journal_block_num)
+            &&(-1 == _fsck_meta_chain(&(tasks[0]), g_superBlockInfo.journal_block_idx, ++stamp));
+        if( (0 == snapshot_bad)&&(0 != g_superBlockInfo.snapshot_block_idx) ){
+            snapshot = _snapshot_load();
+            ret = (NULL == snapshot)?-1:0;
+            info.roots[1] = (const Root_Dir_Info*)snapshot;
+            info.fats[1] = (const uint16_t*)(snapshot+sizeof(Root_Dir_Info));
+            info.root_num = 2;
         }
+    }
+
+    struct fs_fsck_report sum = {0};
+    if(0 == ret){
+        _fsck_run(tasks, thread_num, _fsck_claim_main);
+        _fsck_run(tasks, thread_num, _fsck_scan_main);
+        for(uint32_t cnt = 0; cnt < thread_num; ++cnt){
+            sum.bad_chains += tasks[cnt].bad_chains;
+            sum.bad_sizes += tasks[cnt].bad_sizes;
+            sum.cross_links += tasks[cnt].cross_links;
+            sum.leaks += tasks[cnt].leaks;
+            sum.bad_refcnts += tasks[cnt].bad_refcnts;
+            sum.bad_entries += tasks[cnt].bad_entries;
+        }
+        sum.bad_checksums = g_csum.bad_num;
+        size_t error_num = sum.bad_chains+sum.bad_sizes+sum.cross_links+sum.leaks+sum.bad_refcnts+sum.bad_entries
+            +sum.bad_checksums;
+        if( (0 != repair)&&(0 != error_num) ){
+            sum.repaired = _fsck_repair(&info, &(tasks[0]), journal_bad, snapshot_bad);
+        }
+        ret = (0 == error_num)?0:1;
+        if(NULL != report){
+            *report = sum;
+        }
+    }
+
+    free(snapshot);
+    for(uint32_t cnt = 0; (NULL != tasks)&&(cnt < thread_num); ++cnt){
+        free(tasks[cnt].stamps);
+    }
+    free(tasks);
+    free(info.claims);
+    //only a repair writes the file system back
+    uint8_t write_back = (0 != repair)&&(-1 != ret);
+    if( (0 != write_back)&&(-1 == _sync_all()) ){
+        ret = -1;
+        write_back = 0;
+    }
+    int stop_ret = _journal_stop(write_back);
+    if( (-1 == _close_mount())||(-1 == stop_ret) ){
+        return -1;
+    }
+    return ret;
+}
+
+static int _set_compressed(const char *filename, int compressed)
+{
+    if( (1 != g_mounted_flag)||(0 != _check_filename(filename)) ){
+        return -1;
+    }
+
+    int16_t file_idx = _search_file_by_filename(filename);
+    if( (-1 == file_idx)||(0 != g_inodes[file_idx].refcnt) ){
+        //not found, or opened
+        return -1;
+    }
+
+    Inode* ino = _inode_get(file_idx);
+    if(NULL == ino){
+        return -1;
+    }
+    if( (0 != compressed) == (0 != ino->compressed) ){
+        _inode_put(ino);
+        return 0;
+    }
+
+    //the blocks of the file are freed before the content is written back,
+    //unless other files share them
+    uint32_t size = ino->size;
+    uint32_t need = _blocks_for_len((uint64_t)size+_zcluster_num(size)*sizeof(uint32_t));
+    need += (need >> (g_blockShift-1))+1;
+    uint32_t freed = 0;
+    for(uint32_t lblk = 0; lblk < ino->block_num; ++lblk){
+        freed += (0 != ino->blocks[lblk])&&(0 == _block_shared(ino->blocks[lblk]));
+    }
+    for(uint32_t map = 0; map < ino->map_num; ++map){
+        freed += (0 == _block_shared(ino->map_blocks[map]));
+    }
+    uint8_t* buf = (uint8_t*)malloc(my_max(size, 1));
+    if( (g_FATInfo.free_num+freed < need)||(NULL == buf)||(size != _file_read(ino, 0, buf, size)) ){
+        free(buf);
+        _inode_put(ino);
+        return -1;
+    }
+
+    _zrelease(ino);
+    int ret = (0 != ino->packed)?_pack_truncate(ino, 0):_inode_truncate(ino, 0);
+    if(0 == ret){
+        if(0 != compressed){
+            g_rootDirInfo.files[file_idx].flags |= FE_FLAG_COMPRESSED;
+        }
+        else{
+            g_rootDirInfo.files[file_idx].flags &= ~FE_FLAG_COMPRESSED;
+        }
+        ino->compressed = (0 != compressed);
+        if( (size != _file_write(ino, 0, buf, size))||(-1 == _zstore(ino)) ){
+            ret = -1;
+        }
+    }
+    free(buf);
+    _inode_put(ino);
+    return ret;
+}
+
+int fs_set_compressed(const char *filename, int compressed)
+{
+    _op_begin();
+    int ret = _set_compressed(filename, compressed);
+    _op_end();
+    return ret;
+}
+
+/*
+ * Offline deduplication. A first pass over the blocks of every file finds the
+ * files holding a block seen before, and those holding the first copy: the
+ * chained ones among them get map blocks. A second pass, over the mapped
+ * files, shares each block with the first one of the same bytes.
+ */
+static int _dedup_files(struct fs_dedup_stats* stats)
+{
+    uint8_t dup_files[FS_FILE_MAX_COUNT] = {0};
+    uint16_t* owners = (uint16_t*)malloc(g_FATLen*sizeof(uint16_t));
+    if( (NULL == owners)||(-1 == _dedup_alloc()) ){
+        free(owners);
+        return -1;
+    }
 
-        //data in first block
-        block_read(start_block_idx, tmp_buf);
-        memcpy(buf, tmp_buf+offset_of_first_block, BLOCK_SIZE-offset_of_first_block);
-        read_cnt += BLOCK_SIZE-offset_of_first_block;
+    for(int pass = 0; pass < 2; ++pass){
+        for(uint16_t idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+            if( (0 == g_rootDirInfo.files[idx].start_data_block_idx)
+                ||( (1 == pass)&&(0 == (FE_FLAG_MAPPED & g_rootDirInfo.files[idx].flags)) ) ){
+                continue;
+            }
+            Inode* ino = _inode_get(idx);
+            if(NULL == ino){
+                free(owners);
+                return -1;
+            }
 
-        //data in middle blocks
-        uint16_t block_idx = g_FATInfo.data[start_block_idx];
-        //skip first and last block, so -2
-        for(uint16_t cnt = 2; cnt < block_step; ++cnt){
-            if(FAT_EOC != block_idx){
-                block_read(block_idx, tmp_buf);
-                memcpy(buf+read_cnt, tmp_buf, BLOCK_SIZE);
-                read_cnt += BLOCK_SIZE;
-                block_idx = g_FATInfo.data[block_idx];
+            for(uint32_t lblk = 0; lblk < ino->block_num; ++lblk){
+                uint16_t block_idx = ino->blocks[lblk];
+                if( (0 == block_idx)||(0 != (FRAME_BAD & g_all_data.flags[block_idx])) ){
+                    continue;
+                }
+                uint32_t hash = g_csumKernel.one(_frame(block_idx), g_blockSize);
+                uint16_t match = _dedup_find(_frame(block_idx), hash);
+                stats->scanned += (0 == pass);
+                if(0 == match){
+                    _dedup_add(block_idx, hash);
+                    owners[block_idx] = idx;
+                }
+                else if( (0 == pass)&&(match != block_idx) ){
+                    dup_files[idx] = 1;
+                    dup_files[owners[match]] = 1;
+                }
+                else if( (match != block_idx)&&(0 == _dedup_map(ino, NULL, lblk, match)) ){
+                    stats->shared++;
+                }
             }
+            _inode_put(ino);
         }
 
-        //data in last block
-        block_idx = g_FATInfo.data[block_idx];
-        memcpy(buf+read_cnt, tmp_buf, remain_len);
-        read_cnt += remain_len;
+        //a file that cannot get map blocks keeps its own
+        for(uint16_t idx = 0; (0 == pass)&&(idx < FS_FILE_MAX_COUNT); ++idx){
+            if( (0 != dup_files[idx])&&(0 == (FE_FLAG_MAPPED & g_rootDirInfo.files[idx].flags)) ){
+                Inode* ino = _inode_get(idx);
+                if(NULL != ino){
+                    _inode_make_mapped(ino);
+                    _inode_put(ino);
+                }
+            }
+        }
+        _dedup_reset();
+        if( (0 == pass)&&(-1 == _dedup_alloc()) ){
+            free(owners);
+            return -1;
+        }
     }
-    else{
-        //read data in this block
-        block_read(start_block_idx, tmp_buf);
-        memcpy(buf, tmp_buf+fDes->offset, read_len);
-        read_cnt += read_len;
+
+    free(owners);
+    return 0;
+}
+
+int fs_dedup(const char *diskname, struct fs_dedup_stats *stats)
+{
+    if( (1 == g_mounted_flag)||(-1 == fs_mount(diskname)) ){
+        return -1;
     }
 
-    //printf("filesize(%d), rc(%d)\n", pFE->file_size, read_cnt);
-    fDes->offset += read_cnt;
-    return read_cnt;
+    struct fs_dedup_stats sum = {0};
+    uint32_t free_before = g_FATInfo.free_num;
+    _dedup_reset();
+    int ret = _dedup_files(&sum);
+    _dedup_reset();
+    sum.freed = (g_FATInfo.free_num > free_before)?(g_FATInfo.free_num-free_before):0;
+    if(NULL != stats){
+        *stats = sum;
+    }
+
+    if(-1 == fs_umount()){
+        return -1;
+    }
+    return ret;
 }
@@ -9,16 +9,127 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
+/** Default maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** fs_open_flags() flag: every write goes to the end of the file */
+#define FS_O_APPEND 0x01
+
+/** Upper bound for the maximum number of open files, see %FS_OPT_OPEN_MAX */
+#define FS_OPEN_MAX_LIMIT 65536
+
+/** Tunable options, see fs_set_option() */
+enum fs_option {
+	/** Maximum number of simultaneously open files */
+	FS_OPT_OPEN_MAX,
+	/** Back the block cache with huge pages */
+	FS_OPT_HUGEPAGES,
+	/** Combine small writes to a block before writing it to disk */
+	FS_OPT_WRITE_COMBINE,
+	/** Release freed blocks from the disk image */
+	FS_OPT_PUNCH_HOLE,
+	/** Zero freed blocks on disk in the background */
+	FS_OPT_SCRUB,
+	/** Size in blocks of the metadata journal created at the next mount */
+	FS_OPT_JOURNAL,
+	/** Milliseconds between two commits of the metadata journal */
+	FS_OPT_COMMIT_INTERVAL,
+	/** Scan the FAT with vector instructions */
+	FS_OPT_FAT_SIMD,
+	/** Keep a checksum of every data block, created at the next mount */
+	FS_OPT_CHECKSUM,
+	/** Share the blocks written whole with blocks of the same bytes */
+	FS_OPT_DEDUP,
+	/** Keep files of up to half a block in slots of blocks shared by small files */
+	FS_OPT_PACK,
+};
+
+/** Result of fs_defrag() */
+struct fs_defrag_stats {
+	/** Runs of consecutive blocks in the files before the call */
+	size_t frags_before;
+	/** Runs of consecutive blocks in the files after the call */
+	size_t frags_after;
+	/** Blocks copied to a new place */
+	size_t blocks_moved;
+};
+
+/*
+ * Problems found by fs_fsck(). A block is claimed by each file, in the root
+ * directory or in the snapshot, whose chain or block map names it, and by the
+ * metadata chain holding it.
+ */
+struct fs_fsck_report {
+	/** Chains with a link out of the disk, to a free block, or looping */
+	size_t bad_chains;
+	/** Files larger than their chain of blocks */
+	size_t bad_sizes;
+	/** Blocks claimed more often than their reference count allows */
+	size_t cross_links;
+	/** Blocks in use that nothing claims */
+	size_t leaks;
+	/** Blocks claimed less often than their reference count says */
+	size_t bad_refcnts;
+	/** FAT entries linking out of the disk */
+	size_t bad_entries;
+	/** Blocks of the files that failed their checksum (see %FS_OPT_CHECKSUM) */
+	size_t bad_checksums;
+	/** Fixes made in repair mode */
+	size_t repaired;
+};
+
+/** Options for fs_format() */
+struct fs_format_opts {
+	/** Size of a block in bytes (0 selects the default of 4096) */
+	size_t block_size;
+	/** Size of the metadata journal in blocks (0 for none) */
+	size_t journal_block_num;
+};
+
+/** Result of fs_dedup() */
+struct fs_dedup_stats {
+	/** Blocks of the files looked at */
+	size_t scanned;
+	/** Blocks now sharing the block of another copy */
+	size_t shared;
+	/** Blocks freed, net of the map blocks taken */
+	size_t freed;
+};
+
+/**
+ * fs_format - Create a new file system
+ * @diskname: Name of the virtual disk file
+ * @data_block_num: Number of data blocks of the new file system
+ * @opts: Format options, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname and lay out an empty file system with
+ * @data_block_num data blocks on it. The block size is chosen once here, with
+ * @opts->block_size, and recorded in the superblock: it can be any power of two
+ * between 512 B and 64 KiB. Larger blocks mean fewer FAT hops and bigger I/Os,
+ * smaller blocks waste less space at the end of each file. With
+ * @opts->journal_block_num, the file system gets a journal in its first data
+ * blocks, as with %FS_OPT_JOURNAL.
+ *
+ * The virtual disk file is created sparse, and only the superblock, the FAT
+ * and the root directory are written, in one go: formatting takes the same
+ * time whatever the size of the disk.
+ *
+ * Return: -1 if a file system is currently mounted, if @data_block_num or the
+ * block size are invalid, if the journal does not fit, or if the virtual disk
+ * file cannot be created. 0 otherwise.
+ */
+int fs_format(const char *diskname, size_t data_block_num,
+	      const struct fs_format_opts *opts);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
  *
  * Open the virtual disk file @diskname and mount the file system that it
  * contains. A file system needs to be mounted before files can be read from it
- * with fs_read() or written to it with fs_write().
+ * with fs_read() or written to it with fs_write(). If the file system has a
+ * journal (see %FS_OPT_JOURNAL), the transactions committed before a crash
+ * are replayed first.
  *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
@@ -36,6 +147,20 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Write back the file system
+ *
+ * Write the metadata and every data block that only exists in memory, such as
+ * the blocks with combined writes (see %FS_OPT_WRITE_COMBINE), to the virtual
+ * disk. With a journal (see %FS_OPT_JOURNAL), the metadata is committed to the
+ * journal after the data. The file system stays mounted and the file
+ * descriptors stay open.
+ *
+ * Return: -1 if no underlying virtual disk was opened, or if writing to it
+ * fails. 0 otherwise.
+ */
+int fs_sync(void);
+
 /**
  * fs_info - Display information about file system
  *
@@ -45,6 +170,89 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_set_option - Tune the file system
+ * @opt: Option to set
+ * @value: New value of the option
+ *
+ * Set option @opt to @value. Options keep their value across mounts until they
+ * are set again.
+ *
+ * %FS_OPT_OPEN_MAX: maximum number of files that can be open simultaneously,
+ * between 1 and %FS_OPEN_MAX_LIMIT (%FS_OPEN_MAX_COUNT by default). It can be
+ * changed while files are open, but not below the number of currently open
+ * files.
+ *
+ * %FS_OPT_HUGEPAGES: when non-zero, the cache holding the data blocks of the
+ * next mounted file system is backed by huge pages if it spans at least one.
+ * Reserved huge pages are used when available, transparent huge pages
+ * otherwise. Off by default.
+ *
+ * %FS_OPT_WRITE_COMBINE: when non-zero, file descriptors opened afterwards
+ * combine small writes: a write that does not fill its block only updates the
+ * cached copy, and the block is written to disk once it fills, or on
+ * fs_lseek(), fs_close() or fs_sync(). Small appends then cost a memory copy
+ * instead of a disk write. Off by default.
+ *
+ * %FS_OPT_PUNCH_HOLE: when non-zero, the blocks freed by fs_delete() or
+ * fs_truncate() are punched out of the virtual disk file, so that a sparse
+ * image gives their space back to the host. Runs of consecutive blocks are
+ * released at once. Ignored if the host file system cannot punch holes. Off
+ * by default.
+ *
+ * %FS_OPT_SCRUB: when non-zero, the next mounted file system zeroes freed
+ * blocks on disk, from a background thread, so that deleted data does not
+ * linger in the image. Blocks that are punched out need no zeroing, and a
+ * block allocated again before it was zeroed is cleared in memory instead.
+ * fs_umount() waits for every freed block to be zeroed. Off by default.
+ *
+ * %FS_OPT_JOURNAL: when non-zero, the next mounted file system that has no
+ * journal yet gets one of @value blocks, at most 65535, taken from a run of
+ * free data blocks. It is rounded up to hold a transaction that changes every
+ * metadata block, and silently left out if there is no free run that large.
+ * Changes to the superblock, the FAT and the root directory are then logged
+ * to the journal before they reach their home blocks, and fs_mount() replays
+ * the journal after a crash. A journal stays with the file system once
+ * created. 0 by default.
+ *
+ * %FS_OPT_COMMIT_INTERVAL: with a journal, the operations that change the
+ * file system are committed together once @value milliseconds have passed
+ * since the last commit, by the next operation or else by a background
+ * thread, and on fs_sync(). 0 commits every operation. 5 by default.
+ *
+ * %FS_OPT_FAT_SIMD: when non-zero, the next mounted file system counts and
+ * searches free FAT entries with the widest vector instructions the CPU has
+ * (AVX2 or SSE2), and with scalar code otherwise. On by default.
+ *
+ * %FS_OPT_CHECKSUM: when non-zero, the next mounted file system that has no
+ * checksum table yet gets one, in a chain of data blocks, silently left out if
+ * the disk is too full. A CRC32C of every data block written is kept in the
+ * table, computed with SSE4.2 when the CPU has it, and fs_mount() checks the
+ * blocks of the files against it. A block that fails cannot be read (see
+ * fs_read()) until it is written again. A checksum table stays with the file
+ * system once created, and blocks reserved by fs_fallocate() are written out
+ * at the next sync. Off by default.
+ *
+ * %FS_OPT_DEDUP: when non-zero, fs_write() and fs_append() share every block
+ * they write whole with a block of the same bytes already held by a file,
+ * instead of writing it, and copy it again on a later write (see fs_dedup()).
+ * The first such write indexes the blocks of the files that have map blocks,
+ * and the file written gets map blocks of its own. Takes effect at once. Off
+ * by default.
+ *
+ * %FS_OPT_PACK: when non-zero, an empty file first written with at most half
+ * a block of data goes to a run of slots, 1/64th of a block each, of a block
+ * shared with other small files, so that it takes a fraction of a block on
+ * disk. A packed file that grows past half a block, is reserved space by
+ * fs_fallocate() or is cloned moves to blocks of its own. Takes effect at
+ * once, for the files written afterwards; files already packed stay packed
+ * when it is turned off. Off by default.
+ *
+ * Return: -1 if @opt is unknown or if @value is out of range for @opt. 0
+ * otherwise.
+ */
+int fs_set_option(enum fs_option opt, size_t value);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -65,7 +273,8 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. Only the metadata is updated: the content of the freed blocks is
+ * left as is, unless %FS_OPT_PUNCH_HOLE or %FS_OPT_SCRUB is set.
  *
  * Return: -1 if @filename is invalid, if there is no file named @filename to
  * delete, or if file @filename is currently open. 0 otherwise.
@@ -91,22 +300,40 @@ int fs_ls(void);
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
  * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * simultaneously, or the limit set with %FS_OPT_OPEN_MAX. Allocating and
+ * releasing a file descriptor takes constant time, closed descriptors are
+ * reused first.
  *
  * Return: -1 if @filename is invalid, there is no file named @filename to open,
- * or if there are already %FS_OPEN_MAX_COUNT files currently open. Otherwise,
- * return the file descriptor.
+ * or if the maximum number of files are currently open. Otherwise, return the
+ * file descriptor.
  */
 int fs_open(const char *filename);
 
+/**
+ * fs_open_flags - Open a file with flags
+ * @filename: File name
+ * @flags: Bitwise OR of FS_O_* flags
+ *
+ * Same as fs_open(), with extra behavior selected by @flags. With
+ * %FS_O_APPEND, fs_write() on the returned file descriptor behaves like
+ * fs_append().
+ *
+ * Return: -1 if @flags holds unknown flags, or in the cases where fs_open()
+ * fails. Otherwise, return the file descriptor.
+ */
+int fs_open_flags(const char *filename, int flags);
+
 /**
  * fs_close - Close a file
  * @fd: File descriptor
  *
- * Close file descriptor @fd.
+ * Close file descriptor @fd. Closing the last descriptor of a compressed file
+ * writes its changes back (see fs_set_compressed()).
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). 0 otherwise.
+ * open), or if the changes of a compressed file cannot be written back, in
+ * which case @fd stays open. 0 otherwise.
  */
 int fs_close(int fd);
 
@@ -130,12 +357,67 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset can be past the end of the file. Reading there returns nothing, and
+ * writing there extends the file: the bytes skipped over read as zeros, and
+ * the blocks they span are left as holes that take no space on disk.
+ *
  * Return: -1 if file descriptor @fd is invalid (i.e., out of bounds, or not
- * currently open), or if @offset is larger than the current file size. 0
- * otherwise.
+ * currently open), or if @offset is too large. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_fallocate - Reserve space for a file
+ * @fd: File descriptor
+ * @length: Number of bytes to reserve from the beginning of the file
+ *
+ * Make sure that the file referenced by file descriptor @fd has data blocks for
+ * its first @length bytes, allocating the missing ones in one go. The new
+ * blocks are taken as one contiguous run when the disk has one, preferably
+ * right after the current last block of the file. They are not zero-filled,
+ * and the size of the file is not changed: the reserved space only gets used
+ * by later writes, which then do not allocate anything. Holes of a sparse file
+ * within the first @length bytes are filled with zeroed blocks.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), or if the disk does not have enough free blocks (in which case
+ * nothing is allocated). 0 otherwise.
+ */
+int fs_fallocate(int fd, size_t length);
+
+/**
+ * fs_truncate - Change the size of a file
+ * @fd: File descriptor
+ * @length: New size of the file
+ *
+ * Set the size of the file referenced by file descriptor @fd to @length bytes.
+ *
+ * When the file shrinks, its FAT chain is cut after the last block still
+ * needed and the remaining blocks, including space reserved with
+ * fs_fallocate(), are freed in a single pass. When it grows, no block is
+ * allocated: the new bytes read as zeros, and blocks are only allocated when
+ * they are written. File offsets of open file descriptors are not changed, but
+ * fs_read() returns nothing past the end of the file.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open), if @length is too large, or if a block shared with a clone or a
+ * snapshot cannot be copied for lack of space. 0 otherwise.
+ */
+int fs_truncate(int fd, size_t length);
+
+/**
+ * fs_ftruncate - Change the size of a file by name
+ * @filename: File name
+ * @length: New size of the file
+ *
+ * Same as fs_truncate(), for the file named @filename, which does not need to
+ * be open.
+ *
+ * Return: -1 if no file system is mounted, if @filename is invalid, if there
+ * is no file named @filename, or if @length is too large. 0 otherwise.
+ */
+int fs_ftruncate(const char *filename, size_t length);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -157,6 +439,29 @@ int fs_lseek(int fd, size_t offset);
  */
 int fs_write(int fd, void *buf, size_t count);
 
+/**
+ * fs_append - Append to a file
+ * @fd: File descriptor
+ * @buf: Data buffer to append to the file
+ * @count: Number of bytes of data to be appended
+ *
+ * Write @count bytes of data from buffer @buf at the end of the file
+ * referenced by file descriptor @fd, and move the file offset of @fd to the
+ * new end of the file. Appends from several file descriptors of the same file,
+ * in one thread or several, are serialized, so each one lands whole at the
+ * end of the file.
+ *
+ * The last block of the file and how full it is are kept in memory, so an
+ * append neither walks the FAT nor reads the block back, and a block is only
+ * written to disk once appends fill it (or on fs_sync(), or when the file is
+ * closed by its last file descriptor). Like fs_write(), the number of bytes
+ * appended can be smaller than @count if the disk runs out of space.
+ *
+ * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
+ * open). Otherwise return the number of bytes actually appended.
+ */
+int fs_append(int fd, const void *buf, size_t count);
+
 /**
  * fs_read - Read from a file
  * @fd: File descriptor
@@ -170,11 +475,311 @@ int fs_write(int fd, void *buf, size_t count);
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
  * is at the end of the file). The file offset of the file descriptor is
- * implicitly incremented by the number of bytes that were actually read.
+ * implicitly incremented by the number of bytes that were actually read. A
+ * read stops short at a block that failed its checksum (see %FS_OPT_CHECKSUM).
  *
  * Return: -1 if file descriptor @fd is invalid (out of bounds or not currently
- * open). Otherwise return the number of bytes actually read.
+ * open), or if the read starts in a block that failed its checksum. Otherwise
+ * return the number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_copy - Copy a file
+ * @src_filename: Name of the file to copy
+ * @dst_filename: Name of the new file
+ *
+ * Create a file named @dst_filename with the same content as the file named
+ * @src_filename. The data does not go through the caller: the blocks of the
+ * copy are allocated up front, as one contiguous run when the disk has one,
+ * filled from the cached blocks of @src_filename, and written to disk with
+ * one write per run of consecutive blocks. Holes of a sparse file stay holes
+ * in the copy. The source file may be open.
+ *
+ * Return: -1 if no file system is mounted, if either name is invalid, if
+ * there is no file named @src_filename, if a file named @dst_filename already
+ * exists, or if the disk does not have enough free blocks (in which case no
+ * file is created). 0 otherwise.
+ */
+int fs_copy(const char *src_filename, const char *dst_filename);
+
+/**
+ * fs_copy_range - Copy a range of bytes between files
+ * @fd_in: File descriptor to copy from
+ * @off_in: Offset in the file of @fd_in
+ * @fd_out: File descriptor to copy to
+ * @off_out: Offset in the file of @fd_out
+ * @count: Number of bytes to copy
+ *
+ * Copy @count bytes from the file referenced by @fd_in, starting at offset
+ * @off_in, into the file referenced by @fd_out at offset @off_out, the same
+ * way as fs_copy() does. Fewer bytes are copied if the source file ends
+ * before @off_in + @count. The destination file is extended as with
+ * fs_write(), a gap before @off_out reading as zeros. The file offsets of the
+ * file descriptors are not changed. Both file descriptors can refer to the
+ * same file if the two ranges do not overlap.
+ *
+ * Return: -1 if either file descriptor is invalid (out of bounds or not
+ * currently open), if the ranges overlap, if an offset is too large, or if the
+ * disk does not have enough free blocks (in which case nothing is copied).
+ * Otherwise return the number of bytes copied.
+ */
+int fs_copy_range(int fd_in, size_t off_in, int fd_out, size_t off_out, size_t count);
+
+/**
+ * fs_clone - Clone a file
+ * @src_filename: Name of the file to clone
+ * @dst_filename: Name of the new file
+ *
+ * Create a file named @dst_filename that shares the data blocks of the file
+ * named @src_filename, whatever its size: only the block map of the clone is
+ * written, and a reference count is kept for each shared block. A write to
+ * either file, through fs_write(), fs_append(), fs_truncate() or
+ * fs_copy_range(), first gives that file its own copy of the block it
+ * modifies (copy-on-write), so the other file is not changed. A shared block
+ * is freed once the last file using it lets it go.
+ *
+ * Return: -1 if no file system is mounted, if either name is invalid, if
+ * there is no file named @src_filename, if a file named @dst_filename already
+ * exists, or if the disk does not have enough free blocks for the block maps.
+ * 0 otherwise.
+ */
+int fs_clone(const char *src_filename, const char *dst_filename);
+
+/**
+ * fs_snapshot_create - Take a snapshot of the file system
+ *
+ * Freeze the current root directory and FAT of the mounted file system as its
+ * snapshot, replacing any previous one. The copy takes a few blocks of the
+ * disk, and the snapshot then shares every block in use with the files:
+ * later writes copy a shared block before changing it, the same way as for
+ * fs_clone(), so the snapshot keeps its content. Nothing is written but
+ * metadata, and the file system is synced. Files may be open.
+ *
+ * Return: -1 if no file system is mounted, or if the disk does not have
+ * enough free blocks for the snapshot. 0 otherwise.
+ */
+int fs_snapshot_create(void);
+
+/**
+ * fs_snapshot_restore - Roll the file system back to its snapshot
+ *
+ * Bring back the root directory and FAT saved by the last call to
+ * fs_snapshot_create(). Blocks written since then and not used by the
+ * snapshot are freed, and no data block is copied. The snapshot is kept, so
+ * the file system can be rolled back to it again. The file system is synced.
+ *
+ * Return: -1 if no file system is mounted, if files are open, or if there is
+ * no snapshot. 0 otherwise.
+ */
+int fs_snapshot_restore(void);
+
+/**
+ * fs_batch_begin - Start a batch of metadata operations
+ *
+ * Start recording operations with fs_batch_create(), fs_batch_delete(),
+ * fs_batch_rename() and fs_batch_truncate(). Nothing is changed until
+ * fs_batch_commit(), which applies the whole batch or none of it, and writes
+ * the metadata once for all of it. Other calls are not part of the batch.
+ * fs_umount() drops a batch that was not committed.
+ *
+ * Return: -1 if no file system is mounted, or if a batch is already started.
+ * 0 otherwise.
+ */
+int fs_batch_begin(void);
+
+/**
+ * fs_batch_create - Add the creation of a file to the batch
+ * @filename: File name
+ *
+ * Return: -1 if no batch is started, or if @filename is invalid. 0 otherwise.
+ */
+int fs_batch_create(const char *filename);
+
+/**
+ * fs_batch_delete - Add the deletion of a file to the batch
+ * @filename: File name
+ *
+ * Return: -1 if no batch is started, or if @filename is invalid. 0 otherwise.
+ */
+int fs_batch_delete(const char *filename);
+
+/**
+ * fs_batch_rename - Add the renaming of a file to the batch
+ * @filename: Current file name
+ * @new_filename: New file name
+ *
+ * The file keeps its content, and stays open if it is.
+ *
+ * Return: -1 if no batch is started, or if either name is invalid. 0
+ * otherwise.
+ */
+int fs_batch_rename(const char *filename, const char *new_filename);
+
+/**
+ * fs_batch_truncate - Add a change of file size to the batch
+ * @filename: File name
+ * @length: New size of the file
+ *
+ * Same as fs_ftruncate() once the batch is committed.
+ *
+ * Return: -1 if no batch is started, if @filename is invalid, or if @length
+ * is above 4GiB. 0 otherwise.
+ */
+int fs_batch_truncate(const char *filename, size_t length);
+
+/**
+ * fs_batch_commit - Apply the batch
+ *
+ * Check every operation of the batch, in order, against the state left by the
+ * ones before it: a file to create must not exist and have a free entry, a
+ * file to delete must exist and be closed, a file to rename or truncate must
+ * exist, and a new name must be free. If all of them pass, apply them and
+ * sync the file system once. Otherwise, nothing is changed. Either way the
+ * batch is over.
+ *
+ * Return: -1 if no batch is started, if an operation does not pass, if
+ * copying shared blocks (see fs_clone()) may need more blocks than there are
+ * free, or if writing the metadata fails. 0 otherwise.
+ */
+int fs_batch_commit(void);
+
+/**
+ * fs_batch_abort - Drop the batch
+ *
+ * Return: -1 if no batch is started. 0 otherwise.
+ */
+int fs_batch_abort(void);
+
+/**
+ * fs_defrag - Defragment files
+ * @max_blocks: Number of blocks to move before returning
+ * @stats: Filled with the fragment counts and the blocks moved, or NULL
+ *
+ * Move every file whose blocks are spread over several runs into a single run
+ * of free blocks, in one write, until about @max_blocks blocks are moved: a
+ * file is moved whole, so the last one may go over. The file entry and the
+ * FAT switch to the new blocks at once, and the old blocks are freed only
+ * after the file system is synced, so that a crash leaves the file in one
+ * place or the other. Calls can be repeated while the file system is in use
+ * until everything is done. Open files, files with holes (see fs_lseek()) and
+ * files sharing blocks (see fs_clone()) are skipped, as are files for which
+ * there is no free run large enough.
+ *
+ * Return: -1 if no file system is mounted or if writing to the disk fails, in
+ * which case the old chains of the files moved stay taken until fs_fsck()
+ * frees them. 1 if files are left to move once @max_blocks is reached, 0
+ * otherwise.
+ */
+int fs_defrag(size_t max_blocks, struct fs_defrag_stats *stats);
+
+/**
+ * fs_layout_report - Display the layout of the files on disk
+ *
+ * Display, one line per file, the name, the blocks in its FAT chain, the data
+ * blocks it uses, the extents they form (runs of consecutive blocks), their
+ * average length and the seek distance of a sequential read, as the number of
+ * blocks skipped or gone back over between extents. For a file with holes,
+ * the chain holds its map blocks. Then display the free blocks, the extents
+ * they form and their average length, and a histogram of the free extents by
+ * length, in powers of two. Lines are "tag: key=value, ..." pairs.
+ *
+ * Return: -1 if no file system is mounted. 0 otherwise.
+ */
+int fs_layout_report(void);
+
+/**
+ * fs_resize - Compact or grow a file system image
+ * @diskname: Name of the virtual disk file
+ * @data_block_num: Number of data blocks of the resized file system, or 0 for
+ * the fewest that hold the blocks in use
+ *
+ * Rebuild the unmounted file system of @diskname with @data_block_num data
+ * blocks. The blocks in use are moved, in order, to the front of the data
+ * region, and the FAT, the root directory and the block maps of files with
+ * holes are renumbered to match. The FAT is sized for @data_block_num. The
+ * new image is written to a file next to @diskname, then renamed over it, so
+ * @diskname holds either the old file system or the new one. The journal, if
+ * any, is dropped (see %FS_OPT_JOURNAL).
+ *
+ * Return: -1 if a file system is mounted, if @diskname cannot be mounted, if
+ * it has a snapshot, if @data_block_num cannot hold the blocks in use or is
+ * too large for the FAT, or if writing the new image fails. 0 otherwise.
+ */
+int fs_resize(const char *diskname, size_t data_block_num);
+
+/**
+ * fs_fsck - Check the consistency of a file system image
+ * @diskname: Name of the virtual disk file
+ * @repair: Fix the problems found if not 0
+ * @thread_num: Number of threads to check with, or 0 for one per CPU
+ * @report: Problems found, can be NULL
+ *
+ * Mount the file system of @diskname, replaying its journal, and walk the
+ * chain of every file of the root directory and of the snapshot, and the
+ * metadata chains, then check every block of the FAT against the files
+ * claiming it (see &struct fs_fsck_report). The files, then the FAT, are split
+ * between @thread_num threads.
+ *
+ * With @repair, a chain is cut before its first bad link, or before a block
+ * already claimed as often as its reference count allows, an entry of a block
+ * map naming such a block becomes a hole, and a file larger than its chain is
+ * shrunk. A snapshot or a journal that does not check out is dropped. Then the
+ * blocks nothing claims are freed, the reference counts are set to the claims,
+ * the blocks that failed their checksum are taken as they are, and the file
+ * system is written back. Without @repair nothing is written to the image but
+ * the replay of its journal: the options adding a checksum table or a journal,
+ * or scrubbing freed blocks, do not apply to the mount fsck makes.
+ *
+ * Return: -1 if a file system is mounted, if @diskname cannot be mounted, or
+ * if memory runs out. 1 if problems were found, 0 otherwise.
+ */
+int fs_fsck(const char *diskname, int repair, size_t thread_num,
+	    struct fs_fsck_report *report);
+
+/**
+ * fs_set_compressed - Turn compression of a file on or off
+ * @filename: File name
+ * @compressed: Compress the file if not 0, store it as is otherwise
+ *
+ * Rewrite the content of file @filename compressed, or as is. The blocks of a
+ * compressed file hold its content in clusters of 16 KiB, each compressed on
+ * its own with a fast LZ codec, or kept as is if it does not shrink. A
+ * cluster is decompressed into memory when first read or written, and kept
+ * while the file is open; the changed clusters are compressed and written
+ * back when the last descriptor of the file is closed, by fs_sync() and by
+ * fs_snapshot_create(): until then fs_ls() shows the size last written back.
+ * The copies made by fs_copy() and fs_clone() are compressed too.
+ * fs_fallocate() reserves nothing for a compressed file. Since the space
+ * taken is only known once stored, fs_write() and fs_append() write nothing
+ * to a compressed file, and return 0, unless the free blocks could hold the
+ * rewritten clusters uncompressed; files written at the same time share those
+ * blocks, so a write back can still run out of room and fail.
+ *
+ * Return: -1 if no file system is mounted, if @filename is invalid, does not
+ * exist or is open, if the disk lacks room for the rewritten content, or if
+ * the content cannot be read. 0 otherwise.
+ */
+int fs_set_compressed(const char *filename, int compressed);
+
+/**
+ * fs_dedup - Share the blocks of a file system image holding the same bytes
+ * @diskname: Name of the virtual disk file
+ * @stats: Blocks looked at, shared and freed, can be NULL
+ *
+ * Mount the file system of @diskname and hash every block of its files, then
+ * point each block holding the same bytes as one seen before at that block
+ * and free it. Blocks are shared through the reference counts, as by
+ * fs_clone(), and copied on a later write. A file sharing its blocks needs
+ * map blocks, which files without any block to share do not get.
+ *
+ * While %FS_OPT_DEDUP is set, fs_write() and fs_append() do the same for every
+ * block they write whole: a block that some file already holds is shared
+ * instead of written, and the file gets map blocks with its first whole block.
+ *
+ * Return: -1 if a file system is mounted, if @diskname cannot be mounted, or
+ * if memory runs out. 0 otherwise.
+ */
+int fs_dedup(const char *diskname, struct fs_dedup_stats *stats);
+
 #endif /* _FS_H */
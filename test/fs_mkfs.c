@@ -0,0 +1,44 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <fs.h>
+
+#define die(fmt, ...) \
+do { \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__); \
+	exit(1); \
+} while (0)
+
+static size_t get_argv(char *argv)
+{
+	char *end;
+	unsigned long ret = strtoul(argv, &end, 0);
+
+	if (*argv == '\0' || *end != '\0' || ret == ULONG_MAX)
+		die("invalid number '%s'", argv);
+	return (size_t)ret;
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_format_opts opts = { 0 };
+	size_t data_block_num;
+
+	if (argc < 3)
+		die("Usage: <diskname> <data block count> [<block size> [<journal blocks>]]");
+
+	data_block_num = get_argv(argv[2]);
+	if (argc > 3)
+		opts.block_size = get_argv(argv[3]);
+	if (argc > 4)
+		opts.journal_block_num = get_argv(argv[4]);
+
+	if (fs_format(argv[1], data_block_num, &opts))
+		die("Cannot format '%s'", argv[1]);
+
+	printf("Created virtual disk '%s' with '%zu' data blocks\n", argv[1],
+	       data_block_num);
+
+	return 0;
+}
@@ -1,12 +1,15 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <fs.h>
@@ -33,6 +36,14 @@ static void delete_fs(const char* diskname)
     if(system(tmp_cmd)); //ignore ret val
 }
 
+//the image as a crash would leave it
+static void copy_fs(const char* diskname, const char* copyname)
+{
+    char tmp_cmd[200] = "";
+    sprintf(tmp_cmd, "cp %s %s", diskname, copyname);
+    if(system(tmp_cmd)); //ignore ret val
+}
+
 
 void my_test_bigFile_WR(const char* diskname)
 {
@@ -231,20 +242,1891 @@ void my_test_fullOpenedFiles(const char* diskname)
     return;
 }
 
-int main(int argc, char **argv)
+void my_test_blockSizes(const char* diskname)
 {
-    delete_fs(TEST_DISK_NAME);
+    printf("TEST [%s] start\n", __FUNCTION__);
 
-    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
-    my_test_bigFile_WR(TEST_DISK_NAME);
-    delete_fs(TEST_DISK_NAME);
+    //8192 is not one of the specialized sizes
+    const size_t block_sizes[] = {512, 1024, 8192, 65536};
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_char = 0;
+    for(unsigned int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = tmp_char++;
+    }
 
-    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
-    my_test_longOffset_WR(TEST_DISK_NAME);
-    delete_fs(TEST_DISK_NAME);
+    for(unsigned int cnt = 0; cnt < sizeof(block_sizes)/sizeof(block_sizes[0]); ++cnt){
+        struct fs_format_opts opts = { .block_size = block_sizes[cnt] };
+        if(-1 == fs_format(diskname, TEST_DISK_DATA_BLOCK_NUM, &opts)){
+            printf("TEST [%s] failed, format failed, bs(%zu)\n", __FUNCTION__, block_sizes[cnt]);
+            return;
+        }
 
-    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
-    my_test_fullFiles(TEST_DISK_NAME);
+        fs_mount(diskname);
+        fs_create("test.dat");
+        int fd = fs_open("test.dat");
+        fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE/2);
+        fs_write(fd, tmp_data+TEST_BIG_FILE_SIZE/2, TEST_BIG_FILE_SIZE/2);
+        fs_close(fd);
+        fs_umount();
+
+        memset(tmp_rslt, 0, TEST_BIG_FILE_SIZE);
+        if(-1 == fs_mount(diskname)){
+            printf("TEST [%s] failed, mount failed, bs(%zu)\n", __FUNCTION__, block_sizes[cnt]);
+            return;
+        }
+        fd = fs_open("test.dat");
+        fs_lseek(fd, TEST_BIG_OFFSET);
+        fs_read(fd, tmp_rslt+TEST_BIG_OFFSET, TEST_BIG_FILE_SIZE);
+        fs_lseek(fd, 0);
+        fs_read(fd, tmp_rslt, TEST_BIG_OFFSET);
+        fs_close(fd);
+        fs_umount();
+
+        if(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)){
+            printf("TEST [%s] failed, data mismatch, bs(%zu)\n", __FUNCTION__, block_sizes[cnt]);
+            return;
+        }
+    }
+
+    printf("TEST [%s] passed, block sizes cnt(%zu)\n", __FUNCTION__,
+        sizeof(block_sizes)/sizeof(block_sizes[0]));
+}
+
+void my_test_manyOpenedFiles(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    const int open_max = 4000;
+    fs_mount(diskname);
+    fs_create("test.dat");
+    fs_set_option(FS_OPT_OPEN_MAX, open_max);
+
+    for(int cnt = 0; cnt < open_max; ++cnt){
+        int fd = fs_open("test.dat");
+        if(cnt != fd){
+            printf("TEST [%s] failed, open file failed, cnt(%d)\n", __FUNCTION__, cnt);
+            fs_set_option(FS_OPT_OPEN_MAX, FS_OPEN_MAX_COUNT);
+            return;
+        }
+    }
+
+    if(-1 != fs_open("test.dat")){
+        printf("TEST [%s] failed, opened more than %d files\n", __FUNCTION__, open_max);
+        fs_set_option(FS_OPT_OPEN_MAX, FS_OPEN_MAX_COUNT);
+        return;
+    }
+
+    //closed descriptors are handed out again, last closed first
+    fs_close(17);
+    fs_close(2000);
+    if( (2000 != fs_open("test.dat"))||(17 != fs_open("test.dat")) ){
+        printf("TEST [%s] failed, closed descriptor not reused\n", __FUNCTION__);
+        fs_set_option(FS_OPT_OPEN_MAX, FS_OPEN_MAX_COUNT);
+        return;
+    }
+
+    for(int cnt = 0; cnt < open_max; ++cnt){
+        fs_close(cnt);
+    }
+    fs_umount();
+    fs_set_option(FS_OPT_OPEN_MAX, FS_OPEN_MAX_COUNT);
+    printf("TEST [%s] passed, opened files cnt(%d)\n", __FUNCTION__, open_max);
+}
+
+void my_test_sharedOpenFile(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    memset(tmp_data, 'x', TEST_BIG_FILE_SIZE);
+
+    fs_mount(diskname);
+    fs_create("test");
+    fs_create("test.dat");
+    int fd_w = fs_open("test.dat");
+    int fd_r = fs_open("test.dat");
+    fs_write(fd_w, tmp_data, TEST_BIG_FILE_SIZE);
+
+    //both descriptors see the same file
+    if( (TEST_BIG_FILE_SIZE != fs_stat(fd_r))
+        ||(TEST_BIG_FILE_SIZE != fs_read(fd_r, tmp_rslt, TEST_BIG_FILE_SIZE))
+        ||(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, write not visible to other descriptor\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    //only the open file is busy, not the one with a prefix of its name
+    if( (-1 != fs_delete("test.dat"))||(-1 == fs_delete("test")) ){
+        printf("TEST [%s] failed, wrong open state on delete\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_close(fd_w);
+    if(-1 != fs_delete("test.dat")){
+        printf("TEST [%s] failed, deleted file still open\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_close(fd_r);
+    if(-1 == fs_delete("test.dat")){
+        printf("TEST [%s] failed, delete file failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_umount();
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_smallWrites(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    const unsigned int piece_len = 100;
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_char = 0;
+    for(unsigned int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = tmp_char++;
+    }
+
+    fs_set_option(FS_OPT_WRITE_COMBINE, 1);
+    fs_mount(diskname);
+    fs_create("test.log");
+    int fd_w = fs_open("test.log");
+    int fd_r = fs_open("test.log");
+    unsigned int written = 0;
+    while(written < TEST_BIG_FILE_SIZE){
+        unsigned int len = (TEST_BIG_FILE_SIZE-written < piece_len)?(TEST_BIG_FILE_SIZE-written):piece_len;
+        written += fs_write(fd_w, tmp_data+written, len);
+    }
+
+    //combined writes are visible before they reach the disk
+    fs_read(fd_r, tmp_rslt, TEST_BIG_FILE_SIZE);
+    if(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)){
+        printf("TEST [%s] failed, combined writes not visible\n", __FUNCTION__);
+        fs_set_option(FS_OPT_WRITE_COMBINE, 0);
+        fs_umount();
+        return;
+    }
+
+    fs_close(fd_r);
+    fs_close(fd_w);
+    fs_umount();
+    fs_set_option(FS_OPT_WRITE_COMBINE, 0);
+
+    memset(tmp_rslt, 0, TEST_BIG_FILE_SIZE);
+    fs_mount(diskname);
+    fd_r = fs_open("test.log");
+    fs_read(fd_r, tmp_rslt, TEST_BIG_FILE_SIZE);
+    fs_close(fd_r);
+    fs_umount();
+
+    if(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)){
+        printf("TEST [%s] failed, combined writes lost\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed, writes cnt(%d)\n", __FUNCTION__, (TEST_BIG_FILE_SIZE+piece_len-1)/piece_len);
+}
+
+void my_test_append(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    const unsigned int record_num = 300;
+    char record[64] = {0};
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    unsigned int data_len = 0;
+
+    fs_mount(diskname);
+    fs_create("test.log");
+    int fd_a = fs_open_flags("test.log", FS_O_APPEND);
+    int fd_b = fs_open("test.log");
+
+    //fd_a appends through fs_write, fd_b through fs_append
+    for(unsigned int cnt = 0; cnt < record_num; ++cnt){
+        int len = sprintf(record, "record %u\n", cnt);
+        int fd = (0 == cnt%2)?fd_a:fd_b;
+        fs_lseek(fd, 0);
+        int ret = (0 == cnt%2)?fs_write(fd, record, len):fs_append(fd, record, len);
+        if(len != ret){
+            printf("TEST [%s] failed, append failed, cnt(%u)\n", __FUNCTION__, cnt);
+            fs_umount();
+            return;
+        }
+        memcpy(tmp_data+data_len, record, len);
+        data_len += len;
+    }
+
+    if(data_len != fs_stat(fd_b)){
+        printf("TEST [%s] failed, size mismatch(%d)!=(%u)\n", __FUNCTION__, fs_stat(fd_b), data_len);
+        fs_umount();
+        return;
+    }
+
+    fs_close(fd_a);
+    fs_close(fd_b);
+    fs_umount();
+
+    fs_mount(diskname);
+    int fd = fs_open("test.log");
+    fs_read(fd, tmp_rslt, data_len);
+    fs_close(fd);
+    fs_umount();
+
+    if(0 != memcmp(tmp_data, tmp_rslt, data_len)){
+        printf("TEST [%s] failed, data mismatch\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed, records cnt(%u)\n", __FUNCTION__, record_num);
+}
+
+#define TEST_APPEND_RECORD_LEN      (48)
+#define TEST_APPEND_RECORD_NUM      (400)
+
+static void* append_records(void* arg)
+{
+    int fd = *(int*)arg;
+    char record[TEST_APPEND_RECORD_LEN];
+    memset(record, 'a'+fd%26, TEST_APPEND_RECORD_LEN);
+    for(int cnt = 0; cnt < TEST_APPEND_RECORD_NUM; ++cnt){
+        if(TEST_APPEND_RECORD_LEN != fs_append(fd, record, TEST_APPEND_RECORD_LEN)){
+            break;
+        }
+    }
+    return NULL;
+}
+
+void my_test_appendThreads(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    const int total_len = 2*TEST_APPEND_RECORD_NUM*TEST_APPEND_RECORD_LEN;
+    static char tmp_rslt[2*TEST_APPEND_RECORD_NUM*TEST_APPEND_RECORD_LEN];
+
+    //every append commits, while the other thread appends
+    fs_set_option(FS_OPT_JOURNAL, 64);
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 0);
+    fs_mount(diskname);
+    fs_set_option(FS_OPT_JOURNAL, 0);
+    fs_create("test.log");
+    int fds[2] = { fs_open("test.log"), fs_open("test.log") };
+    pthread_t threads[2];
+    for(int idx = 0; idx < 2; ++idx){
+        pthread_create(&threads[idx], NULL, append_records, &fds[idx]);
+    }
+    for(int idx = 0; idx < 2; ++idx){
+        pthread_join(threads[idx], NULL);
+    }
+    fs_close(fds[0]);
+    fs_close(fds[1]);
+    fs_umount();
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 5);
+
+    //records interleave whole, none lost
+    fs_mount(diskname);
+    int fd = fs_open("test.log");
+    int size = fs_stat(fd);
+    int read_len = fs_read(fd, tmp_rslt, total_len);
+    fs_close(fd);
+    fs_umount();
+    if( (total_len != size)||(total_len != read_len) ){
+        printf("TEST [%s] failed, size mismatch(%d)!=(%d)\n", __FUNCTION__, size, total_len);
+        return;
+    }
+    int counts[2] = {0};
+    for(int pos = 0; pos < total_len; pos += TEST_APPEND_RECORD_LEN){
+        int idx = (tmp_rslt[pos] == 'a'+fds[0]%26)?0:1;
+        for(int off = 0; off < TEST_APPEND_RECORD_LEN; ++off){
+            if(tmp_rslt[pos+off] != tmp_rslt[pos]){
+                printf("TEST [%s] failed, torn record at(%d)\n", __FUNCTION__, pos);
+                return;
+            }
+        }
+        counts[idx]++;
+    }
+    if( (TEST_APPEND_RECORD_NUM != counts[0])||(TEST_APPEND_RECORD_NUM != counts[1]) ){
+        printf("TEST [%s] failed, records mismatch(%d,%d)\n", __FUNCTION__, counts[0], counts[1]);
+        return;
+    }
+
+    struct fs_fsck_report report;
+    if(0 != fs_fsck(diskname, 0, 0, &report)){
+        printf("TEST [%s] failed, fsck found errors\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_fallocate(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    memset(tmp_data, 'f', TEST_BIG_FILE_SIZE);
+
+    fs_mount(diskname);
+    fs_create("test.dat");
+    int fd = fs_open("test.dat");
+
+    if( (-1 != fs_fallocate(fd, (size_t)4096*(TEST_DISK_DATA_BLOCK_NUM+1)))
+        ||(0 != fs_fallocate(fd, TEST_BIG_FILE_SIZE))
+        ||(0 != fs_stat(fd)) ){
+        printf("TEST [%s] failed, fallocate failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    //space is reserved, writes use it as is
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_lseek(fd, 0);
+    fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    if( (TEST_BIG_FILE_SIZE != fs_stat(fd))||(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, data mismatch\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_close(fd);
+    fs_umount();
+    printf("TEST [%s] passed, reserved size(%d)\n", __FUNCTION__, TEST_BIG_FILE_SIZE);
+}
+
+void my_test_truncate(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    memset(tmp_data, 't', TEST_BIG_FILE_SIZE);
+
+    fs_mount(diskname);
+    fs_create("test.dat");
+    int fd = fs_open("test.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+
+    //shrink in the middle of a block, then grow back: the tail reads as zeros
+    fs_truncate(fd, TEST_BIG_OFFSET);
+    if(TEST_BIG_OFFSET != fs_stat(fd)){
+        printf("TEST [%s] failed, shrink failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    fs_close(fd);
+    fs_ftruncate("test.dat", TEST_BIG_FILE_SIZE);
+    memset(tmp_data+TEST_BIG_OFFSET, 0, TEST_BIG_FILE_SIZE-TEST_BIG_OFFSET);
+
+    fd = fs_open("test.dat");
+    fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    if( (TEST_BIG_FILE_SIZE != fs_stat(fd))||(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, grown file mismatch\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    //cutting to zero hands every block back
+    fs_truncate(fd, 0);
+    fs_close(fd);
+    if(-1 == fs_delete("test.dat")){
+        printf("TEST [%s] failed, delete file failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_umount();
+    printf("TEST [%s] passed, size(%d)\n", __FUNCTION__, TEST_BIG_FILE_SIZE);
+}
+
+void my_test_sparse(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    //far more than the disk holds, only the blocks written get space
+    const size_t hole_offset = (size_t)4096*TEST_DISK_DATA_BLOCK_NUM*8;
+    char tmp_data[TEST_LONG_READ] = {0};
+    char tmp_rslt[TEST_LONG_READ] = {0};
+    char zeros[TEST_LONG_READ] = {0};
+    memset(tmp_data, 's', TEST_LONG_READ);
+
+    fs_mount(diskname);
+    fs_create("test.dat");
+    int fd = fs_open("test.dat");
+    fs_write(fd, tmp_data, TEST_LONG_READ);
+    fs_lseek(fd, hole_offset);
+    if(TEST_LONG_READ != fs_write(fd, tmp_data, TEST_LONG_READ)){
+        printf("TEST [%s] failed, write past the hole failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    //fill a block in the middle of the hole
+    fs_lseek(fd, hole_offset/2+TEST_BIG_OFFSET);
+    fs_write(fd, tmp_data, TEST_LONG_READ);
+    fs_close(fd);
+    fs_umount();
+
+    fs_mount(diskname);
+    fd = fs_open("test.dat");
+    if((int)(hole_offset+TEST_LONG_READ) != fs_stat(fd)){
+        printf("TEST [%s] failed, size(%d) mismatch\n", __FUNCTION__, fs_stat(fd));
+        fs_umount();
+        return;
+    }
+
+    const size_t offsets[] = { 0, TEST_LONG_READ, hole_offset/2+TEST_BIG_OFFSET, hole_offset };
+    const char* expected[] = { tmp_data, zeros, tmp_data, tmp_data };
+    for(int idx = 0; idx < 4; ++idx){
+        fs_lseek(fd, offsets[idx]);
+        fs_read(fd, tmp_rslt, TEST_LONG_READ);
+        if(0 != memcmp(expected[idx], tmp_rslt, TEST_LONG_READ)){
+            printf("TEST [%s] failed, data mismatch at offset(%zu)\n", __FUNCTION__, offsets[idx]);
+            fs_umount();
+            return;
+        }
+    }
+
+    //every block is handed back, a file as big as the disk fits again
+    fs_truncate(fd, 0);
+    fs_close(fd);
+    fs_delete("test.dat");
+    fs_create("test.dat");
+    fd = fs_open("test.dat");
+    for(int idx = 0; idx < TEST_DISK_DATA_BLOCK_NUM/2-1; ++idx){
+        if(TEST_LONG_READ != fs_write(fd, tmp_data, TEST_LONG_READ)){
+            printf("TEST [%s] failed, blocks leaked\n", __FUNCTION__);
+            fs_umount();
+            return;
+        }
+    }
+
+    fs_close(fd);
+    fs_umount();
+    printf("TEST [%s] passed, size(%zu)\n", __FUNCTION__, hole_offset+TEST_LONG_READ);
+}
+
+void my_test_scrub(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    memset(tmp_data, 'p', TEST_BIG_FILE_SIZE);
+
+    fs_set_option(FS_OPT_PUNCH_HOLE, 1);
+    fs_set_option(FS_OPT_SCRUB, 1);
+    fs_mount(diskname);
+    fs_create("test.dat");
+    int fd = fs_open("test.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_sync();
+
+    struct stat st_before;
+    stat(diskname, &st_before);
+    fs_delete("test.dat");
+    fs_umount();
+    fs_set_option(FS_OPT_PUNCH_HOLE, 0);
+    fs_set_option(FS_OPT_SCRUB, 0);
+
+    //nothing of the file is left in the image
+    struct stat st_after;
+    stat(diskname, &st_after);
+    int img_fd = open(diskname, O_RDONLY);
+    char* img = mmap(NULL, st_after.st_size, PROT_READ, MAP_PRIVATE, img_fd, 0);
+    close(img_fd);
+    off_t left_cnt = 0;
+    for(off_t pos = 0; pos < st_after.st_size; ++pos){
+        left_cnt += ('p' == img[pos]);
+    }
+    if(0 != left_cnt){
+        printf("TEST [%s] failed, deleted data still in the image\n", __FUNCTION__);
+        munmap(img, st_after.st_size);
+        return;
+    }
+    munmap(img, st_after.st_size);
+
+    printf("TEST [%s] passed, host blocks(%ld -> %ld)\n", __FUNCTION__,
+        (long)st_before.st_blocks, (long)st_after.st_blocks);
+}
+
+void my_test_copy(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_expt[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    fs_mount(diskname);
+    fs_create("src.dat");
+    int fd = fs_open("src.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    if( (0 != fs_copy("src.dat", "dst.dat"))||(-1 != fs_copy("src.dat", "dst.dat")) ){
+        printf("TEST [%s] failed, copy failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    //unaligned on both sides, then cut short by the end of the source
+    int fd_out = fs_open("dst.dat");
+    const int range_len = TEST_LONG_READ+100;
+    memcpy(tmp_expt, tmp_data, TEST_BIG_FILE_SIZE);
+    memcpy(tmp_expt+TEST_BIG_OFFSET+1000, tmp_data+100, range_len);
+    memcpy(tmp_expt+10, tmp_data+TEST_BIG_FILE_SIZE-10, 10);
+    if( (range_len != fs_copy_range(fd, 100, fd_out, TEST_BIG_OFFSET+1000, range_len))
+        ||(10 != fs_copy_range(fd, TEST_BIG_FILE_SIZE-10, fd_out, 10, range_len)) ){
+        printf("TEST [%s] failed, ranged copy failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    fs_close(fd_out);
+    fs_close(fd);
+    fs_umount();
+
+    fs_mount(diskname);
+    fd = fs_open("dst.dat");
+    fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    if( (TEST_BIG_FILE_SIZE != fs_stat(fd))||(0 != memcmp(tmp_expt, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, data mismatch\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    fs_close(fd);
+
+    //the holes of a file larger than the disk are not filled in
+    const size_t hole_offset = (size_t)4096*TEST_DISK_DATA_BLOCK_NUM*4;
+    fd = fs_open("src.dat");
+    fs_lseek(fd, hole_offset);
+    fs_write(fd, tmp_data, TEST_LONG_READ);
+    fs_close(fd);
+    if(0 != fs_copy("src.dat", "sparse.dat")){
+        printf("TEST [%s] failed, sparse copy failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    fd = fs_open("sparse.dat");
+    fs_lseek(fd, hole_offset-TEST_LONG_READ);
+    fs_read(fd, tmp_rslt, TEST_LONG_READ*2);
+    memset(tmp_expt, 0, TEST_LONG_READ);
+    memcpy(tmp_expt+TEST_LONG_READ, tmp_data, TEST_LONG_READ);
+    if( ((int)(hole_offset+TEST_LONG_READ) != fs_stat(fd))||(0 != memcmp(tmp_expt, tmp_rslt, TEST_LONG_READ*2)) ){
+        printf("TEST [%s] failed, sparse data mismatch\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_close(fd);
+    fs_umount();
+    printf("TEST [%s] passed, size(%d)\n", __FUNCTION__, TEST_BIG_FILE_SIZE);
+}
+
+void my_test_clone(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    //many more clones than the disk could hold as copies
+    const int clone_cnt = 40;
+    const int base_size = TEST_BIG_FILE_SIZE*5;
+    static char tmp_data[TEST_BIG_FILE_SIZE*5];
+    static char tmp_rslt[TEST_BIG_FILE_SIZE*5];
+    for(int idx = 0; idx < base_size; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    fs_mount(diskname);
+    fs_create("base.dat");
+    int fd = fs_open("base.dat");
+    fs_write(fd, tmp_data, base_size);
+    fs_close(fd);
+    if( (-1 != fs_clone("base.dat", NULL))||(-1 != fs_clone("base.dat", "base.dat")) ){
+        printf("TEST [%s] failed, invalid destination accepted\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    char filename[FS_FILENAME_LEN] = "";
+    for(int cnt = 0; cnt < clone_cnt; ++cnt){
+        sprintf(filename, "clone%d", cnt);
+        if(0 != fs_clone("base.dat", filename)){
+            printf("TEST [%s] failed, clone(%d) failed\n", __FUNCTION__, cnt);
+            fs_umount();
+            return;
+        }
+        fd = fs_open(filename);
+        fs_lseek(fd, cnt*1000);
+        fs_write(fd, "CLONE", 5);
+        fs_close(fd);
+    }
+    fs_umount();
+
+    //each clone only sees its own change
+    fs_mount(diskname);
+    for(int cnt = -1; cnt < clone_cnt; ++cnt){
+        sprintf(filename, "clone%d", cnt);
+        fd = fs_open((-1 == cnt)?"base.dat":filename);
+        fs_read(fd, tmp_rslt, base_size);
+        fs_close(fd);
+        if( (-1 != cnt)&&(0 != memcmp(tmp_rslt+cnt*1000, "CLONE", 5)) ){
+            printf("TEST [%s] failed, clone(%d) lost its write\n", __FUNCTION__, cnt);
+            fs_umount();
+            return;
+        }
+        if(-1 != cnt){
+            memcpy(tmp_rslt+cnt*1000, tmp_data+cnt*1000, 5);
+        }
+        if(0 != memcmp(tmp_data, tmp_rslt, base_size)){
+            printf("TEST [%s] failed, clone(%d) data mismatch\n", __FUNCTION__, cnt);
+            fs_umount();
+            return;
+        }
+    }
+
+    //the last owner of a block frees it
+    fs_delete("base.dat");
+    for(int cnt = 0; cnt < clone_cnt; ++cnt){
+        sprintf(filename, "clone%d", cnt);
+        fs_delete(filename);
+    }
+    fs_create("test.dat");
+    fd = fs_open("test.dat");
+    for(int idx = 0; idx < TEST_DISK_DATA_BLOCK_NUM/2-2; ++idx){
+        if(TEST_LONG_READ != fs_write(fd, tmp_data, TEST_LONG_READ)){
+            printf("TEST [%s] failed, blocks leaked\n", __FUNCTION__);
+            fs_umount();
+            return;
+        }
+    }
+
+    fs_close(fd);
+    fs_umount();
+    printf("TEST [%s] passed, clones cnt(%d)\n", __FUNCTION__, clone_cnt);
+}
+
+void my_test_snapshot(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    fs_mount(diskname);
+    fs_create("chain.dat");
+    int fd = fs_open("chain.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_create("sparse.dat");
+    fd = fs_open("sparse.dat");
+    fs_lseek(fd, TEST_BIG_FILE_SIZE);
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    if(0 != fs_snapshot_create()){
+        printf("TEST [%s] failed, snapshot failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    //overwrite, shrink, delete and create, over and over: blocks freed since
+    //the snapshot come back every round
+    for(int round = 0; round < TEST_DISK_DATA_BLOCK_NUM/5; ++round){
+        fd = fs_open("chain.dat");
+        fs_lseek(fd, TEST_BIG_OFFSET);
+        fs_write(fd, "CHANGED", 7);
+        fs_truncate(fd, TEST_BIG_OFFSET+100);
+        fs_close(fd);
+        fd = fs_open("sparse.dat");
+        fs_write(fd, tmp_data, TEST_LONG_READ);
+        fs_close(fd);
+        fs_delete("sparse.dat");
+        fs_create("new.dat");
+        fd = fs_open("new.dat");
+        fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+        fs_close(fd);
+        fs_umount();
+
+        fs_mount(diskname);
+        if(0 != fs_snapshot_restore()){
+            printf("TEST [%s] failed, restore(%d) failed\n", __FUNCTION__, round);
+            fs_umount();
+            return;
+        }
+    }
+    fs_umount();
+
+    fs_mount(diskname);
+    if(-1 != fs_open("new.dat")){
+        printf("TEST [%s] failed, file created after the snapshot is back\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    fd = fs_open("chain.dat");
+    fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    if( (TEST_BIG_FILE_SIZE != fs_stat(fd))||(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, chained file mismatch\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    fs_close(fd);
+    fd = fs_open("sparse.dat");
+    fs_lseek(fd, TEST_BIG_FILE_SIZE);
+    fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    if( (TEST_BIG_FILE_SIZE*2 != fs_stat(fd))||(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, sparse file mismatch\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_close(fd);
+    fs_umount();
+    printf("TEST [%s] passed, rounds cnt(%d)\n", __FUNCTION__, TEST_DISK_DATA_BLOCK_NUM/5);
+}
+
+void my_test_journal(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+    char crash_name[200] = "";
+    sprintf(crash_name, "%s.crash", diskname);
+
+    //commit every operation
+    fs_set_option(FS_OPT_JOURNAL, 64);
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 0);
+    fs_mount(diskname);
+    fs_set_option(FS_OPT_JOURNAL, 0);
+    fs_create("gone.dat");
+    fs_create("test.dat");
+    int fd = fs_open("test.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_delete("gone.dat");
+
+    //crash: the image as it is before the metadata goes home
+    struct stat st;
+    stat(diskname, &st);
+    int img_fd = open(diskname, O_RDONLY);
+    char* img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, img_fd, 0);
+    close(img_fd);
+    int crash_fd = open(crash_name, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if(st.st_size != write(crash_fd, img, st.st_size)){
+        printf("TEST [%s] failed, cannot copy the image\n", __FUNCTION__);
+    }
+    close(crash_fd);
+    munmap(img, st.st_size);
+    fs_umount();
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 5);
+
+    if(0 != fs_mount(crash_name)){
+        printf("TEST [%s] failed, replay failed\n", __FUNCTION__);
+        delete_fs(crash_name);
+        return;
+    }
+    if(-1 != fs_open("gone.dat")){
+        printf("TEST [%s] failed, deleted file is back\n", __FUNCTION__);
+        fs_umount();
+        delete_fs(crash_name);
+        return;
+    }
+    fd = fs_open("test.dat");
+    fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    if( (TEST_BIG_FILE_SIZE != fs_stat(fd))||(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, file mismatch after replay\n", __FUNCTION__);
+        fs_umount();
+        delete_fs(crash_name);
+        return;
+    }
+
+    fs_close(fd);
+    fs_umount();
+    delete_fs(crash_name);
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_journalCrash(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    //the process dies with a clone committed, never unmounting
+    struct fs_format_opts opts = { .journal_block_num = 64 };
+    fs_format(diskname, TEST_DISK_DATA_BLOCK_NUM, &opts);
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 0);
+    pid_t pid = fork();
+    if(0 == pid){
+        fs_mount(diskname);
+        fs_create("a");
+        int fd = fs_open("a");
+        fs_write(fd, tmp_data, 4096*2);
+        fs_close(fd);
+        fs_clone("a", "b");
+        fs_create("c");
+        fs_create("d");
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 5);
+
+    if(0 != fs_mount(diskname)){
+        printf("TEST [%s] failed, replay failed\n", __FUNCTION__);
+        return;
+    }
+    int fd = fs_open("b");
+    int read_len = fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_umount();
+    if( (4096*2 != read_len)||(0 != memcmp(tmp_data, tmp_rslt, 4096*2)) ){
+        printf("TEST [%s] failed, clone mismatch after replay, read(%d)\n", __FUNCTION__, read_len);
+        return;
+    }
+
+    struct fs_fsck_report report;
+    if(0 != fs_fsck(diskname, 0, 0, &report)){
+        printf("TEST [%s] failed, fsck found errors\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_journalReuse(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    const char* copyname = "my_test_copy.fs";
+    char tmp_data[4096*2] = {0};
+    char tmp_rslt[4096*2] = {0};
+    for(int idx = 0; idx < 4096*2; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    //a is committed, its delete is not: its blocks must not hold b yet
+    struct fs_format_opts opts = { .journal_block_num = 64 };
+    fs_format(diskname, TEST_DISK_DATA_BLOCK_NUM, &opts);
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 100000);
+    fs_mount(diskname);
+    fs_create("a");
+    int fd = fs_open("a");
+    fs_write(fd, tmp_data, sizeof(tmp_data));
+    fs_close(fd);
+    fs_sync();
+    fs_delete("a");
+    fs_create("b");
+    fd = fs_open("b");
+    memset(tmp_rslt, 'z', sizeof(tmp_rslt));
+    fs_write(fd, tmp_rslt, sizeof(tmp_rslt));
+    fs_close(fd);
+    copy_fs(diskname, copyname);
+    fs_umount();
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 5);
+
+    if(0 != fs_mount(copyname)){
+        printf("TEST [%s] failed, replay failed\n", __FUNCTION__);
+        delete_fs(copyname);
+        return;
+    }
+    memset(tmp_rslt, 0, sizeof(tmp_rslt));
+    fd = fs_open("a");
+    int read_len = fs_read(fd, tmp_rslt, sizeof(tmp_rslt));
+    fs_close(fd);
+    fs_umount();
+    if( ((int)sizeof(tmp_data) != read_len)||(0 != memcmp(tmp_data, tmp_rslt, sizeof(tmp_data))) ){
+        printf("TEST [%s] failed, committed file overwritten, read(%d)\n", __FUNCTION__, read_len);
+        delete_fs(copyname);
+        return;
+    }
+
+    struct fs_fsck_report report;
+    int fsck_ret = fs_fsck(copyname, 0, 0, &report);
+    delete_fs(copyname);
+    if(0 != fsck_ret){
+        printf("TEST [%s] failed, fsck found errors\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_journalIdle(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    const char* copyname = "my_test_copy.fs";
+    char tmp_data[4096*2] = {0};
+    char tmp_rslt[4096*2] = {0};
+    for(int idx = 0; idx < 4096*2; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    //the write is within the interval of the create, nothing follows it
+    struct fs_format_opts opts = { .journal_block_num = 64 };
+    fs_format(diskname, TEST_DISK_DATA_BLOCK_NUM, &opts);
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 50);
+    fs_mount(diskname);
+    fs_create("a");
+    int fd = fs_open("a");
+    fs_write(fd, tmp_data, sizeof(tmp_data));
+    fs_close(fd);
+    usleep(300*1000);
+    copy_fs(diskname, copyname);
+    fs_umount();
+    fs_set_option(FS_OPT_COMMIT_INTERVAL, 5);
+
+    if(0 != fs_mount(copyname)){
+        printf("TEST [%s] failed, replay failed\n", __FUNCTION__);
+        delete_fs(copyname);
+        return;
+    }
+    fd = fs_open("a");
+    int read_len = fs_read(fd, tmp_rslt, sizeof(tmp_rslt));
+    fs_close(fd);
+    fs_umount();
+    delete_fs(copyname);
+    if( ((int)sizeof(tmp_data) != read_len)||(0 != memcmp(tmp_data, tmp_rslt, sizeof(tmp_data))) ){
+        printf("TEST [%s] failed, last write not committed, read(%d)\n", __FUNCTION__, read_len);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_batch(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char old_name[FS_FILENAME_LEN] = "";
+    char new_name[FS_FILENAME_LEN] = "";
+    fs_mount(diskname);
+    fs_create("old.dat");
+
+    //fill the root dir in one go: files are created, renamed and resized
+    //within the batch, the entry of a deleted file is taken again
+    fs_batch_begin();
+    fs_batch_delete("old.dat");
+    for(int idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        sprintf(old_name, "tmp%d", idx);
+        sprintf(new_name, "file%d", idx);
+        fs_batch_create(old_name);
+        fs_batch_rename(old_name, new_name);
+        fs_batch_truncate(new_name, idx);
+    }
+    if(0 != fs_batch_commit()){
+        printf("TEST [%s] failed, commit failed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    fs_umount();
+
+    //one bad operation and nothing is applied
+    fs_mount(diskname);
+    fs_batch_begin();
+    fs_batch_delete("file1");
+    fs_batch_truncate("file2", 1000);
+    fs_batch_create("file3");
+    if(-1 != fs_batch_commit()){
+        printf("TEST [%s] failed, bad batch committed\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+    for(int idx = 0; idx < FS_FILE_MAX_COUNT; ++idx){
+        sprintf(new_name, "file%d", idx);
+        int fd = fs_open(new_name);
+        if( (-1 == fd)||(idx != fs_stat(fd)) ){
+            printf("TEST [%s] failed, file(%s) mismatch\n", __FUNCTION__, new_name);
+            fs_umount();
+            return;
+        }
+        fs_close(fd);
+    }
+    if(-1 != fs_open("old.dat")){
+        printf("TEST [%s] failed, deleted file is back\n", __FUNCTION__);
+        fs_umount();
+        return;
+    }
+
+    fs_umount();
+    printf("TEST [%s] passed, files cnt(%d)\n", __FUNCTION__, FS_FILE_MAX_COUNT);
+}
+
+void my_test_defrag(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    //interleave the blocks of two files
+    fs_mount(diskname);
+    fs_create("even.dat");
+    fs_create("odd.dat");
+    int fd_even = fs_open("even.dat");
+    int fd_odd = fs_open("odd.dat");
+    for(int pos = 0; pos < TEST_BIG_FILE_SIZE; pos += 4096){
+        fs_write(fd_even, tmp_data+pos, 4096);
+        fs_write(fd_odd, tmp_data+pos, 4096);
+    }
+    fs_close(fd_even);
+    fs_close(fd_odd);
+
+    //one block at a time, so one file per call
+    struct fs_defrag_stats stats = {0};
+    int call_cnt = 0;
+    int ret = 1;
+    size_t frags_before = 0;
+    while( (1 == ret)&&(call_cnt < 10) ){
+        ret = fs_defrag(1, &stats);
+        if(0 == call_cnt++){
+            frags_before = stats.frags_before;
+        }
+    }
+    if( (0 != ret)||(2*TEST_BIG_FILE_SIZE/4096 != frags_before)||(2 != stats.frags_after) ){
+        printf("TEST [%s] failed, ret(%d) fragments(%zu -> %zu)\n", __FUNCTION__,
+            ret, frags_before, stats.frags_after);
+        fs_umount();
+        return;
+    }
+    fs_umount();
+
+    fs_mount(diskname);
+    for(int idx = 0; idx < 2; ++idx){
+        int fd = fs_open((0 == idx)?"even.dat":"odd.dat");
+        fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+        fs_close(fd);
+        if(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)){
+            printf("TEST [%s] failed, file(%d) mismatch\n", __FUNCTION__, idx);
+            fs_umount();
+            return;
+        }
+    }
+
+    fs_umount();
+    printf("TEST [%s] passed, fragments(%zu -> %zu), calls cnt(%d)\n", __FUNCTION__,
+        frags_before, stats.frags_after, call_cnt);
+}
+
+void my_test_layoutReport(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char report[4096] = {0};
+    char report_name[200] = "";
+    sprintf(report_name, "%s.report", diskname);
+
+    //interleave the blocks of two files
+    fs_mount(diskname);
+    fs_create("even.dat");
+    fs_create("odd.dat");
+    int fd_even = fs_open("even.dat");
+    int fd_odd = fs_open("odd.dat");
+    for(int pos = 0; pos < TEST_BIG_FILE_SIZE; pos += 4096){
+        fs_write(fd_even, tmp_data+pos, 4096);
+        fs_write(fd_odd, tmp_data+pos, 4096);
+    }
+    fs_close(fd_even);
+    fs_close(fd_odd);
+
+    //catch the report
+    fflush(stdout);
+    int stdout_fd = dup(STDOUT_FILENO);
+    int report_fd = open(report_name, O_RDWR|O_CREAT|O_TRUNC, 0644);
+    dup2(report_fd, STDOUT_FILENO);
+    fs_layout_report();
+    fflush(stdout);
+    dup2(stdout_fd, STDOUT_FILENO);
+    close(stdout_fd);
+    lseek(report_fd, 0, SEEK_SET);
+    if(read(report_fd, report, sizeof(report)-1) <= 0){
+        printf("TEST [%s] failed, no report\n", __FUNCTION__);
+    }
+    close(report_fd);
+    delete_fs(report_name);
+    fs_umount();
+
+    //every block of a file is a separate extent, one block apart
+    const char* expects[] = {
+        "file: name=even.dat, chain=5, blocks=5, extents=5, avg_extent=1.00, seek=4\n",
+        "file: name=odd.dat, chain=5, blocks=5, extents=5, avg_extent=1.00, seek=4\n",
+        "free: blocks=189, extents=1, avg_extent=189.00\n",
+        "free_hist: min=128, max=255, extents=1\n",
+    };
+    for(int idx = 0; idx < sizeof(expects)/sizeof(expects[0]); ++idx){
+        if(NULL == strstr(report, expects[idx])){
+            printf("TEST [%s] failed, no line: %s", __FUNCTION__, expects[idx]);
+            return;
+        }
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_resize(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    //files spread over the disk with gaps, one with holes, one clone
+    fs_mount(diskname);
+    for(int idx = 0; idx < 6; ++idx){
+        char filename[FS_FILENAME_LEN] = "";
+        sprintf(filename, "file%d", idx);
+        fs_create(filename);
+        int fd = fs_open(filename);
+        if(3 == idx){
+            fs_lseek(fd, TEST_BIG_FILE_SIZE);
+        }
+        fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+        fs_close(fd);
+    }
+    fs_delete("file0");
+    fs_delete("file2");
+    fs_clone("file3", "clone3");
+    fs_umount();
+
+    struct stat st_before;
+    stat(diskname, &st_before);
+    if(0 != fs_resize(diskname, 0)){
+        printf("TEST [%s] failed, compaction failed\n", __FUNCTION__);
+        return;
+    }
+    struct stat st_after;
+    stat(diskname, &st_after);
+
+    //compact, then grow, the files stay the same
+    const char* filenames[] = {"file1", "file3", "file4", "file5", "clone3"};
+    for(int round = 0; round < 2; ++round){
+        if( (1 == round)&&(0 != fs_resize(diskname, TEST_DISK_DATA_BLOCK_NUM*2)) ){
+            printf("TEST [%s] failed, grow failed\n", __FUNCTION__);
+            return;
+        }
+
+        fs_mount(diskname);
+        for(int idx = 0; idx < sizeof(filenames)/sizeof(filenames[0]); ++idx){
+            int fd = fs_open(filenames[idx]);
+            if('3' == filenames[idx][strlen(filenames[idx])-1]){
+                fs_lseek(fd, TEST_BIG_FILE_SIZE);
+            }
+            fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+            fs_close(fd);
+            if(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)){
+                printf("TEST [%s] failed, round(%d) file(%s) mismatch\n", __FUNCTION__,
+                    round, filenames[idx]);
+                fs_umount();
+                return;
+            }
+        }
+        //room to write after growing
+        if( (1 == round)&&(0 != fs_copy("file1", "more")) ){
+            printf("TEST [%s] failed, no room after grow\n", __FUNCTION__);
+            fs_umount();
+            return;
+        }
+        fs_umount();
+    }
+
+    printf("TEST [%s] passed, image size(%ld -> %ld)\n", __FUNCTION__,
+        (long)st_before.st_size, (long)st_after.st_size);
+}
+
+void my_test_format(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    memset(tmp_data, 'f', TEST_BIG_FILE_SIZE);
+
+    //a big image costs its metadata only
+    struct fs_format_opts opts = { .block_size = 65536 };
+    if(0 != fs_format(diskname, 60000, &opts)){
+        printf("TEST [%s] failed, big format failed\n", __FUNCTION__);
+        return;
+    }
+    struct stat st;
+    stat(diskname, &st);
+    if((off_t)st.st_blocks*512 > 4*65536){
+        printf("TEST [%s] failed, image not sparse, %ld bytes used\n", __FUNCTION__,
+            (long)st.st_blocks*512);
+        return;
+    }
+
+    //formatted with a journal
+    struct fs_format_opts journal_opts = { .journal_block_num = 16 };
+    if( (0 != fs_format(diskname, TEST_DISK_DATA_BLOCK_NUM, &journal_opts))||(0 != fs_mount(diskname)) ){
+        printf("TEST [%s] failed, journal format failed\n", __FUNCTION__);
+        return;
+    }
+    fs_create("test.dat");
+    int fd = fs_open("test.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_umount();
+
+    fs_mount(diskname);
+    fd = fs_open("test.dat");
+    fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_umount();
+    if(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)){
+        printf("TEST [%s] failed, file mismatch\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed, big image(%ld MiB)\n", __FUNCTION__, (long)(st.st_size >> 20));
+}
+
+void my_test_fsck(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    //a, b and d hold blocks 1-3, 4-6 and 8-9, c holds block 7
+    const char* filenames[] = {"a", "b", "c", "d"};
+    const int block_nums[] = {3, 3, 1, 2};
+    fs_mount(diskname);
+    for(int idx = 0; idx < 4; ++idx){
+        fs_create(filenames[idx]);
+        int fd = fs_open(filenames[idx]);
+        fs_write(fd, tmp_data, 4096*block_nums[idx]);
+        fs_close(fd);
+    }
+    fs_umount();
+
+    struct fs_fsck_report report;
+    if(0 != fs_fsck(diskname, 0, 4, &report)){
+        printf("TEST [%s] failed, clean image has errors\n", __FUNCTION__);
+        return;
+    }
+
+    //a check alone leaves the image as it is, whatever the options
+    struct stat st;
+    stat(diskname, &st);
+    char* before = (char*)malloc(st.st_size);
+    char* after = (char*)malloc(st.st_size);
+    int img_fd = open(diskname, O_RDONLY);
+    ssize_t before_len = read(img_fd, before, st.st_size);
+    close(img_fd);
+    fs_set_option(FS_OPT_CHECKSUM, 1);
+    fs_set_option(FS_OPT_JOURNAL, 16);
+    fs_fsck(diskname, 0, 4, &report);
+    fs_set_option(FS_OPT_CHECKSUM, 0);
+    fs_set_option(FS_OPT_JOURNAL, 0);
+    img_fd = open(diskname, O_RDONLY);
+    ssize_t after_len = read(img_fd, after, st.st_size);
+    close(img_fd);
+    int same = (before_len == after_len)&&(0 == memcmp(before, after, st.st_size));
+    free(before);
+    free(after);
+    if(0 == same){
+        printf("TEST [%s] failed, check changed the image\n", __FUNCTION__);
+        return;
+    }
+
+    //the FAT is block 1 and the root dir block 2 of the image
+    img_fd = open(diskname, O_RDWR);
+    char* img = mmap(NULL, 4096*3, PROT_READ|PROT_WRITE, MAP_SHARED, img_fd, 0);
+    close(img_fd);
+    uint16_t* fat = (uint16_t*)(img+4096);
+    fat[50] = 0xFFFF;                       //leak
+    fat[5] = 2;                             //b runs into a, block 6 leaks
+    *(uint32_t*)(img+8192+32*2+16) = 4096*3; //c larger than its chain
+    fat[9] = 8;                             //d loops
+    fat[60] = 300;                          //out of the disk, and a leak
+    munmap(img, 4096*3);
+
+    if( (1 != fs_fsck(diskname, 0, 4, &report))||(1 != report.bad_chains)||(1 != report.bad_sizes)
+        ||(2 != report.cross_links)||(3 != report.leaks)||(1 != report.bad_entries) ){
+        printf("TEST [%s] failed, check found chains(%zu) sizes(%zu) cross(%zu) leaks(%zu) entries(%zu)\n",
+            __FUNCTION__, report.bad_chains, report.bad_sizes, report.cross_links, report.leaks,
+            report.bad_entries);
+        return;
+    }
+    int repair_ret = fs_fsck(diskname, 1, 0, &report);
+    size_t repaired = report.repaired;
+    if( (1 != repair_ret)||(0 == repaired)||(0 != fs_fsck(diskname, 0, 1, &report)) ){
+        printf("TEST [%s] failed, repair left errors\n", __FUNCTION__);
+        return;
+    }
+
+    //a is intact, b and c are cut to their own blocks, the leaks are free
+    fs_mount(diskname);
+    int fd = fs_open("a");
+    int read_len = fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fd = fs_open("b");
+    int b_size = fs_stat(fd);
+    fs_close(fd);
+    fd = fs_open("c");
+    int c_size = fs_stat(fd);
+    fs_close(fd);
+    fs_delete("a");
+    fs_delete("b");
+    fs_delete("c");
+    fs_delete("d");
+    fs_create("full");
+    fd = fs_open("full");
+    char block[4096] = {0};
+    int write_num = 0;
+    while(4096 == fs_write(fd, block, 4096)){
+        write_num++;
+    }
+    fs_close(fd);
+    fs_umount();
+    if( (4096*3 != read_len)||(0 != memcmp(tmp_data, tmp_rslt, read_len))
+        ||(4096*2 != b_size)||(4096 != c_size)||(TEST_DISK_DATA_BLOCK_NUM-1 != write_num) ){
+        printf("TEST [%s] failed, read(%d) b(%d) c(%d) blocks(%d)\n", __FUNCTION__,
+            read_len, b_size, c_size, write_num);
+        return;
+    }
+
+    printf("TEST [%s] passed, repaired(%zu)\n", __FUNCTION__, repaired);
+}
+
+void my_test_checksum(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    const char marker[] = "second block";
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+    memcpy(tmp_data+4096, marker, sizeof(marker));
+
+    //the table comes with the first mount, reserved blocks get checksums too
+    fs_set_option(FS_OPT_CHECKSUM, 1);
+    fs_mount(diskname);
+    fs_set_option(FS_OPT_CHECKSUM, 0);
+    fs_create("test.dat");
+    int fd = fs_open("test.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_create("reserved.dat");
+    fd = fs_open("reserved.dat");
+    fs_fallocate(fd, 4096*3);
+    fs_close(fd);
+    fs_umount();
+
+    struct fs_fsck_report report;
+    if( (0 != fs_fsck(diskname, 0, 0, &report))||(0 != report.bad_checksums) ){
+        printf("TEST [%s] failed, clean image has bad checksums(%zu)\n", __FUNCTION__, report.bad_checksums);
+        return;
+    }
+
+    //one byte of the second block flips on disk
+    struct stat st;
+    stat(diskname, &st);
+    int img_fd = open(diskname, O_RDWR);
+    char* img = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, img_fd, 0);
+    close(img_fd);
+    char* pos = NULL;
+    for(off_t off = 0; (NULL == pos)&&(off+4096 <= st.st_size); off += 4096){
+        pos = (0 == memcmp(img+off, marker, sizeof(marker)))?(img+off):NULL;
+    }
+    if(NULL != pos){
+        pos[100] ^= 0x01;
+    }
+    munmap(img, st.st_size);
+
+    fs_mount(diskname);
+    fd = fs_open("test.dat");
+    int read_len = fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    fs_lseek(fd, 4096);
+    int bad_len = fs_read(fd, tmp_rslt, 10);
+    fs_close(fd);
+    fs_umount();
+    if( (NULL == pos)||(4096 != read_len)||(-1 != bad_len) ){
+        printf("TEST [%s] failed, corrupted block read, read(%d) bad(%d)\n", __FUNCTION__, read_len, bad_len);
+        return;
+    }
+    if( (1 != fs_fsck(diskname, 0, 0, &report))||(1 != report.bad_checksums) ){
+        printf("TEST [%s] failed, fsck found bad checksums(%zu)\n", __FUNCTION__, report.bad_checksums);
+        return;
+    }
+
+    //written again, the block is good
+    fs_mount(diskname);
+    fd = fs_open("test.dat");
+    fs_write(fd, tmp_data, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_umount();
+    fs_mount(diskname);
+    fd = fs_open("test.dat");
+    read_len = fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+    fs_close(fd);
+    fs_umount();
+    if( (TEST_BIG_FILE_SIZE != read_len)||(0 != memcmp(tmp_data, tmp_rslt, TEST_BIG_FILE_SIZE)) ){
+        printf("TEST [%s] failed, rewritten block read(%d)\n", __FUNCTION__, read_len);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_compress(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    //a log compresses well, random bytes do not
+    const int log_size = 4096*16;
+    const int rand_size = 4096*3+100;
+    char* log_data = malloc(log_size);
+    char* rand_data = malloc(rand_size);
+    char* tmp_rslt = malloc(log_size);
+    for(int idx = 0; idx < log_size; idx += 64){
+        char line[64];
+        int len = snprintf(line, sizeof(line), "%08d INFO request served in %4d us", idx/64, idx%997);
+        memset(log_data+idx, ' ', 64);
+        memcpy(log_data+idx, line, len);
+        log_data[idx+63] = '\n';
+    }
+    uint32_t seed = 12345;
+    for(int idx = 0; idx < rand_size; ++idx){
+        seed = seed*1103515245+12345;
+        rand_data[idx] = seed >> 16;
+    }
+
+    fs_mount(diskname);
+    fs_create("log.txt");
+    fs_create("rand.dat");
+    fs_set_compressed("log.txt", 1);
+    fs_set_compressed("rand.dat", 1);
+    int fd = fs_open("log.txt");
+    for(int idx = 0; idx < log_size; idx += 1000){
+        fs_write(fd, log_data+idx, (log_size-idx < 1000)?(log_size-idx):1000);
+    }
+    fs_close(fd);
+    fd = fs_open("rand.dat");
+    fs_write(fd, rand_data, rand_size);
+    fs_close(fd);
+    fs_umount();
+
+    //overwritten in the middle, cut, copied and cloned
+    fs_mount(diskname);
+    fd = fs_open("log.txt");
+    fs_lseek(fd, 4096*5);
+    fs_write(fd, "OVERWRITTEN", 11);
+    memcpy(log_data+4096*5, "OVERWRITTEN", 11);
+    fs_truncate(fd, log_size-100);
+    fs_close(fd);
+    fs_copy("log.txt", "copy.txt");
+    fs_clone("rand.dat", "clone.dat");
+    fs_umount();
+
+    const char* filenames[] = {"log.txt", "copy.txt", "rand.dat", "clone.dat"};
+    for(int round = 0; round < 2; ++round){
+        fs_mount(diskname);
+        for(int idx = 0; idx < sizeof(filenames)/sizeof(filenames[0]); ++idx){
+            const char* data = (2 > idx)?log_data:rand_data;
+            int size = (2 > idx)?(log_size-100):rand_size;
+            fd = fs_open(filenames[idx]);
+            int read_len = fs_read(fd, tmp_rslt, log_size);
+            int file_size = fs_stat(fd);
+            fs_close(fd);
+            if( (size != read_len)||(size != file_size)||(0 != memcmp(data, tmp_rslt, size)) ){
+                printf("TEST [%s] failed, %s round(%d) read(%d) size(%d)\n", __FUNCTION__, filenames[idx],
+                    round, read_len, file_size);
+                fs_umount();
+                free(log_data);
+                free(rand_data);
+                free(tmp_rslt);
+                return;
+            }
+        }
+        //stored as is, the log takes its full size
+        if(0 == round){
+            fs_set_compressed("log.txt", 0);
+            fs_set_compressed("copy.txt", 0);
+        }
+        fs_umount();
+    }
+    free(log_data);
+    free(rand_data);
+    free(tmp_rslt);
+
+    struct fs_fsck_report report;
+    if(0 != fs_fsck(diskname, 0, 0, &report)){
+        printf("TEST [%s] failed, fsck found errors\n", __FUNCTION__);
+        return;
+    }
+
+    //both logs compressed again, the compacted image shrinks
+    struct stat st_plain;
+    struct stat st_compressed;
+    fs_resize(diskname, 0);
+    stat(diskname, &st_plain);
+    fs_resize(diskname, TEST_DISK_DATA_BLOCK_NUM);
+    fs_mount(diskname);
+    fs_set_compressed("log.txt", 1);
+    fs_set_compressed("copy.txt", 1);
+    fs_umount();
+    fs_resize(diskname, 0);
+    stat(diskname, &st_compressed);
+    if(st_compressed.st_size+4096*16 > st_plain.st_size){
+        printf("TEST [%s] failed, image size compressed(%ld) plain(%ld)\n", __FUNCTION__,
+            (long)st_compressed.st_size, (long)st_plain.st_size);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_dedup(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    //four distinct blocks and a partial one
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+(idx/4096)+idx%7;
+    }
+    const int size = 4096*4+100;
+
+    //written with dedup on, the whole blocks of the copy are shared
+    fs_set_option(FS_OPT_DEDUP, 1);
+    fs_mount(diskname);
+    const char* filenames[] = {"asset1", "asset2", "plain1", "plain2"};
+    for(int idx = 0; idx < 4; ++idx){
+        if(2 == idx){
+            fs_set_option(FS_OPT_DEDUP, 0);
+        }
+        fs_create(filenames[idx]);
+        int fd = fs_open(filenames[idx]);
+        fs_write(fd, tmp_data, size);
+        fs_close(fd);
+    }
+    //a write to a shared block copies it
+    int fd = fs_open("asset2");
+    fs_lseek(fd, 4096);
+    fs_write(fd, "changed", 7);
+    fs_close(fd);
+    fs_umount();
+
+    //then the partial block of the copy and all of the plain copies are
+    //shared offline, less a map block for each plain copy
+    struct fs_dedup_stats stats;
+    if( (0 != fs_dedup(diskname, &stats))||(11 != stats.shared)||(9 != stats.freed) ){
+        printf("TEST [%s] failed, offline scanned(%zu) shared(%zu) freed(%zu)\n", __FUNCTION__,
+            stats.scanned, stats.shared, stats.freed);
+        return;
+    }
+
+    fs_mount(diskname);
+    for(int idx = 0; idx < 4; ++idx){
+        fd = fs_open(filenames[idx]);
+        int read_len = fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+        fs_close(fd);
+        int changed = (1 == idx)&&(0 == memcmp(tmp_rslt+4096, "changed", 7));
+        if( (1 == idx)&&(0 != changed) ){
+            memcpy(tmp_rslt+4096, tmp_data+4096, 7);
+        }
+        if( (size != read_len)||(0 != memcmp(tmp_data, tmp_rslt, size))||( (1 == idx)&&(0 == changed) ) ){
+            printf("TEST [%s] failed, %s read(%d)\n", __FUNCTION__, filenames[idx], read_len);
+            fs_umount();
+            return;
+        }
+    }
+    fs_umount();
+
+    struct fs_fsck_report report;
+    if(0 != fs_fsck(diskname, 0, 0, &report)){
+        printf("TEST [%s] failed, fsck found errors\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+void my_test_pack(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char tmp_data[TEST_BIG_FILE_SIZE] = {0};
+    char tmp_rslt[TEST_BIG_FILE_SIZE] = {0};
+    for(int idx = 0; idx < TEST_BIG_FILE_SIZE; ++idx){
+        tmp_data[idx] = 'a'+idx%26;
+    }
+
+    //forty small files share a few blocks
+    const int file_num = 40;
+    const int size = 200;
+    char filename[FS_FILENAME_LEN] = "";
+    fs_set_option(FS_OPT_PACK, 1);
+    fs_mount(diskname);
+    for(int idx = 0; idx < file_num; ++idx){
+        sprintf(filename, "conf%d", idx);
+        fs_create(filename);
+        int fd = fs_open(filename);
+        fs_write(fd, tmp_data+idx, size);
+        fs_close(fd);
+    }
+    //one grows out of its slots, one is emptied
+    int fd = fs_open("conf1");
+    fs_lseek(fd, size);
+    fs_write(fd, tmp_data+1+size, 4096*2);
+    fs_close(fd);
+    fd = fs_open("conf2");
+    fs_truncate(fd, 0);
+    fs_close(fd);
+    fs_umount();
+    fs_set_option(FS_OPT_PACK, 0);
+
+    fs_mount(diskname);
+    for(int idx = 0; idx < file_num; ++idx){
+        int file_size = (1 == idx)?(size+4096*2):((2 == idx)?0:size);
+        sprintf(filename, "conf%d", idx);
+        fd = fs_open(filename);
+        int read_len = fs_read(fd, tmp_rslt, TEST_BIG_FILE_SIZE);
+        fs_close(fd);
+        if( (file_size != read_len)||(0 != memcmp(tmp_data+idx, tmp_rslt, file_size)) ){
+            printf("TEST [%s] failed, %s read(%d)\n", __FUNCTION__, filename, read_len);
+            fs_umount();
+            return;
+        }
+    }
+    fs_umount();
+
+    //the 37 small files fit in 3 blocks, with the reserved block 0, the refcount
+    //table and the 3 blocks of the grown file that makes 8 data blocks
+    struct fs_fsck_report report;
+    struct stat st;
+    fs_resize(diskname, 0);
+    stat(diskname, &st);
+    if( (0 != fs_fsck(diskname, 0, 0, &report))||(st.st_size > 4096*(1+1+1+8)) ){
+        printf("TEST [%s] failed, image size(%ld)\n", __FUNCTION__, (long)st.st_size);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+//same operations on two images, with and without vector scans
+static void _fat_scan_run(const char* diskname, int simd)
+{
+    char tmp_data[4096*5] = {0};
+    memset(tmp_data, 's', sizeof(tmp_data));
+
+    create_fs(diskname, TEST_DISK_DATA_BLOCK_NUM);
+    fs_set_option(FS_OPT_FAT_SIMD, simd);
+    fs_mount(diskname);
+    for(int idx = 0; idx < 60; ++idx){
+        char filename[FS_FILENAME_LEN] = "";
+        sprintf(filename, "file%d", idx);
+        fs_create(filename);
+        int fd = fs_open(filename);
+        fs_write(fd, tmp_data, 4096*(1+idx%5)-idx);
+        fs_close(fd);
+    }
+    for(int idx = 0; idx < 60; idx += 3){
+        char filename[FS_FILENAME_LEN] = "";
+        sprintf(filename, "file%d", idx);
+        fs_delete(filename);
+    }
+    fs_create("run");
+    int fd = fs_open("run");
+    fs_fallocate(fd, 4096*7);
+    fs_close(fd);
+    fs_defrag(SIZE_MAX, NULL);
+    fs_create("fill");
+    fd = fs_open("fill");
+    while(0 < fs_write(fd, tmp_data, sizeof(tmp_data)));
+    fs_close(fd);
+    fs_umount();
+    fs_set_option(FS_OPT_FAT_SIMD, 1);
+}
+
+void my_test_fatScan(const char* diskname)
+{
+    printf("TEST [%s] start\n", __FUNCTION__);
+
+    char scalar_name[100] = "";
+    sprintf(scalar_name, "%s.scalar", diskname);
+    _fat_scan_run(diskname, 1);
+    _fat_scan_run(scalar_name, 0);
+
+    int same = 0;
+    struct stat st;
+    struct stat scalar_st;
+    stat(diskname, &st);
+    stat(scalar_name, &scalar_st);
+    if(st.st_size == scalar_st.st_size){
+        int img_fd = open(diskname, O_RDONLY);
+        char* img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, img_fd, 0);
+        close(img_fd);
+        img_fd = open(scalar_name, O_RDONLY);
+        char* scalar_img = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, img_fd, 0);
+        close(img_fd);
+        same = (0 == memcmp(img, scalar_img, st.st_size));
+        munmap(img, st.st_size);
+        munmap(scalar_img, st.st_size);
+    }
+    delete_fs(scalar_name);
+
+    if(0 == same){
+        printf("TEST [%s] failed, images differ\n", __FUNCTION__);
+        return;
+    }
+
+    printf("TEST [%s] passed\n", __FUNCTION__);
+}
+
+int main(int argc, char **argv)
+{
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_bigFile_WR(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_longOffset_WR(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_fullFiles(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    my_test_blockSizes(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_manyOpenedFiles(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_sharedOpenFile(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_smallWrites(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_append(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_appendThreads(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_fallocate(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_truncate(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_sparse(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_scrub(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_copy(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_clone(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_snapshot(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_journal(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    my_test_journalCrash(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    my_test_journalReuse(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    my_test_journalIdle(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_batch(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_defrag(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_layoutReport(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_resize(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    my_test_format(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_fsck(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    my_test_fatScan(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_checksum(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_compress(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_dedup(TEST_DISK_NAME);
+    delete_fs(TEST_DISK_NAME);
+
+    create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
+    my_test_pack(TEST_DISK_NAME);
     delete_fs(TEST_DISK_NAME);
 
     create_fs(TEST_DISK_NAME, TEST_DISK_DATA_BLOCK_NUM);
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -244,6 +245,25 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_layout(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_layout_report();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -271,6 +291,122 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_resize(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t data_block_num = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<data blocks>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		data_block_num = get_argv(t_arg->argv[1]);
+
+	if (fs_resize(diskname, data_block_num))
+		die("Cannot resize diskname");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_info();
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	size_t max_blocks = SIZE_MAX;
+	struct fs_defrag_stats stats;
+	size_t frags_before, moved = 0;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<blocks per pass>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		max_blocks = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Pass after pass, each one moving about max_blocks blocks */
+	ret = fs_defrag(max_blocks, &stats);
+	frags_before = stats.frags_before;
+	moved += stats.blocks_moved;
+	while (ret == 1 && stats.blocks_moved) {
+		ret = fs_defrag(max_blocks, &stats);
+		moved += stats.blocks_moved;
+	}
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot defragment");
+	}
+
+	printf("Defragmented: fragments %zu -> %zu, blocks moved %zu\n",
+	       frags_before, stats.frags_after, moved);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_fsck(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int repair = 0;
+	size_t thread_num = 0;
+	struct fs_fsck_report report;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [repair [<threads>]]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		repair = !strcmp(t_arg->argv[1], "repair");
+	if (t_arg->argc > 2)
+		thread_num = get_argv(t_arg->argv[2]);
+
+	ret = fs_fsck(diskname, repair, thread_num, &report);
+	if (ret < 0)
+		die("Cannot check diskname");
+
+	printf("FS Check:\n");
+	printf("bad_chains=%zu\n", report.bad_chains);
+	printf("bad_sizes=%zu\n", report.bad_sizes);
+	printf("cross_links=%zu\n", report.cross_links);
+	printf("leaks=%zu\n", report.leaks);
+	printf("bad_refcnts=%zu\n", report.bad_refcnts);
+	printf("bad_entries=%zu\n", report.bad_entries);
+	printf("bad_checksums=%zu\n", report.bad_checksums);
+	if (repair)
+		printf("repaired=%zu\n", report.repaired);
+	printf("%s\n", ret ? "errors" : "clean");
+}
+
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dedup_stats stats;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	if (fs_dedup(t_arg->argv[0], &stats))
+		die("Cannot dedup diskname");
+
+	printf("FS Dedup:\n");
+	printf("scanned=%zu\n", stats.scanned);
+	printf("shared=%zu\n", stats.shared);
+	printf("freed=%zu\n", stats.freed);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -280,7 +416,12 @@ static struct {
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
-	{ "stat",	thread_fs_stat }
+	{ "stat",	thread_fs_stat },
+	{ "defrag",	thread_fs_defrag },
+	{ "layout",	thread_fs_layout },
+	{ "resize",	thread_fs_resize },
+	{ "fsck",	thread_fs_fsck },
+	{ "dedup",	thread_fs_dedup }
 };
 
 void usage(char *program)